@@ -18,11 +18,14 @@
 
 #include <Rcpp.h>
 #include <cmath>
+#include <algorithm>
+#include <utility>
 #include "MTNormalizationMeanSpectra.h"
 using namespace Rcpp;
 
-MTNormalizationMeanSpectra::MTNormalizationMeanSpectra(Rcpp::List rMSIObj_list, int numberOfThreads, double memoryPerThreadMB, Rcpp::NumericVector commonMassAxis) : 
-  ThreadingMsiProc(rMSIObj_list, numberOfThreads, memoryPerThreadMB, commonMassAxis), 
+MTNormalizationMeanSpectra::MTNormalizationMeanSpectra(Rcpp::List rMSIObj_list, int numberOfThreads, double memoryPerThreadMB, Rcpp::NumericVector commonMassAxis, bool computeOverallAverage, bool float32DataCubes) : 
+  ThreadingMsiProc(rMSIObj_list, numberOfThreads, memoryPerThreadMB, commonMassAxis, DataCubeIOMode::DATA_READ, Rcpp::StringVector(), "", Rcpp::StringVector(), float32DataCubes), 
+  bOverallAverage(computeOverallAverage),
   rMSIObj_lst(rMSIObj_list)
 {
   averageSpectrum.resize(rMSIObj_lst.length());
@@ -80,11 +83,94 @@ List MTNormalizationMeanSpectra::Run()
   return rMSIObj_lst; 
 }
 
+NumericVector MTNormalizationMeanSpectra::OverallAverage()
+{
+  if(!bOverallAverage)
+  {
+    throw std::runtime_error("ERROR: MTNormalizationMeanSpectra overall average was not enabled.\n");
+  }
+  
+  //Get the 25% and 75% quantiles of TIC norms using the same method as the R quantile() default (type 7)
+  std::vector<double> allTICs;
+  for( int i = 0; i < rMSIObj_lst.length(); i++)
+  {
+    for( unsigned int j = 0; j < num_of_pixels[i]; j++)
+    {
+      allTICs.push_back(Normalizations[i][j].TIC);
+    }
+  }
+  std::sort(allTICs.begin(), allTICs.end());
+  double ticQuantiles[2];
+  const double probs[2] = {0.25, 0.75};
+  for( int i = 0; i < 2; i++)
+  {
+    double h = (allTICs.size() - 1) * probs[i];
+    unsigned int hlow = (unsigned int)floor(h);
+    unsigned int hhigh = hlow + 1 < allTICs.size() ? hlow + 1 : hlow; 
+    ticQuantiles[i] = allTICs[hlow] + (h - hlow)*(allTICs[hhigh] - allTICs[hlow]);
+  }
+  
+  //Use the buckets that overlap the TIC range by at least half a bucket or that contain the whole range
+  NumericVector AverageSpectrum(massAxis.length());
+  unsigned int pixelCount = 0;
+  for( std::map<int, TicBucket>::iterator it = ticBuckets.begin(); it != ticBuckets.end(); ++it)
+  {
+    double ticLow = pow(2.0, ((double)it->first)/TIC_BUCKETS_PER_OCTAVE);
+    double ticHigh = pow(2.0, ((double)(it->first + 1))/TIC_BUCKETS_PER_OCTAVE);
+    double ticCenter = pow(2.0, ((double)it->first + 0.5)/TIC_BUCKETS_PER_OCTAVE);
+    if( (ticCenter >= ticQuantiles[0] && ticCenter <= ticQuantiles[1]) || (ticLow <= ticQuantiles[0] && ticHigh > ticQuantiles[1]) )
+    {
+      for( int k = 0; k < massAxis.length(); k++)
+      {
+        AverageSpectrum[k] += it->second.spectrum[k];
+      }
+      pixelCount += it->second.pixelCount;
+    }
+  }
+  
+  if(pixelCount > 0)
+  {
+    for( int k = 0; k < massAxis.length(); k++)
+    {
+      AverageSpectrum[k] /= (double)pixelCount;
+    }
+  }
+  
+  return AverageSpectrum;
+}
+
+
+template<typename T> MTNormalizationMeanSpectra::PixelNorms MTNormalizationMeanSpectra::AccumulateSpectrum(const T *spectrum, int ncols, double numPixels, double *average, double *base)
+{
+  PixelNorms norms;
+  norms.TIC = 0.0;
+  norms.RMS = 0.0;
+  norms.MAX = 0.0;
+  for (int k= 0; k < ncols; k++)
+  {
+    double x = spectrum[k];
+    norms.TIC += x;
+    norms.RMS += (x * x);
+    norms.MAX = x > norms.MAX ? x : norms.MAX;
+    
+    average[k] += x / numPixels;
+    base[k] = x > base[k] ? x : base[k];
+  }
+  norms.RMS = sqrt(norms.RMS);
+  return norms;
+}
+
+template<typename T> void MTNormalizationMeanSpectra::AccumulateNormalizedSpectrum(const T *spectrum, int ncols, double TIC, double *sum)
+{
+  for (int k= 0; k < ncols; k++)
+  {
+    sum[k] += spectrum[k] / TIC;
+  }
+}
 
 void MTNormalizationMeanSpectra::ProcessingFunction(int threadSlot)
 {
   //Perform the average value of each mass channel in the current loaded cube
-  double TIC, RMS, MAX;
   std::vector<std::vector<double>> thread_average(ioObj->get_images_count());
   std::vector<std::vector<double>> thread_base(ioObj->get_images_count());
   for(unsigned int i = 0; i < ioObj->get_images_count(); i++)
@@ -92,29 +178,69 @@ void MTNormalizationMeanSpectra::ProcessingFunction(int threadSlot)
     thread_average[i].resize(cubes[threadSlot]->ncols);
     thread_base[i].resize(cubes[threadSlot]->ncols);
   }
+  std::vector<std::pair<int, int>> rowBuckets; //TIC bucket and row of each spectrum in the cube
   
   for (int j = 0; j < cubes[threadSlot]->nrows; j++)
   {
-    TIC = 0.0;
-    RMS = 0.0;
-    MAX = 0.0;
     int imgID = ioObj->getImageIndex(cubes[threadSlot]->cubeID, j);
     int pixelID = ioObj->getPixelId(cubes[threadSlot]->cubeID, j);
     
-    for (int k= 0; k < cubes[threadSlot]->ncols; k++)
+    if(ioObj->get_float32DataCubes())
+    {
+      Normalizations[imgID][pixelID] = AccumulateSpectrum(cubes[threadSlot]->dataInterpolatedFloat[j], cubes[threadSlot]->ncols, (double)(num_of_pixels[imgID]),
+                                                          thread_average[imgID].data(), thread_base[imgID].data());
+    }
+    else
     {
-      TIC += cubes[threadSlot]->dataInterpolated[j][k];
-      RMS += (cubes[threadSlot]->dataInterpolated[j][k] * cubes[threadSlot]->dataInterpolated[j][k]);
-      MAX = cubes[threadSlot]->dataInterpolated[j][k] > MAX ? cubes[threadSlot]->dataInterpolated[j][k] : MAX;
-      
-      thread_average[imgID][k] += cubes[threadSlot]->dataInterpolated[j][k] / ((double)(num_of_pixels[imgID]));
-      thread_base[imgID][k] = cubes[threadSlot]->dataInterpolated[j][k] > thread_base[imgID][k] ? cubes[threadSlot]->dataInterpolated[j][k] : thread_base[imgID][k];
+      Normalizations[imgID][pixelID] = AccumulateSpectrum(cubes[threadSlot]->dataInterpolated[j], cubes[threadSlot]->ncols, (double)(num_of_pixels[imgID]),
+                                                          thread_average[imgID].data(), thread_base[imgID].data());
     }
-    RMS = sqrt(RMS);
     
-    Normalizations[imgID][pixelID].TIC = TIC;
-    Normalizations[imgID][pixelID].RMS = RMS;
-    Normalizations[imgID][pixelID].MAX = MAX;
+    //Spectra with a zero TIC can not be TIC-normalized
+    double TIC = Normalizations[imgID][pixelID].TIC;
+    if(bOverallAverage && TIC > 0.0)
+    {
+      rowBuckets.push_back(std::make_pair((int)floor(log2(TIC) * TIC_BUCKETS_PER_OCTAVE), j));
+    }
+  }
+  
+  //Accumulate the TIC-normalized spectra of each bucket and add them to the global buckets
+  std::sort(rowBuckets.begin(), rowBuckets.end());
+  std::vector<double> bucketSpectrum(bOverallAverage ? cubes[threadSlot]->ncols : 0);
+  unsigned int ibucket = 0;
+  while(ibucket < rowBuckets.size())
+  {
+    int bucket = rowBuckets[ibucket].first;
+    unsigned int bucketPixels = 0;
+    std::fill(bucketSpectrum.begin(), bucketSpectrum.end(), 0.0);
+    for( ; ibucket < rowBuckets.size() && rowBuckets[ibucket].first == bucket; ibucket++)
+    {
+      int j = rowBuckets[ibucket].second;
+      double TICval = Normalizations[ioObj->getImageIndex(cubes[threadSlot]->cubeID, j)][ioObj->getPixelId(cubes[threadSlot]->cubeID, j)].TIC;
+      if(ioObj->get_float32DataCubes())
+      {
+        AccumulateNormalizedSpectrum(cubes[threadSlot]->dataInterpolatedFloat[j], cubes[threadSlot]->ncols, TICval, bucketSpectrum.data());
+      }
+      else
+      {
+        AccumulateNormalizedSpectrum(cubes[threadSlot]->dataInterpolated[j], cubes[threadSlot]->ncols, TICval, bucketSpectrum.data());
+      }
+      bucketPixels++;
+    }
+    
+    mutex_ticBuckets.lock();
+    TicBucket &globalBucket = ticBuckets[bucket];
+    if(globalBucket.spectrum.size() == 0)
+    {
+      globalBucket.spectrum.resize(cubes[threadSlot]->ncols, 0.0);
+      globalBucket.pixelCount = 0;
+    }
+    for (int k= 0; k < cubes[threadSlot]->ncols; k++)
+    {
+      globalBucket.spectrum[k] += bucketSpectrum[k];
+    }
+    globalBucket.pixelCount += bucketPixels;
+    mutex_ticBuckets.unlock();
   }
   
   mutex_copyData.lock();
@@ -135,7 +261,8 @@ void MTNormalizationMeanSpectra::ProcessingFunction(int threadSlot)
 List CNormalizationsAndMeans(Rcpp::List rMSIObj_list, 
                                int numOfThreads, 
                                double memoryPerThreadMB,
-                               Rcpp::NumericVector commonMassAxis)
+                               Rcpp::NumericVector commonMassAxis,
+                               bool float32DataCubes = false)
 {
   List out;
   
@@ -144,7 +271,9 @@ List CNormalizationsAndMeans(Rcpp::List rMSIObj_list,
     MTNormalizationMeanSpectra myNorms(rMSIObj_list, 
                       numOfThreads, 
                       memoryPerThreadMB,
-                      commonMassAxis);
+                      commonMassAxis,
+                      false,
+                      float32DataCubes);
     out = myNorms.Run();
     }
   catch(std::runtime_error &e)
@@ -153,3 +282,33 @@ List CNormalizationsAndMeans(Rcpp::List rMSIObj_list,
   }
   return out;
 }
+
+// Calculate the normalizations, the average and base spectrum of each image and the overall average spectrum
+// of the pixels with a TIC between the 25% and 75% quantiles in a single pass over the data.
+// Returns a list with the rMSI objects in rMSIObj and the overall average spectrum in AverageSpectrum.
+// [[Rcpp::export]]
+List CNormalizationsMeansAndOverallAverage(Rcpp::List rMSIObj_list, 
+                                           int numOfThreads, 
+                                           double memoryPerThreadMB,
+                                           Rcpp::NumericVector commonMassAxis,
+                                           bool float32DataCubes = false)
+{
+  List out;
+  
+  try
+  {
+    MTNormalizationMeanSpectra myNorms(rMSIObj_list, 
+                                       numOfThreads, 
+                                       memoryPerThreadMB,
+                                       commonMassAxis,
+                                       true,
+                                       float32DataCubes);
+    List imgs = myNorms.Run();
+    out = List::create(Named("rMSIObj") = imgs, Named("AverageSpectrum") = myNorms.OverallAverage());
+  }
+  catch(std::runtime_error &e)
+  {
+    Rcpp::stop(e.what());
+  }
+  return out;
+}
@@ -20,8 +20,12 @@
   #define MT_NORMALIZATIONMEANSPECTRA_H
 #include <Rcpp.h>
 #include <vector>
+#include <map>
+#include <mutex>
 #include "threadingmsiproc.h"
 
+#define TIC_BUCKETS_PER_OCTAVE 8 //Resolution of the TIC buckets used to select the pixels of the overall average spectrum
+
 class MTNormalizationMeanSpectra : public ThreadingMsiProc 
 {
   public:
@@ -31,12 +35,19 @@ class MTNormalizationMeanSpectra : public ThreadingMsiProc
     // numberOfThreads: Total number of threads to use during processing
     // memoryPerThreadMB: Maximum memory allocated by each thread in MB. The total allocated memory will be: 2*numberOfThreads*memoryPerThreadMB
     // commonMassAxis: The common mass axis used to process and interpolate multiple datasets.
-    MTNormalizationMeanSpectra(Rcpp::List rMSIObj_list, int numberOfThreads, double memoryPerThreadMB, Rcpp::NumericVector commonMassAxis);
+    // computeOverallAverage: if true the TIC-normalized spectra are also accumulated to compute the overall average spectrum in the same pass.
+    MTNormalizationMeanSpectra(Rcpp::List rMSIObj_list, int numberOfThreads, double memoryPerThreadMB, Rcpp::NumericVector commonMassAxis, bool computeOverallAverage = false, bool float32DataCubes = false);
     ~MTNormalizationMeanSpectra();
     
     //Execute a full imatge processing using threaded methods
     Rcpp::List Run();
     
+    //Returns the average of the TIC-normalized spectra with a TIC between the 25% and 75% quantiles of all TIC values.
+    //Pixels are selected by TIC bucket, so the TIC limits are applied with a resolution of 1/TIC_BUCKETS_PER_OCTAVE octaves.
+    //It approximates COverallAverageSpectrum() with the exact quantiles, which needs another pass over the data, so it is only used on request.
+    //It must be called after Run() and only if computeOverallAverage was enabled.
+    Rcpp::NumericVector OverallAverage();
+    
   private:
     
     typedef struct
@@ -53,9 +64,26 @@ class MTNormalizationMeanSpectra : public ThreadingMsiProc
     std::vector<Rcpp::NumericVector> averageSpectrum;
     std::vector<Rcpp::NumericVector> baseSpectrum;
     
+    typedef struct
+    {
+      std::vector<double> spectrum; //Sum of the TIC-normalized spectra in the bucket
+      unsigned int pixelCount; //Number of spectra in the bucket
+    }TicBucket;
+    
+    bool bOverallAverage; //Enables the TIC bucket accumulation
+    std::map<int, TicBucket> ticBuckets; //TIC-normalized spectra accumulated by floor(log2(TIC) * TIC_BUCKETS_PER_OCTAVE)
+    std::mutex mutex_ticBuckets; //Mutex to avoid accumulating in ticBuckets from various threads simultaneously
+    
     //Thread Processing function definition
     void ProcessingFunction(int threadSlot);
     
+    //Row kernels templated on the sample type of the data cube, so float32 rows are read in place without converting them to double.
+    //The sums are accumulated in double for both sample types.
+    //Computes the normalizations of a spectrum while adding it to the average (divided by numPixels) and base spectra of its image.
+    template<typename T> PixelNorms AccumulateSpectrum(const T *spectrum, int ncols, double numPixels, double *average, double *base);
+    //Adds the TIC-normalized spectrum to sum
+    template<typename T> void AccumulateNormalizedSpectrum(const T *spectrum, int ncols, double TIC, double *sum);
+    
     Rcpp::List rMSIObj_lst; //Copy of the rMSI object
     std::vector<unsigned int> num_of_pixels; //Number of pixel in each rMSI object
 };
@@ -11,8 +11,8 @@ Rcpp::Rostream<false>& Rcpp::Rcerr = Rcpp::Rcpp_cerr_get();
 #endif
 
 // CNormalizationsAndMeans
-List CNormalizationsAndMeans(Rcpp::List rMSIObj_list, int numOfThreads, double memoryPerThreadMB, Rcpp::NumericVector commonMassAxis);
-RcppExport SEXP _rMSI2_CNormalizationsAndMeans(SEXP rMSIObj_listSEXP, SEXP numOfThreadsSEXP, SEXP memoryPerThreadMBSEXP, SEXP commonMassAxisSEXP) {
+List CNormalizationsAndMeans(Rcpp::List rMSIObj_list, int numOfThreads, double memoryPerThreadMB, Rcpp::NumericVector commonMassAxis, bool float32DataCubes);
+RcppExport SEXP _rMSI2_CNormalizationsAndMeans(SEXP rMSIObj_listSEXP, SEXP numOfThreadsSEXP, SEXP memoryPerThreadMBSEXP, SEXP commonMassAxisSEXP, SEXP float32DataCubesSEXP) {
 BEGIN_RCPP
     Rcpp::RObject rcpp_result_gen;
     Rcpp::RNGScope rcpp_rngScope_gen;
@@ -20,7 +20,23 @@ BEGIN_RCPP
     Rcpp::traits::input_parameter< int >::type numOfThreads(numOfThreadsSEXP);
     Rcpp::traits::input_parameter< double >::type memoryPerThreadMB(memoryPerThreadMBSEXP);
     Rcpp::traits::input_parameter< Rcpp::NumericVector >::type commonMassAxis(commonMassAxisSEXP);
-    rcpp_result_gen = Rcpp::wrap(CNormalizationsAndMeans(rMSIObj_list, numOfThreads, memoryPerThreadMB, commonMassAxis));
+    Rcpp::traits::input_parameter< bool >::type float32DataCubes(float32DataCubesSEXP);
+    rcpp_result_gen = Rcpp::wrap(CNormalizationsAndMeans(rMSIObj_list, numOfThreads, memoryPerThreadMB, commonMassAxis, float32DataCubes));
+    return rcpp_result_gen;
+END_RCPP
+}
+// CNormalizationsMeansAndOverallAverage
+List CNormalizationsMeansAndOverallAverage(Rcpp::List rMSIObj_list, int numOfThreads, double memoryPerThreadMB, Rcpp::NumericVector commonMassAxis, bool float32DataCubes);
+RcppExport SEXP _rMSI2_CNormalizationsMeansAndOverallAverage(SEXP rMSIObj_listSEXP, SEXP numOfThreadsSEXP, SEXP memoryPerThreadMBSEXP, SEXP commonMassAxisSEXP, SEXP float32DataCubesSEXP) {
+BEGIN_RCPP
+    Rcpp::RObject rcpp_result_gen;
+    Rcpp::RNGScope rcpp_rngScope_gen;
+    Rcpp::traits::input_parameter< Rcpp::List >::type rMSIObj_list(rMSIObj_listSEXP);
+    Rcpp::traits::input_parameter< int >::type numOfThreads(numOfThreadsSEXP);
+    Rcpp::traits::input_parameter< double >::type memoryPerThreadMB(memoryPerThreadMBSEXP);
+    Rcpp::traits::input_parameter< Rcpp::NumericVector >::type commonMassAxis(commonMassAxisSEXP);
+    Rcpp::traits::input_parameter< bool >::type float32DataCubes(float32DataCubesSEXP);
+    rcpp_result_gen = Rcpp::wrap(CNormalizationsMeansAndOverallAverage(rMSIObj_list, numOfThreads, memoryPerThreadMB, commonMassAxis, float32DataCubes));
     return rcpp_result_gen;
 END_RCPP
 }
@@ -35,6 +51,16 @@ BEGIN_RCPP
     return rcpp_result_gen;
 END_RCPP
 }
+// SetFFTWisdomFile
+void SetFFTWisdomFile(String path);
+RcppExport SEXP _rMSI2_SetFFTWisdomFile(SEXP pathSEXP) {
+BEGIN_RCPP
+    Rcpp::RNGScope rcpp_rngScope_gen;
+    Rcpp::traits::input_parameter< String >::type path(pathSEXP);
+    SetFFTWisdomFile(path);
+    return R_NilValue;
+END_RCPP
+}
 // testingimzMLBinWriteSequential
 Rcpp::DataFrame testingimzMLBinWriteSequential(const char* ibdFname, Rcpp::String mz_dataTypeString, Rcpp::String int_dataTypeString, Rcpp::String str_uuid, Rcpp::NumericMatrix mzArray, Rcpp::NumericMatrix intArray);
 RcppExport SEXP _rMSI2_testingimzMLBinWriteSequential(SEXP ibdFnameSEXP, SEXP mz_dataTypeStringSEXP, SEXP int_dataTypeStringSEXP, SEXP str_uuidSEXP, SEXP mzArraySEXP, SEXP intArraySEXP) {
@@ -51,6 +77,19 @@ BEGIN_RCPP
     return rcpp_result_gen;
 END_RCPP
 }
+// testingImzMLDataConversion
+Rcpp::NumericVector testingImzMLDataConversion(Rcpp::String dataTypeString, Rcpp::NumericVector values, int reps);
+RcppExport SEXP _rMSI2_testingImzMLDataConversion(SEXP dataTypeStringSEXP, SEXP valuesSEXP, SEXP repsSEXP) {
+BEGIN_RCPP
+    Rcpp::RObject rcpp_result_gen;
+    Rcpp::RNGScope rcpp_rngScope_gen;
+    Rcpp::traits::input_parameter< Rcpp::String >::type dataTypeString(dataTypeStringSEXP);
+    Rcpp::traits::input_parameter< Rcpp::NumericVector >::type values(valuesSEXP);
+    Rcpp::traits::input_parameter< int >::type reps(repsSEXP);
+    rcpp_result_gen = Rcpp::wrap(testingImzMLDataConversion(dataTypeString, values, reps));
+    return rcpp_result_gen;
+END_RCPP
+}
 // CimzMLBinCreateNewIBD
 void CimzMLBinCreateNewIBD(const char* ibdFname, Rcpp::String str_uuid);
 RcppExport SEXP _rMSI2_CimzMLBinCreateNewIBD(SEXP ibdFnameSEXP, SEXP str_uuidSEXP) {
@@ -234,8 +273,8 @@ BEGIN_RCPP
 END_RCPP
 }
 // COverallAverageSpectrum
-NumericVector COverallAverageSpectrum(Rcpp::List rMSIObj_list, int numOfThreads, double memoryPerThreadMB, Rcpp::NumericVector commonMassAxis, double minTIC, double maxTic);
-RcppExport SEXP _rMSI2_COverallAverageSpectrum(SEXP rMSIObj_listSEXP, SEXP numOfThreadsSEXP, SEXP memoryPerThreadMBSEXP, SEXP commonMassAxisSEXP, SEXP minTICSEXP, SEXP maxTicSEXP) {
+NumericVector COverallAverageSpectrum(Rcpp::List rMSIObj_list, int numOfThreads, double memoryPerThreadMB, Rcpp::NumericVector commonMassAxis, double minTIC, double maxTic, bool float32DataCubes);
+RcppExport SEXP _rMSI2_COverallAverageSpectrum(SEXP rMSIObj_listSEXP, SEXP numOfThreadsSEXP, SEXP memoryPerThreadMBSEXP, SEXP commonMassAxisSEXP, SEXP minTICSEXP, SEXP maxTicSEXP, SEXP float32DataCubesSEXP) {
 BEGIN_RCPP
     Rcpp::RObject rcpp_result_gen;
     Rcpp::RNGScope rcpp_rngScope_gen;
@@ -245,7 +284,8 @@ BEGIN_RCPP
     Rcpp::traits::input_parameter< Rcpp::NumericVector >::type commonMassAxis(commonMassAxisSEXP);
     Rcpp::traits::input_parameter< double >::type minTIC(minTICSEXP);
     Rcpp::traits::input_parameter< double >::type maxTic(maxTicSEXP);
-    rcpp_result_gen = Rcpp::wrap(COverallAverageSpectrum(rMSIObj_list, numOfThreads, memoryPerThreadMB, commonMassAxis, minTIC, maxTic));
+    Rcpp::traits::input_parameter< bool >::type float32DataCubes(float32DataCubesSEXP);
+    rcpp_result_gen = Rcpp::wrap(COverallAverageSpectrum(rMSIObj_list, numOfThreads, memoryPerThreadMB, commonMassAxis, minTIC, maxTic, float32DataCubes));
     return rcpp_result_gen;
 END_RCPP
 }
@@ -263,9 +303,10 @@ BEGIN_RCPP
 END_RCPP
 }
 // CRunFillPeaks
-void CRunFillPeaks(Rcpp::List rMSIObj_list, int numOfThreads, double memoryPerThreadMB, Rcpp::Reference preProcessingParams, Rcpp::NumericVector commonMassAxis, Rcpp::List peakMatrix);
-RcppExport SEXP _rMSI2_CRunFillPeaks(SEXP rMSIObj_listSEXP, SEXP numOfThreadsSEXP, SEXP memoryPerThreadMBSEXP, SEXP preProcessingParamsSEXP, SEXP commonMassAxisSEXP, SEXP peakMatrixSEXP) {
+List CRunFillPeaks(Rcpp::List rMSIObj_list, int numOfThreads, double memoryPerThreadMB, Rcpp::Reference preProcessingParams, Rcpp::NumericVector commonMassAxis, Rcpp::List peakMatrix, bool float32DataCubes, bool sparseOutput);
+RcppExport SEXP _rMSI2_CRunFillPeaks(SEXP rMSIObj_listSEXP, SEXP numOfThreadsSEXP, SEXP memoryPerThreadMBSEXP, SEXP preProcessingParamsSEXP, SEXP commonMassAxisSEXP, SEXP peakMatrixSEXP, SEXP float32DataCubesSEXP, SEXP sparseOutputSEXP) {
 BEGIN_RCPP
+    Rcpp::RObject rcpp_result_gen;
     Rcpp::RNGScope rcpp_rngScope_gen;
     Rcpp::traits::input_parameter< Rcpp::List >::type rMSIObj_list(rMSIObj_listSEXP);
     Rcpp::traits::input_parameter< int >::type numOfThreads(numOfThreadsSEXP);
@@ -273,13 +314,15 @@ BEGIN_RCPP
     Rcpp::traits::input_parameter< Rcpp::Reference >::type preProcessingParams(preProcessingParamsSEXP);
     Rcpp::traits::input_parameter< Rcpp::NumericVector >::type commonMassAxis(commonMassAxisSEXP);
     Rcpp::traits::input_parameter< Rcpp::List >::type peakMatrix(peakMatrixSEXP);
-    CRunFillPeaks(rMSIObj_list, numOfThreads, memoryPerThreadMB, preProcessingParams, commonMassAxis, peakMatrix);
-    return R_NilValue;
+    Rcpp::traits::input_parameter< bool >::type float32DataCubes(float32DataCubesSEXP);
+    Rcpp::traits::input_parameter< bool >::type sparseOutput(sparseOutputSEXP);
+    rcpp_result_gen = Rcpp::wrap(CRunFillPeaks(rMSIObj_list, numOfThreads, memoryPerThreadMB, preProcessingParams, commonMassAxis, peakMatrix, float32DataCubes, sparseOutput));
+    return rcpp_result_gen;
 END_RCPP
 }
 // CInternalReferenceSpectrum
-List CInternalReferenceSpectrum(Rcpp::List rMSIObj_list, int numOfThreads, double memoryPerThreadMB, Rcpp::NumericVector referenceSpectrum, Rcpp::NumericVector commonMassAxis);
-RcppExport SEXP _rMSI2_CInternalReferenceSpectrum(SEXP rMSIObj_listSEXP, SEXP numOfThreadsSEXP, SEXP memoryPerThreadMBSEXP, SEXP referenceSpectrumSEXP, SEXP commonMassAxisSEXP) {
+List CInternalReferenceSpectrum(Rcpp::List rMSIObj_list, int numOfThreads, double memoryPerThreadMB, Rcpp::NumericVector referenceSpectrum, Rcpp::NumericVector commonMassAxis, bool float32DataCubes);
+RcppExport SEXP _rMSI2_CInternalReferenceSpectrum(SEXP rMSIObj_listSEXP, SEXP numOfThreadsSEXP, SEXP memoryPerThreadMBSEXP, SEXP referenceSpectrumSEXP, SEXP commonMassAxisSEXP, SEXP float32DataCubesSEXP) {
 BEGIN_RCPP
     Rcpp::RObject rcpp_result_gen;
     Rcpp::RNGScope rcpp_rngScope_gen;
@@ -288,13 +331,14 @@ BEGIN_RCPP
     Rcpp::traits::input_parameter< double >::type memoryPerThreadMB(memoryPerThreadMBSEXP);
     Rcpp::traits::input_parameter< Rcpp::NumericVector >::type referenceSpectrum(referenceSpectrumSEXP);
     Rcpp::traits::input_parameter< Rcpp::NumericVector >::type commonMassAxis(commonMassAxisSEXP);
-    rcpp_result_gen = Rcpp::wrap(CInternalReferenceSpectrum(rMSIObj_list, numOfThreads, memoryPerThreadMB, referenceSpectrum, commonMassAxis));
+    Rcpp::traits::input_parameter< bool >::type float32DataCubes(float32DataCubesSEXP);
+    rcpp_result_gen = Rcpp::wrap(CInternalReferenceSpectrum(rMSIObj_list, numOfThreads, memoryPerThreadMB, referenceSpectrum, commonMassAxis, float32DataCubes));
     return rcpp_result_gen;
 END_RCPP
 }
 // CRunPeakPicking
-Rcpp::List CRunPeakPicking(Rcpp::List rMSIObj_list, int numOfThreads, double memoryPerThreadMB, Rcpp::Reference preProcessingParams, Rcpp::StringVector uuid, Rcpp::String outputDataPath, Rcpp::StringVector imzMLoutFnames, Rcpp::NumericVector commonMassAxis);
-RcppExport SEXP _rMSI2_CRunPeakPicking(SEXP rMSIObj_listSEXP, SEXP numOfThreadsSEXP, SEXP memoryPerThreadMBSEXP, SEXP preProcessingParamsSEXP, SEXP uuidSEXP, SEXP outputDataPathSEXP, SEXP imzMLoutFnamesSEXP, SEXP commonMassAxisSEXP) {
+Rcpp::List CRunPeakPicking(Rcpp::List rMSIObj_list, int numOfThreads, double memoryPerThreadMB, Rcpp::Reference preProcessingParams, Rcpp::StringVector uuid, Rcpp::String outputDataPath, Rcpp::StringVector imzMLoutFnames, Rcpp::NumericVector commonMassAxis, bool float32DataCubes, bool recomputeNoise);
+RcppExport SEXP _rMSI2_CRunPeakPicking(SEXP rMSIObj_listSEXP, SEXP numOfThreadsSEXP, SEXP memoryPerThreadMBSEXP, SEXP preProcessingParamsSEXP, SEXP uuidSEXP, SEXP outputDataPathSEXP, SEXP imzMLoutFnamesSEXP, SEXP commonMassAxisSEXP, SEXP float32DataCubesSEXP, SEXP recomputeNoiseSEXP) {
 BEGIN_RCPP
     Rcpp::RObject rcpp_result_gen;
     Rcpp::RNGScope rcpp_rngScope_gen;
@@ -306,13 +350,15 @@ BEGIN_RCPP
     Rcpp::traits::input_parameter< Rcpp::String >::type outputDataPath(outputDataPathSEXP);
     Rcpp::traits::input_parameter< Rcpp::StringVector >::type imzMLoutFnames(imzMLoutFnamesSEXP);
     Rcpp::traits::input_parameter< Rcpp::NumericVector >::type commonMassAxis(commonMassAxisSEXP);
-    rcpp_result_gen = Rcpp::wrap(CRunPeakPicking(rMSIObj_list, numOfThreads, memoryPerThreadMB, preProcessingParams, uuid, outputDataPath, imzMLoutFnames, commonMassAxis));
+    Rcpp::traits::input_parameter< bool >::type float32DataCubes(float32DataCubesSEXP);
+    Rcpp::traits::input_parameter< bool >::type recomputeNoise(recomputeNoiseSEXP);
+    rcpp_result_gen = Rcpp::wrap(CRunPeakPicking(rMSIObj_list, numOfThreads, memoryPerThreadMB, preProcessingParams, uuid, outputDataPath, imzMLoutFnames, commonMassAxis, float32DataCubes, recomputeNoise));
     return rcpp_result_gen;
 END_RCPP
 }
 // CRunPreProcessing
-List CRunPreProcessing(Rcpp::List rMSIObj_list, int numOfThreads, double memoryPerThreadMB, Rcpp::Reference preProcessingParams, Rcpp::NumericVector reference, Rcpp::StringVector uuid, Rcpp::String outputDataPath, Rcpp::StringVector imzMLoutFnames, Rcpp::NumericVector commonMassAxis);
-RcppExport SEXP _rMSI2_CRunPreProcessing(SEXP rMSIObj_listSEXP, SEXP numOfThreadsSEXP, SEXP memoryPerThreadMBSEXP, SEXP preProcessingParamsSEXP, SEXP referenceSEXP, SEXP uuidSEXP, SEXP outputDataPathSEXP, SEXP imzMLoutFnamesSEXP, SEXP commonMassAxisSEXP) {
+List CRunPreProcessing(Rcpp::List rMSIObj_list, int numOfThreads, double memoryPerThreadMB, Rcpp::Reference preProcessingParams, Rcpp::NumericVector reference, Rcpp::StringVector uuid, Rcpp::String outputDataPath, Rcpp::StringVector imzMLoutFnames, Rcpp::NumericVector commonMassAxis, bool float32DataCubes, bool fusedPeakPicking);
+RcppExport SEXP _rMSI2_CRunPreProcessing(SEXP rMSIObj_listSEXP, SEXP numOfThreadsSEXP, SEXP memoryPerThreadMBSEXP, SEXP preProcessingParamsSEXP, SEXP referenceSEXP, SEXP uuidSEXP, SEXP outputDataPathSEXP, SEXP imzMLoutFnamesSEXP, SEXP commonMassAxisSEXP, SEXP float32DataCubesSEXP, SEXP fusedPeakPickingSEXP) {
 BEGIN_RCPP
     Rcpp::RObject rcpp_result_gen;
     Rcpp::RNGScope rcpp_rngScope_gen;
@@ -325,7 +371,9 @@ BEGIN_RCPP
     Rcpp::traits::input_parameter< Rcpp::String >::type outputDataPath(outputDataPathSEXP);
     Rcpp::traits::input_parameter< Rcpp::StringVector >::type imzMLoutFnames(imzMLoutFnamesSEXP);
     Rcpp::traits::input_parameter< Rcpp::NumericVector >::type commonMassAxis(commonMassAxisSEXP);
-    rcpp_result_gen = Rcpp::wrap(CRunPreProcessing(rMSIObj_list, numOfThreads, memoryPerThreadMB, preProcessingParams, reference, uuid, outputDataPath, imzMLoutFnames, commonMassAxis));
+    Rcpp::traits::input_parameter< bool >::type float32DataCubes(float32DataCubesSEXP);
+    Rcpp::traits::input_parameter< bool >::type fusedPeakPicking(fusedPeakPickingSEXP);
+    rcpp_result_gen = Rcpp::wrap(CRunPreProcessing(rMSIObj_list, numOfThreads, memoryPerThreadMB, preProcessingParams, reference, uuid, outputDataPath, imzMLoutFnames, commonMassAxis, float32DataCubes, fusedPeakPicking));
     return rcpp_result_gen;
 END_RCPP
 }
@@ -508,6 +556,20 @@ BEGIN_RCPP
     return rcpp_result_gen;
 END_RCPP
 }
+// testingDataCubesRows
+Rcpp::IntegerVector testingDataCubesRows(Rcpp::List rMSIObj_list, double memoryPerThreadMB, Rcpp::NumericVector commonMassAxis, bool float32DataCubes);
+RcppExport SEXP _rMSI2_testingDataCubesRows(SEXP rMSIObj_listSEXP, SEXP memoryPerThreadMBSEXP, SEXP commonMassAxisSEXP, SEXP float32DataCubesSEXP) {
+BEGIN_RCPP
+    Rcpp::RObject rcpp_result_gen;
+    Rcpp::RNGScope rcpp_rngScope_gen;
+    Rcpp::traits::input_parameter< Rcpp::List >::type rMSIObj_list(rMSIObj_listSEXP);
+    Rcpp::traits::input_parameter< double >::type memoryPerThreadMB(memoryPerThreadMBSEXP);
+    Rcpp::traits::input_parameter< Rcpp::NumericVector >::type commonMassAxis(commonMassAxisSEXP);
+    Rcpp::traits::input_parameter< bool >::type float32DataCubes(float32DataCubesSEXP);
+    rcpp_result_gen = Rcpp::wrap(testingDataCubesRows(rMSIObj_list, memoryPerThreadMB, commonMassAxis, float32DataCubes));
+    return rcpp_result_gen;
+END_RCPP
+}
 // Ccreate_rMSIXBinData
 List Ccreate_rMSIXBinData(List rMSIobj, int number_of_threads);
 RcppExport SEXP _rMSI2_Ccreate_rMSIXBinData(SEXP rMSIobjSEXP, SEXP number_of_threadsSEXP) {
@@ -547,6 +609,16 @@ BEGIN_RCPP
     return rcpp_result_gen;
 END_RCPP
 }
+// testingScratchArenaAllocations
+double testingScratchArenaAllocations();
+RcppExport SEXP _rMSI2_testingScratchArenaAllocations() {
+BEGIN_RCPP
+    Rcpp::RObject rcpp_result_gen;
+    Rcpp::RNGScope rcpp_rngScope_gen;
+    rcpp_result_gen = Rcpp::wrap(testingScratchArenaAllocations());
+    return rcpp_result_gen;
+END_RCPP
+}
 // Smoothing_SavitzkyGolay
 NumericVector Smoothing_SavitzkyGolay(NumericVector x, int sgSize);
 RcppExport SEXP _rMSI2_Smoothing_SavitzkyGolay(SEXP xSEXP, SEXP sgSizeSEXP) {
@@ -559,11 +631,27 @@ BEGIN_RCPP
     return rcpp_result_gen;
 END_RCPP
 }
+// CSparsePeakMatrixSlice
+NumericMatrix CSparsePeakMatrixSlice(List sparseMat, IntegerVector rows, IntegerVector cols);
+RcppExport SEXP _rMSI2_CSparsePeakMatrixSlice(SEXP sparseMatSEXP, SEXP rowsSEXP, SEXP colsSEXP) {
+BEGIN_RCPP
+    Rcpp::RObject rcpp_result_gen;
+    Rcpp::RNGScope rcpp_rngScope_gen;
+    Rcpp::traits::input_parameter< List >::type sparseMat(sparseMatSEXP);
+    Rcpp::traits::input_parameter< IntegerVector >::type rows(rowsSEXP);
+    Rcpp::traits::input_parameter< IntegerVector >::type cols(colsSEXP);
+    rcpp_result_gen = Rcpp::wrap(CSparsePeakMatrixSlice(sparseMat, rows, cols));
+    return rcpp_result_gen;
+END_RCPP
+}
 
 static const R_CallMethodDef CallEntries[] = {
-    {"_rMSI2_CNormalizationsAndMeans", (DL_FUNC) &_rMSI2_CNormalizationsAndMeans, 4},
+    {"_rMSI2_CNormalizationsAndMeans", (DL_FUNC) &_rMSI2_CNormalizationsAndMeans, 5},
+    {"_rMSI2_CNormalizationsMeansAndOverallAverage", (DL_FUNC) &_rMSI2_CNormalizationsMeansAndOverallAverage, 5},
     {"_rMSI2_CparseBrukerXML", (DL_FUNC) &_rMSI2_CparseBrukerXML, 1},
+    {"_rMSI2_SetFFTWisdomFile", (DL_FUNC) &_rMSI2_SetFFTWisdomFile, 1},
     {"_rMSI2_testingimzMLBinWriteSequential", (DL_FUNC) &_rMSI2_testingimzMLBinWriteSequential, 6},
+    {"_rMSI2_testingImzMLDataConversion", (DL_FUNC) &_rMSI2_testingImzMLDataConversion, 3},
     {"_rMSI2_CimzMLBinCreateNewIBD", (DL_FUNC) &_rMSI2_CimzMLBinCreateNewIBD, 2},
     {"_rMSI2_CimzMLBinAppendMass", (DL_FUNC) &_rMSI2_CimzMLBinAppendMass, 3},
     {"_rMSI2_CimzMLBinAppendIntensity", (DL_FUNC) &_rMSI2_CimzMLBinAppendIntensity, 3},
@@ -577,12 +665,12 @@ static const R_CallMethodDef CallEntries[] = {
     {"_rMSI2_CimzMLStore", (DL_FUNC) &_rMSI2_CimzMLStore, 3},
     {"_rMSI2_AlignSpectrumToReference", (DL_FUNC) &_rMSI2_AlignSpectrumToReference, 13},
     {"_rMSI2_MergeMassAxisAutoBinSize", (DL_FUNC) &_rMSI2_MergeMassAxisAutoBinSize, 2},
-    {"_rMSI2_COverallAverageSpectrum", (DL_FUNC) &_rMSI2_COverallAverageSpectrum, 6},
+    {"_rMSI2_COverallAverageSpectrum", (DL_FUNC) &_rMSI2_COverallAverageSpectrum, 7},
     {"_rMSI2_CcommonMassAxis", (DL_FUNC) &_rMSI2_CcommonMassAxis, 3},
-    {"_rMSI2_CRunFillPeaks", (DL_FUNC) &_rMSI2_CRunFillPeaks, 6},
-    {"_rMSI2_CInternalReferenceSpectrum", (DL_FUNC) &_rMSI2_CInternalReferenceSpectrum, 5},
-    {"_rMSI2_CRunPeakPicking", (DL_FUNC) &_rMSI2_CRunPeakPicking, 8},
-    {"_rMSI2_CRunPreProcessing", (DL_FUNC) &_rMSI2_CRunPreProcessing, 9},
+    {"_rMSI2_CRunFillPeaks", (DL_FUNC) &_rMSI2_CRunFillPeaks, 8},
+    {"_rMSI2_CInternalReferenceSpectrum", (DL_FUNC) &_rMSI2_CInternalReferenceSpectrum, 6},
+    {"_rMSI2_CRunPeakPicking", (DL_FUNC) &_rMSI2_CRunPeakPicking, 10},
+    {"_rMSI2_CRunPreProcessing", (DL_FUNC) &_rMSI2_CRunPreProcessing, 11},
     {"_rMSI2_NoiseEstimationFFTCosWin", (DL_FUNC) &_rMSI2_NoiseEstimationFFTCosWin, 2},
     {"_rMSI2_NoiseEstimationFFTExpWin", (DL_FUNC) &_rMSI2_NoiseEstimationFFTExpWin, 2},
     {"_rMSI2_NoiseEstimationFFTCosWinMat", (DL_FUNC) &_rMSI2_NoiseEstimationFFTCosWinMat, 2},
@@ -595,10 +683,13 @@ static const R_CallMethodDef CallEntries[] = {
     {"_rMSI2_TestHanningWindow", (DL_FUNC) &_rMSI2_TestHanningWindow, 3},
     {"_rMSI2_TestAreaWindow", (DL_FUNC) &_rMSI2_TestAreaWindow, 3},
     {"_rMSI2_ReduceDataPointsC", (DL_FUNC) &_rMSI2_ReduceDataPointsC, 5},
+    {"_rMSI2_testingDataCubesRows", (DL_FUNC) &_rMSI2_testingDataCubesRows, 4},
     {"_rMSI2_Ccreate_rMSIXBinData", (DL_FUNC) &_rMSI2_Ccreate_rMSIXBinData, 2},
     {"_rMSI2_Cload_rMSIXBinData", (DL_FUNC) &_rMSI2_Cload_rMSIXBinData, 2},
     {"_rMSI2_Cload_rMSIXBinIonImage", (DL_FUNC) &_rMSI2_Cload_rMSIXBinIonImage, 5},
+    {"_rMSI2_testingScratchArenaAllocations", (DL_FUNC) &_rMSI2_testingScratchArenaAllocations, 0},
     {"_rMSI2_Smoothing_SavitzkyGolay", (DL_FUNC) &_rMSI2_Smoothing_SavitzkyGolay, 2},
+    {"_rMSI2_CSparsePeakMatrixSlice", (DL_FUNC) &_rMSI2_CSparsePeakMatrixSlice, 3},
     {NULL, NULL, 0}
 };
 
@@ -0,0 +1,145 @@
+/*************************************************************************
+ *     rMSIproc - R package for MSI data processing
+ *     Copyright (C) 2014 Pere Rafols Soler
+ * 
+ *     This program is free software: you can redistribute it and/or modify
+ *     it under the terms of the GNU General Public License as published by
+ *     the Free Software Foundation, either version 3 of the License, or
+ *     (at your option) any later version.
+ * 
+ *     This program is distributed in the hope that it will be useful,
+ *     but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *     MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *     GNU General Public License for more details.
+ * 
+ *     You should have received a copy of the GNU General Public License
+ *     along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ **************************************************************************/
+#include <Rcpp.h>
+#include <map>
+#include <mutex>
+#include "fftengine.h"
+using namespace Rcpp;
+
+//Plans are identified by its size, kind, batch length and placement
+typedef struct
+{
+  int fftSize;
+  int kind;
+  int howMany;
+  bool inPlace;
+}FFTPlanKey;
+
+static bool operator<(const FFTPlanKey &a, const FFTPlanKey &b)
+{
+  if( a.fftSize != b.fftSize ) return a.fftSize < b.fftSize;
+  if( a.kind != b.kind ) return a.kind < b.kind;
+  if( a.howMany != b.howMany ) return a.howMany < b.howMany;
+  return a.inPlace < b.inPlace;
+}
+
+//The FFTW planner is not thread safe, so all planner and wisdom calls are serialized
+static std::mutex plannerMutex;
+static std::map<FFTPlanKey, fftw_plan> plans;
+static std::string wisdomFile;
+
+int FFTEngine::goodSize(int n)
+{
+  if( n <= 1 )
+  {
+    return 1;
+  }
+  
+  //Search all the products of 2, 3, 5 and 7 between n and the next power of two, which is always a candidate
+  int best = 1;
+  while( best < n )
+  {
+    best *= 2;
+  }
+  for( long long p7 = 1; p7 < best; p7 *= 7 )
+  {
+    for( long long p5 = p7; p5 < best; p5 *= 5 )
+    {
+      for( long long p3 = p5; p3 < best; p3 *= 3 )
+      {
+        long long p2 = p3;
+        while( p2 < n )
+        {
+          p2 *= 2;
+        }
+        if( p2 < best )
+        {
+          best = (int)p2;
+        }
+      }
+    }
+  }
+  return best;
+}
+
+fftw_plan FFTEngine::getPlan(int fftSize, fftw_r2r_kind kind, int howMany, bool inPlace)
+{
+  std::lock_guard<std::mutex> lock(plannerMutex);
+  FFTPlanKey key = {fftSize, (int)kind, howMany, inPlace};
+  std::map<FFTPlanKey, fftw_plan>::iterator it = plans.find(key);
+  if( it != plans.end() )
+  {
+    return it->second;
+  }
+  
+  //Measuring overwrites the buffers, so temporary ones are used. Plans remain valid for any other buffer with the same alignment.
+  const bool bMeasure = fftSize <= FFT_MEASURE_MAX_SIZE;
+  double *in = fftw_alloc_real((size_t)fftSize * (size_t)howMany);
+  double *out = inPlace ? in : fftw_alloc_real((size_t)fftSize * (size_t)howMany);
+  fftw_plan plan = fftw_plan_many_r2r(1, &fftSize, howMany, 
+                                      in, NULL, 1, fftSize, 
+                                      out, NULL, 1, fftSize, 
+                                      &kind, bMeasure ? FFTW_MEASURE : FFTW_ESTIMATE);
+  if( !inPlace )
+  {
+    fftw_free(out);
+  }
+  fftw_free(in);
+  
+  if( plan == NULL )
+  {
+    throw std::runtime_error("Error: FFTW could not create a plan of size " + std::to_string(fftSize) + "\n");
+  }
+  plans[key] = plan;
+  
+  if( bMeasure && !wisdomFile.empty() )
+  {
+    fftw_export_wisdom_to_filename(wisdomFile.c_str()); //A failed export only means the plan will be measured again next session
+  }
+  return plan;
+}
+
+void FFTEngine::execute(fftw_plan plan, double *in, double *out)
+{
+  fftw_execute_r2r(plan, in, out);
+}
+
+void FFTEngine::setWisdomFile(std::string path)
+{
+  std::lock_guard<std::mutex> lock(plannerMutex);
+  wisdomFile = path;
+  if( !wisdomFile.empty() )
+  {
+    fftw_import_wisdom_from_filename(wisdomFile.c_str()); //The file does not exist until the first plan is measured
+  }
+}
+
+////// Rcpp Exported methods //////////////////////////////////////////////////////////
+//' SetFFTWisdomFile.
+//' 
+//' Sets a file to keep the FFTW wisdom between R sessions. 
+//' The FFT plans used in the processing are measured only the first time each FFT size is used and stored in this file.
+//' 
+//' @param path full path to the wisdom file, it is created if it does not exist. An empty string disables it.
+//' 
+//' @export
+// [[Rcpp::export]]
+void SetFFTWisdomFile(String path)
+{
+  FFTEngine::setWisdomFile(std::string(path.get_cstring()));
+}
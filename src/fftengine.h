@@ -0,0 +1,48 @@
+/*************************************************************************
+ *     rMSIproc - R package for MSI data processing
+ *     Copyright (C) 2014 Pere Rafols Soler
+ * 
+ *     This program is free software: you can redistribute it and/or modify
+ *     it under the terms of the GNU General Public License as published by
+ *     the Free Software Foundation, either version 3 of the License, or
+ *     (at your option) any later version.
+ * 
+ *     This program is distributed in the hope that it will be useful,
+ *     but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *     MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *     GNU General Public License for more details.
+ * 
+ *     You should have received a copy of the GNU General Public License
+ *     along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ **************************************************************************/
+#ifndef FFT_ENGINE_H
+  #define FFT_ENGINE_H
+
+#include <string>
+#include <fftw3.h>
+
+#define FFT_MEASURE_MAX_SIZE 262144 //Larger transforms are planned with FFTW_ESTIMATE since measuring them takes too long
+
+//FFT plans shared by all the processing classes (noise estimation, peak picking and label-free alignment).
+//Plans are created once per size, transform kind and batch length and reused by every object and thread,
+//so FFTW_MEASURE can be used without paying the planning time on each new object.
+class FFTEngine
+{
+  public:
+    //Returns the smallest size >= n with only 2, 3, 5 and 7 as prime factors, which FFTW transforms efficiently
+    static int goodSize(int n);
+    
+    //Returns the plan for howMany consecutive real transforms of fftSize points each, kind must be FFTW_R2HC or FFTW_HC2R.
+    //The plan is owned by the engine and must not be destroyed. Set inPlace to run it with the same input and output buffer.
+    static fftw_plan getPlan(int fftSize, fftw_r2r_kind kind, int howMany = 1, bool inPlace = false);
+    
+    //Executes a plan on the given buffers, they must be allocated with fftw_alloc_real and hold howMany*fftSize points.
+    //It is thread safe so a plan can be executed by many threads at once.
+    static void execute(fftw_plan plan, double *in, double *out);
+    
+    //Sets the file used to keep FFTW wisdom between sessions and imports it if it exists.
+    //Wisdom is exported to it each time a new plan is measured. An empty path disables it.
+    static void setWisdomFile(std::string path);
+};
+
+#endif
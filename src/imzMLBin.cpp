@@ -18,13 +18,28 @@
 
 #include "imzMLBin.h"
 #include "mlinterp.hpp" //Used for linear interpolation
+#include "scratcharena.h"
 #include <stdexcept>
+#include <algorithm>
 #include <future>
 #include <chrono>
 #include <Rcpp.h>
+#ifndef _WIN32
+  #include <sys/mman.h>
+  #include <sys/stat.h>
+  #include <fcntl.h>
+  #include <unistd.h>
+  #include <cerrno>
+#endif
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+  #define IMZML_X86_SIMD //Data conversion kernels using AVX are available and selected at runtime
+  #include <immintrin.h>
+#endif
 
 //#define __DEBUG__
 #define INTERPOLATION_TIMEOUT 10 //Timeout for interpolation theads ins ms
+#define MASS_LOOKUP_BLOCK 8192 //Maximum number of mass channels read at once to complete a binary search in processed mode
+#define PREFETCH_MAX_GAP 65536 //Maximum gap in bytes between the mass and intensity arrays of a pixel to be read as a single range
 
 ImzMLBin::ImzMLBin(const char* ibd_fname,  unsigned int num_of_pixels,Rcpp::String Str_mzType, Rcpp::String Str_intType, bool continuous, Mode mode):
   ibdFname(ibd_fname), Npixels(num_of_pixels), bContinuous(continuous), fileMode(mode)
@@ -264,41 +279,236 @@ ImzMLBin::imzMLDataType ImzMLBin::string2imzMLDatatype(Rcpp::String data_type)
   return dataType;
 }
 
-template<typename T> 
-void ImzMLBin::convertBytes2Double(char* inBytes, double* outPtr, unsigned int N)
+//Data conversion kernels between the ibd bytes and double
+//Bytes are accessed without any alignment requirement and decoded in the host byte order, imzML data and all supported platforms are little-endian.
+namespace
 {
-  //First, copy the data to an intermediate vector with the desired type
-  T* auxBuffer = new T[N];
-  memcpy(auxBuffer, inBytes, sizeof(T)*N);
+  //Scalar conversion, used for int64 and as fallback for the remaining elements of the SIMD kernels
+  template<typename T> 
+  void decodeScalar(const char* inBytes, double* outPtr, unsigned int N)
+  {
+    T value;
+    for(unsigned int i = 0; i < N; i++)
+    {
+      memcpy(&value, inBytes + i*sizeof(T), sizeof(T));
+      outPtr[i] = (double)value;
+    }
+  }
   
-  //Finally, move the data to the double pointer
-  for(int i = 0; i < N; i++)
+  template<typename T> 
+  void encodeScalar(const double* inPtr, char* outBytes, unsigned int N)
   {
-    outPtr[i] = (double)auxBuffer[i];
+    T value;
+    for(unsigned int i = 0; i < N; i++)
+    {
+      value = (T)inPtr[i]; //Conversion from double to T type
+      memcpy(outBytes + i*sizeof(T), &value, sizeof(T));
+    }
   }
   
-  delete[] auxBuffer;
-}
+#ifdef IMZML_X86_SIMD
+  //The CPU features are checked only once
+  bool cpuHasAVX()
+  {
+    static const bool bAVX = __builtin_cpu_supports("avx");
+    return bAVX;
+  }
+  
+  __attribute__((target("avx"))) void decodeInt32AVX(const char* inBytes, double* outPtr, unsigned int N)
+  {
+    unsigned int i = 0;
+    for( ; i + 4 <= N; i += 4)
+    {
+      _mm256_storeu_pd(outPtr + i, _mm256_cvtepi32_pd(_mm_loadu_si128((const __m128i*)(inBytes + i*sizeof(int32_t)))));
+    }
+    decodeScalar<int32_t>(inBytes + i*sizeof(int32_t), outPtr + i, N - i);
+  }
+  
+  __attribute__((target("avx"))) void decodeFloat32AVX(const char* inBytes, double* outPtr, unsigned int N)
+  {
+    unsigned int i = 0;
+    for( ; i + 4 <= N; i += 4)
+    {
+      _mm256_storeu_pd(outPtr + i, _mm256_cvtps_pd(_mm_loadu_ps((const float*)(inBytes + i*sizeof(float)))));
+    }
+    decodeScalar<float>(inBytes + i*sizeof(float), outPtr + i, N - i);
+  }
+  
+  __attribute__((target("avx"))) void encodeInt32AVX(const double* inPtr, char* outBytes, unsigned int N)
+  {
+    unsigned int i = 0;
+    for( ; i + 4 <= N; i += 4)
+    {
+      _mm_storeu_si128((__m128i*)(outBytes + i*sizeof(int32_t)), _mm256_cvttpd_epi32(_mm256_loadu_pd(inPtr + i))); //Truncation, as the C cast
+    }
+    encodeScalar<int32_t>(inPtr + i, outBytes + i*sizeof(int32_t), N - i);
+  }
+  
+  __attribute__((target("avx"))) void encodeFloat32AVX(const double* inPtr, char* outBytes, unsigned int N)
+  {
+    unsigned int i = 0;
+    for( ; i + 4 <= N; i += 4)
+    {
+      _mm_storeu_ps((float*)(outBytes + i*sizeof(float)), _mm256_cvtpd_ps(_mm256_loadu_pd(inPtr + i)));
+    }
+    encodeScalar<float>(inPtr + i, outBytes + i*sizeof(float), N - i);
+  }
+#endif
 
-template<typename T> 
-void ImzMLBin::convertDouble2Bytes(double* inPtr, char* outBytes, unsigned int N)
-{
-  //First, copy the data to an intermediate vector with the desired type
-  T* auxBuffer = new T[N];
-  for(int i = 0; i < N; i++)
+#ifdef __SSE2__
+  //SSE2 is always available in x86_64 so it is used when AVX is not supported
+  void decodeInt32SSE2(const char* inBytes, double* outPtr, unsigned int N)
+  {
+    unsigned int i = 0;
+    for( ; i + 2 <= N; i += 2)
+    {
+      _mm_storeu_pd(outPtr + i, _mm_cvtepi32_pd(_mm_loadl_epi64((const __m128i*)(inBytes + i*sizeof(int32_t)))));
+    }
+    decodeScalar<int32_t>(inBytes + i*sizeof(int32_t), outPtr + i, N - i);
+  }
+  
+  void decodeFloat32SSE2(const char* inBytes, double* outPtr, unsigned int N)
+  {
+    unsigned int i = 0;
+    for( ; i + 4 <= N; i += 4)
+    {
+      __m128 v = _mm_loadu_ps((const float*)(inBytes + i*sizeof(float)));
+      _mm_storeu_pd(outPtr + i, _mm_cvtps_pd(v));
+      _mm_storeu_pd(outPtr + i + 2, _mm_cvtps_pd(_mm_movehl_ps(v, v)));
+    }
+    decodeScalar<float>(inBytes + i*sizeof(float), outPtr + i, N - i);
+  }
+  
+  void encodeInt32SSE2(const double* inPtr, char* outBytes, unsigned int N)
+  {
+    unsigned int i = 0;
+    for( ; i + 4 <= N; i += 4)
+    {
+      __m128i lo = _mm_cvttpd_epi32(_mm_loadu_pd(inPtr + i)); //Truncation, as the C cast
+      __m128i hi = _mm_cvttpd_epi32(_mm_loadu_pd(inPtr + i + 2));
+      _mm_storeu_si128((__m128i*)(outBytes + i*sizeof(int32_t)), _mm_unpacklo_epi64(lo, hi));
+    }
+    encodeScalar<int32_t>(inPtr + i, outBytes + i*sizeof(int32_t), N - i);
+  }
+  
+  void encodeFloat32SSE2(const double* inPtr, char* outBytes, unsigned int N)
+  {
+    unsigned int i = 0;
+    for( ; i + 4 <= N; i += 4)
+    {
+      __m128 lo = _mm_cvtpd_ps(_mm_loadu_pd(inPtr + i));
+      __m128 hi = _mm_cvtpd_ps(_mm_loadu_pd(inPtr + i + 2));
+      _mm_storeu_ps((float*)(outBytes + i*sizeof(float)), _mm_movelh_ps(lo, hi));
+    }
+    encodeScalar<float>(inPtr + i, outBytes + i*sizeof(float), N - i);
+  }
+#endif
+  
+  //Kernel selection for each data type
+  //int64 is always converted by the scalar kernels, packed conversions between int64 and double only exist from AVX-512DQ
+  template<typename T> 
+  void decodeKernel(const char* inBytes, double* outPtr, unsigned int N)
+  {
+    decodeScalar<T>(inBytes, outPtr, N);
+  }
+  
+  template<typename T> 
+  void encodeKernel(const double* inPtr, char* outBytes, unsigned int N)
   {
-    auxBuffer[i] = (T)inPtr[i]; //Conversion from double to T type
+    encodeScalar<T>(inPtr, outBytes, N);
   }
   
-  //Finally, move the data to the output bytes buffer
-  memcpy(outBytes, auxBuffer, sizeof(T)*N);
+  template<> 
+  void decodeKernel<int32_t>(const char* inBytes, double* outPtr, unsigned int N)
+  {
+#ifdef IMZML_X86_SIMD
+    if(cpuHasAVX())
+    {
+      decodeInt32AVX(inBytes, outPtr, N);
+      return;
+    }
+#endif
+#ifdef __SSE2__
+    decodeInt32SSE2(inBytes, outPtr, N);
+#else
+    decodeScalar<int32_t>(inBytes, outPtr, N);
+#endif
+  }
+  
+  template<> 
+  void decodeKernel<float>(const char* inBytes, double* outPtr, unsigned int N)
+  {
+#ifdef IMZML_X86_SIMD
+    if(cpuHasAVX())
+    {
+      decodeFloat32AVX(inBytes, outPtr, N);
+      return;
+    }
+#endif
+#ifdef __SSE2__
+    decodeFloat32SSE2(inBytes, outPtr, N);
+#else
+    decodeScalar<float>(inBytes, outPtr, N);
+#endif
+  }
+  
+  template<> 
+  void encodeKernel<int32_t>(const double* inPtr, char* outBytes, unsigned int N)
+  {
+#ifdef IMZML_X86_SIMD
+    if(cpuHasAVX())
+    {
+      encodeInt32AVX(inPtr, outBytes, N);
+      return;
+    }
+#endif
+#ifdef __SSE2__
+    encodeInt32SSE2(inPtr, outBytes, N);
+#else
+    encodeScalar<int32_t>(inPtr, outBytes, N);
+#endif
+  }
   
-  delete[] auxBuffer;
+  template<> 
+  void encodeKernel<float>(const double* inPtr, char* outBytes, unsigned int N)
+  {
+#ifdef IMZML_X86_SIMD
+    if(cpuHasAVX())
+    {
+      encodeFloat32AVX(inPtr, outBytes, N);
+      return;
+    }
+#endif
+#ifdef __SSE2__
+    encodeFloat32SSE2(inPtr, outBytes, N);
+#else
+    encodeScalar<float>(inPtr, outBytes, N);
+#endif
+  }
+}
+
+template<typename T> 
+void ImzMLBin::convertBytes2Double(const char* inBytes, double* outPtr, unsigned int N)
+{
+  //Decode directly from the bytes buffer, no intermediate copy is needed
+  decodeKernel<T>(inBytes, outPtr, N);
 }
 
-ImzMLBinRead::ImzMLBinRead(const char* ibd_fname, unsigned int num_of_pixels, Rcpp::String Str_mzType, Rcpp::String Str_intType, bool continuous, bool openIbd, bool peakListrMSIformat):
-  ImzMLBin(ibd_fname, num_of_pixels, Str_mzType, Str_intType, continuous, Mode::Read), bForceResampling(false), bOriginalMassAxisOnMem(false), bPeakListInrMSIFormat(peakListrMSIformat)
+template<typename T> 
+void ImzMLBin::convertDouble2Bytes(double* inPtr, char* outBytes, unsigned int N)
+{
+  //Encode directly to the bytes buffer, no intermediate copy is needed
+  encodeKernel<T>(inPtr, outBytes, N);
+}
+
+ImzMLBinRead::ImzMLBinRead(const char* ibd_fname, unsigned int num_of_pixels, Rcpp::String Str_mzType, Rcpp::String Str_intType, bool continuous, bool openIbd, bool peakListrMSIformat, bool memoryMapped):
+  ImzMLBin(ibd_fname, num_of_pixels, Str_mzType, Str_intType, continuous, Mode::Read), bForceResampling(false), bOriginalMassAxisOnMem(false), bPeakListInrMSIFormat(peakListrMSIformat),
+  bMemoryMapped(memoryMapped), bSequentialAccess(true), ibdMap(nullptr), ibdMapSize(0), ibdMapCursor(0)
 {
+#ifdef _WIN32
+  bMemoryMapped = false; //Memory maps are only supported on POSIX systems, fall back to std::fstream
+#endif
+
   pixels_read_offsets.resize(num_of_pixels);
   
   if(openIbd)
@@ -313,7 +523,7 @@ ImzMLBinRead::ImzMLBinRead(const char* ibd_fname, unsigned int num_of_pixels, Rc
 
 ImzMLBinRead::~ImzMLBinRead()
 {
-  //Empty desctructor
+  close(); //Base class destructor can not release the memory map
 }
 
 void ImzMLBinRead::open()
@@ -321,6 +531,50 @@ void ImzMLBinRead::open()
 #ifdef __DEBUG__
   Rcpp::Rcout << "ImzMLBinRead() open start...\nibdfile is:"<<  ibdFname.get_cstring() << "\n";
 #endif
+#ifndef _WIN32
+  if(bMemoryMapped)
+  {
+    if(ibdMap != nullptr)
+    {
+      return; //Already mapped
+    }
+    
+    int fd = ::open(ibdFname.get_cstring(), O_RDONLY);
+    if(fd < 0)
+    {
+      throw std::runtime_error("ERROR: ImzMLBinRead could not open the imzML ibd file.\n"); 
+    }
+    
+    struct stat fileStats;
+    if(fstat(fd, &fileStats) != 0)
+    {
+      ::close(fd);
+      throw std::runtime_error("ERROR: ImzMLBinRead could not get the size of the imzML ibd file.\n"); 
+    }
+    ibdMapSize = (std::streamoff)fileStats.st_size;
+    ibdMapCursor = 0;
+    
+    if(ibdMapSize > 0)
+    {
+      void *addr = mmap(nullptr, (size_t)ibdMapSize, PROT_READ, MAP_SHARED, fd, 0);
+      ::close(fd); //The mapping keeps its own reference to the file
+      if(addr == MAP_FAILED)
+      {
+        ibdMapSize = 0;
+        throw std::runtime_error("ERROR: ImzMLBinRead could not memory map the imzML ibd file.\n"); 
+      }
+      ibdMap = (const char*)addr;
+      setAccessPattern(bSequentialAccess);
+    }
+    else
+    {
+      ::close(fd);
+      ibdMap = nullptr;
+    }
+    return;
+  }
+#endif
+  
   ibdFile.open(ibdFname.get_cstring(), std::fstream::in | std::ios::binary);
   if(!ibdFile.is_open())
   {
@@ -328,10 +582,159 @@ void ImzMLBinRead::open()
   }
 }
 
+void ImzMLBinRead::close()
+{
+#ifndef _WIN32
+  if(ibdMap != nullptr)
+  {
+    munmap((void*)ibdMap, (size_t)ibdMapSize);
+    ibdMap = nullptr;
+    ibdMapSize = 0;
+    ibdMapCursor = 0;
+  }
+#endif
+  prefetchedRanges.clear();
+  ImzMLBin::close();
+}
+
+void ImzMLBinRead::setAccessPattern(bool sequential)
+{
+  bSequentialAccess = sequential;
+#ifndef _WIN32
+  if(ibdMap != nullptr)
+  {
+    madvise((void*)ibdMap, (size_t)ibdMapSize, bSequentialAccess ? MADV_SEQUENTIAL : MADV_RANDOM); //Just a hint, errors are not relevant
+  }
+#endif
+}
+
+bool ImzMLBinRead::get_memoryMapped()
+{
+  return bMemoryMapped;
+}
+
+void ImzMLBinRead::getPixelByteRange(int pixelID, std::streamoff &begin, std::streamoff &end)
+{
+  //The rMSI peak list format stores area, SNR and binSize after the intensities
+  const std::streamoff intBytes = (std::streamoff)get_intLength(pixelID)*intDataPointBytes*(bPeakListInrMSIFormat ? 4 : 1);
+  begin = get_intOffset(pixelID);
+  end = begin + intBytes;
+  if(!get_continuous())
+  {
+    const std::streamoff mzBegin = get_mzOffset(pixelID);
+    const std::streamoff mzEnd = mzBegin + (std::streamoff)get_mzLength(pixelID)*mzDataPointBytes;
+    if(mzEnd <= begin && begin - mzEnd <= PREFETCH_MAX_GAP)
+    {
+      begin = mzBegin; //Usually the mass axis is just before the intensities
+    }
+    else if(mzBegin >= end && mzBegin - end <= PREFETCH_MAX_GAP)
+    {
+      end = mzEnd;
+    }
+  }
+}
+
+void ImzMLBinRead::prefetch(std::streamoff offset, std::streamoff byteCount)
+{
+  if(byteCount <= 0)
+  {
+    return;
+  }
+  
+#ifndef _WIN32
+  if(ibdMap != nullptr)
+  {
+    //Page aligned hint, errors are not relevant
+    const std::streamoff pageSize = sysconf(_SC_PAGESIZE);
+    const std::streamoff alignedOffset = std::max((std::streamoff)0, offset - offset % pageSize);
+    const std::streamoff alignedEnd = std::min(ibdMapSize, offset + byteCount);
+    if(alignedEnd > alignedOffset)
+    {
+      madvise((void*)(ibdMap + alignedOffset), (size_t)(alignedEnd - alignedOffset), MADV_WILLNEED);
+    }
+    return;
+  }
+#endif
+  
+  if(bMemoryMapped)
+  {
+    return; //Nothing is mapped, it happens with an empty file or a closed reader
+  }
+  
+  //Best effort, if the range can not be read the following reads just access the file as usual
+  std::lock_guard<std::mutex> lock(ibdFileMutex);
+  PrefetchedRange &range = prefetchedRanges[std::this_thread::get_id()];
+  range.buffer.resize(byteCount);
+  range.offset = offset;
+  ibdFile.seekg(offset);
+  ibdFile.read(range.buffer.data(), byteCount);
+  threadReadCounters.fileReads++;
+  threadReadCounters.fileReadBytes += byteCount;
+  if(ibdFile.fail() || ibdFile.bad())
+  {
+    range.buffer.clear();
+    ibdFile.clear();
+  }
+}
+
+thread_local ImzMLBinRead::ReadCounters ImzMLBinRead::threadReadCounters = {0, 0.0, 0.0};
+
+ImzMLBinRead::ReadCounters ImzMLBinRead::getThreadReadCounters()
+{
+  return threadReadCounters;
+}
+
+const double* ImzMLBinRead::mappedMzData(std::streampos offset, unsigned int N)
+{
+  if(ibdMap == nullptr || mzDataType != float64 || offset < 0 || ((std::streamoff)offset % sizeof(double)) != 0)
+  {
+    return nullptr;
+  }
+  
+  if( ((std::streamoff)offset + (std::streamoff)(N*sizeof(double))) > ibdMapSize )
+  {
+    throw std::runtime_error("ERROR: ImzMLBinRead reached EOF reading the mapped imzML ibd file.\n"); 
+  }
+  
+  threadReadCounters.mappedBytes += N*sizeof(double);
+  return (const double*)(ibdMap + (std::streamoff)offset); //The mapping is page aligned so the pointer is aligned as double
+}
+
 void ImzMLBinRead::readDataCommon(std::streampos offset, unsigned int N, double* ptr, unsigned int dataPointBytes, imzMLDataType dataType)
 {
   unsigned int byteCount = N*dataPointBytes;
-  char* buffer = new char [byteCount];
+  
+  if(ibdMap != nullptr)
+  {
+    //Memory mapped file, decode directely from the mapped pages
+    std::streamoff readOffset = offset >= 0 ? (std::streamoff)offset : ibdMapCursor.load();
+    if( (readOffset + (std::streamoff)byteCount) > ibdMapSize )
+    {
+      throw std::runtime_error("ERROR: ImzMLBinRead reached EOF reading the mapped imzML ibd file.\n"); 
+    }
+    decodeDataCommon(ibdMap + readOffset, N, ptr, dataType);
+    ibdMapCursor = readOffset + byteCount;
+    threadReadCounters.mappedBytes += byteCount;
+    return;
+  }
+  else if(bMemoryMapped && N > 0)
+  {
+    //Mapping requested but not available, this happens with an empty file or a closed reader
+    throw std::runtime_error("ERROR: ImzMLBinRead reading from a non mapped imzML ibd file.\n"); 
+  }
+  
+  ScratchArena::Scope scratch;
+  char* buffer = scratch.alloc<char>(byteCount);
+  std::lock_guard<std::mutex> lock(ibdFileMutex); //The stream position is shared so seek and read must be atomic
+  
+  std::map<std::thread::id, PrefetchedRange>::iterator range = offset >= 0 ? prefetchedRanges.find(std::this_thread::get_id()) : prefetchedRanges.end();
+  if(range != prefetchedRanges.end() && (std::streamoff)offset >= range->second.offset && 
+     (std::streamoff)offset + (std::streamoff)byteCount <= range->second.offset + (std::streamoff)range->second.buffer.size())
+  {
+    //Inside the range prefetched by this thread, so there is no need to access the file
+    decodeDataCommon(range->second.buffer.data() + ((std::streamoff)offset - range->second.offset), N, ptr, dataType);
+    return;
+  }
   
   if(offset >= 0)
   {
@@ -347,6 +750,8 @@ void ImzMLBinRead::readDataCommon(std::streampos offset, unsigned int N, double*
   }
   
   ibdFile.read (buffer, byteCount);
+  threadReadCounters.fileReads++;
+  threadReadCounters.fileReadBytes += byteCount;
   if(ibdFile.eof())
   {
     throw std::runtime_error("ERROR: ImzMLBinRead reached EOF reading the imzML ibd file.\n"); 
@@ -356,31 +761,45 @@ void ImzMLBinRead::readDataCommon(std::streampos offset, unsigned int N, double*
     throw std::runtime_error("FATAL ERROR: ImzMLBinRead got fail or bad bit condition reading the imzML ibd file.\n"); 
   }
   
+  decodeDataCommon(buffer, N, ptr, dataType);
+}
+
+void ImzMLBinRead::decodeDataCommon(const char* bytes, unsigned int N, double* ptr, imzMLDataType dataType)
+{
   switch(dataType)
   {
   case int32:
-    convertBytes2Double<int32_t>(buffer, ptr, N);
+    convertBytes2Double<int32_t>(bytes, ptr, N);
     break;
     
   case float32:  
-    convertBytes2Double<float>(buffer, ptr, N);
+    convertBytes2Double<float>(bytes, ptr, N);
     break;
     
   case int64:
-    convertBytes2Double<int64_t>(buffer, ptr, N);
+    convertBytes2Double<int64_t>(bytes, ptr, N);
     break;
     
   case float64:
-    //convertBytes2Double<double>(buffer, ptr, N); If double there is no need of intermediate conversion
-    memcpy(ptr, buffer, sizeof(double)*N);
+    //convertBytes2Double<double>(bytes, ptr, N); If double there is no need of intermediate conversion
+    memcpy(ptr, bytes, sizeof(double)*N);
     break;
   }
-  
-  delete[] buffer;
 }
 
 void ImzMLBinRead::readUUID(char* uuid)
 {
+  if(ibdMap != nullptr)
+  {
+    if(ibdMapSize < 16)
+    {
+      throw std::runtime_error("ERROR: ImzMLBin reached EOF reading the imzML ibd file.\n"); 
+    }
+    memcpy(uuid, ibdMap, 16);
+    return;
+  }
+  
+  std::lock_guard<std::mutex> lock(ibdFileMutex);
   ibdFile.seekg(0);
   if(ibdFile.eof())
   {
@@ -412,15 +831,16 @@ void ImzMLBinRead::readMzData(std::streampos offset, unsigned int N, double* ptr
     }
     
     //In continuous mode avoid re-reading the same offset
+    std::lock_guard<std::mutex> lock(originalMassAxisMutex); //The first reading may be triggered from multiple threads at once
     if(!bOriginalMassAxisOnMem)
     {
       //First reading of the mass axis
       originalMassAxis.resize(N);
       readDataCommon(offset, N, originalMassAxis.data(), mzDataPointBytes, mzDataType);  
-      bOriginalMassAxisOnMem = true;
       
       //Re-check if equals to the common mass axis
       checkCompareOriginalMassAxisAndCommonMassAxis();
+      bOriginalMassAxisOnMem = true; //Set at the end, so bForceResampling is valid for any thread seeing it
     }
   
     //Mass axis already in mem so just copy from it
@@ -469,6 +889,47 @@ void ImzMLBinRead::checkCompareOriginalMassAxisAndCommonMassAxis()
       }
     }
   } 
+  
+  computeResamplingPlan();
+}
+
+//Compute the original mass channel and the weight used to resample each common mass axis point of continuous data.
+//The plan follows the same rules as mlinterp, so values out of the original mass range take the value of the nearest edge.
+void ImzMLBinRead::computeResamplingPlan()
+{
+  resampleIndex.clear();
+  resampleWeight.clear();
+  
+  //The plan is only used for continuous data with a different mass axis, at least two original mass channels are needed
+  if(!get_continuous() || !bForceResampling || originalMassAxis.size() < 2)
+  {
+    return;
+  }
+  
+  resampleIndex.resize(commonMassAxis.size());
+  resampleWeight.resize(commonMassAxis.size());
+  const unsigned int lastIndex = originalMassAxis.size() - 1;
+  for(unsigned int i = 0; i < commonMassAxis.size(); i++)
+  {
+    const double x = commonMassAxis[i];
+    if( x <= originalMassAxis[0] )
+    {
+      resampleIndex[i] = 0;
+      resampleWeight[i] = 1.0;
+    }
+    else if( x >= originalMassAxis[lastIndex] )
+    {
+      resampleIndex[i] = lastIndex - 1;
+      resampleWeight[i] = 0.0;
+    }
+    else
+    {
+      //First original mass channel strictly greater than x, it is always in the range [1, lastIndex]
+      unsigned int upper = std::upper_bound(originalMassAxis.begin(), originalMassAxis.end(), x) - originalMassAxis.begin();
+      resampleIndex[i] = upper - 1;
+      resampleWeight[i] = (originalMassAxis[upper] - x) / (originalMassAxis[upper] - originalMassAxis[upper - 1]);
+    }
+  }
 }
 
 //Read a single spectrum from the imzML data
@@ -481,6 +942,14 @@ void ImzMLBinRead::checkCompareOriginalMassAxisAndCommonMassAxis()
 //offset_proc_data: offset to start reading spectra in processed mode to skip all the inital mass axis. It will be modified with the last readed mass offset.
 imzMLSpectrum ImzMLBinRead::ReadSpectrum(int pixelID, unsigned int ionIndex, unsigned int ionCount, double *out, 
                                          bool bRunLinearInterpolationOnLoad, unsigned int offset_proc_data)
+{
+  imzMLSpectrum imzMLSpc;
+  ReadSpectrum(pixelID, ionIndex, ionCount, out, imzMLSpc, bRunLinearInterpolationOnLoad, offset_proc_data);
+  return imzMLSpc;
+}
+
+void ImzMLBinRead::ReadSpectrum(int pixelID, unsigned int ionIndex, unsigned int ionCount, double *out, imzMLSpectrum &imzMLSpc,
+                                bool bRunLinearInterpolationOnLoad, unsigned int offset_proc_data)
 {
   if(commonMassAxis.size() == 0)
   {
@@ -492,8 +961,10 @@ imzMLSpectrum ImzMLBinRead::ReadSpectrum(int pixelID, unsigned int ionIndex, uns
     throw std::runtime_error("Error: mass channels out of range\n"); 
   }
   
-  imzMLSpectrum imzMLSpc;
   imzMLSpc.pixelID = pixelID;
+  imzMLSpc.resample_offset = 0;
+  imzMLSpc.imzMLmass.clear(); //clear() keeps the capacity of a reused imzMLSpectrum
+  imzMLSpc.imzMLintensity.clear();
   
   if(get_continuous() && !bOriginalMassAxisOnMem)
   {
@@ -509,6 +980,20 @@ imzMLSpectrum ImzMLBinRead::ReadSpectrum(int pixelID, unsigned int ionIndex, uns
     //Continuous mode, just load the spectrum intensity vector
     readIntData(get_intOffset(pixelID) + (std::streampos)(ionIndex*get_intEncodingBytes()), ionCount, out);  
   }
+  else if(get_continuous() && resampleIndex.size() > 0)
+  {
+    //Continuous mode with a different mass axis, the resampling plan provides the original mass channels to read
+    imzMLSpc.resample_offset = resampleIndex[ionIndex];
+    imzMLSpc.last_offset = resampleIndex[ionIndex + ionCount - 1];
+    imzMLSpc.imzMLintensity.resize(imzMLSpc.last_offset + 2 - imzMLSpc.resample_offset);
+    readIntData(get_intOffset(pixelID) + (std::streampos)((std::streamoff)imzMLSpc.resample_offset*get_intEncodingBytes()), imzMLSpc.imzMLintensity.size(), imzMLSpc.imzMLintensity.data());
+    
+    //Linear interpolation
+    if(bRunLinearInterpolationOnLoad)
+    {
+      InterpolateSpectrum(&imzMLSpc, ionIndex, ionCount, out);
+    }
+  }
   else
   {
     //Interpolation is needed because one of the followings:
@@ -524,83 +1009,62 @@ imzMLSpectrum ImzMLBinRead::ReadSpectrum(int pixelID, unsigned int ionIndex, uns
     //Read processed mode mass and intensity
     try
     {
-      //Complex read by searching the apropiate mass
-      double current_mass;
-      unsigned int start_ioffset = offset_proc_data; //Offset at which start reading the spectrum
-      unsigned int found_ioffset = start_ioffset;
-      unsigned int last_ioffset = start_ioffset;
+      //Locate the mass window using binary search and then read it with a single access for mass and intensity
+      const unsigned int mzLength = get_mzLength(pixelID);
+      const unsigned int start_ioffset = offset_proc_data; //Offset at which start reading the spectrum
+      unsigned int lower_ioffset; //First mass channel greater or equal than the first common mass
+      unsigned int upper_ioffset; //First mass channel greater than the last common mass
+      bool bMassOnMem = false; //Set to true when the mass window is already loaded in imzMLSpc.imzMLmass
       
-      if(!get_continuous())
+      if(start_ioffset >= mzLength)
       {
-        ibdFile.seekg(get_mzOffset(pixelID) +  (std::streampos)(start_ioffset*get_mzEncodingBytes()));
-        if(ibdFile.eof())
-        {
-          throw std::runtime_error("ERROR: mass look-up reached EOF seeking the imzML ibd file.\n"); 
-        }
-        if(ibdFile.fail() || ibdFile.bad())
-        {
-          throw std::runtime_error("FATAL ERROR: mass look-up got fail or bad bit condition seeking the imzML ibd file.\n"); 
-        }
+        lower_ioffset = start_ioffset;
+        upper_ioffset = start_ioffset;
       }
-      
-      //Search the first mass channel
-      unsigned int ioffset = start_ioffset;
-      while( ioffset < get_mzLength(pixelID) )
+      else if(get_continuous())
       {
-        if(get_continuous())
-        {
-          current_mass = originalMassAxis[ioffset];
-        }
-        else
-        {
-          readMzData(-1, 1, &current_mass); //Read a single mass channel
-        }
-        if( current_mass >= commonMassAxis[ionIndex])
-        {
-          break;
-        }
-        found_ioffset = ioffset;
-        ioffset++;
+        lower_ioffset = std::lower_bound(originalMassAxis.begin() + start_ioffset, originalMassAxis.begin() + mzLength, commonMassAxis[ionIndex]) - originalMassAxis.begin();
+        upper_ioffset = std::upper_bound(originalMassAxis.begin() + start_ioffset, originalMassAxis.begin() + mzLength, commonMassAxis[ionIndex + ionCount -1]) - originalMassAxis.begin();
       }
-      
-      //Read the mass channel till get the last
-      if(!get_continuous())
+      else if( (mzLength - start_ioffset) <= MASS_LOOKUP_BLOCK )
       {
-        ibdFile.seekg(get_mzOffset(pixelID) +  (std::streampos)(found_ioffset*get_mzEncodingBytes()));
-        if(ibdFile.eof())
-        {
-          throw std::runtime_error("ERROR: mass read reached EOF seeking the imzML ibd file.\n"); 
-        }
-        if(ibdFile.fail() || ibdFile.bad())
-        {
-          throw std::runtime_error("FATAL ERROR: mass read got fail or bad bit condition seeking the imzML ibd file.\n"); 
-        }
+        //Small spectrum, read the whole remaining mass axis at once and search it in memory
+        imzMLSpc.imzMLmass.resize(mzLength - start_ioffset);
+        readMzData(get_mzOffset(pixelID) + (std::streampos)((std::streamoff)start_ioffset*get_mzEncodingBytes()), imzMLSpc.imzMLmass.size(), imzMLSpc.imzMLmass.data());
+        lower_ioffset = start_ioffset + (std::lower_bound(imzMLSpc.imzMLmass.begin(), imzMLSpc.imzMLmass.end(), commonMassAxis[ionIndex]) - imzMLSpc.imzMLmass.begin());
+        upper_ioffset = start_ioffset + (std::upper_bound(imzMLSpc.imzMLmass.begin(), imzMLSpc.imzMLmass.end(), commonMassAxis[ionIndex + ionCount -1]) - imzMLSpc.imzMLmass.begin());
+        bMassOnMem = true;
       }
-      ioffset = found_ioffset;
-      while( ioffset < get_mzLength(pixelID) )
+      else
       {
-        if(get_continuous())
-        {
-          current_mass = originalMassAxis[ioffset];
-        }
-        else
-        {
-          readMzData(-1, 1, &current_mass); //Read a single mass channel
-        }
-        imzMLSpc.imzMLmass.push_back(current_mass);
-        if( current_mass > commonMassAxis[ionIndex + ionCount -1] )
-        {
-          break;
-        }
-        last_ioffset = ioffset;
-        ioffset++;
+        lower_ioffset = searchMassIndex(pixelID, start_ioffset, commonMassAxis[ionIndex], false);
+        upper_ioffset = searchMassIndex(pixelID, lower_ioffset, commonMassAxis[ionIndex + ionCount -1], true);
       }
       
-      imzMLSpc.last_offset = last_ioffset;
+      //Keep the previous mass channel and the following one to allow the interpolation at the window edges
+      unsigned int found_ioffset = lower_ioffset > start_ioffset ? (lower_ioffset - 1) : start_ioffset;
+      unsigned int end_ioffset = upper_ioffset < mzLength ? (upper_ioffset + 1) : mzLength;
+      end_ioffset = end_ioffset < found_ioffset ? found_ioffset : end_ioffset;
+      imzMLSpc.last_offset = upper_ioffset > found_ioffset ? (upper_ioffset - 1) : start_ioffset;
+      
+      if(bMassOnMem)
+      {
+        imzMLSpc.imzMLmass.erase(imzMLSpc.imzMLmass.begin() + (end_ioffset - start_ioffset), imzMLSpc.imzMLmass.end());
+        imzMLSpc.imzMLmass.erase(imzMLSpc.imzMLmass.begin(), imzMLSpc.imzMLmass.begin() + (found_ioffset - start_ioffset));
+      }
+      else if(get_continuous())
+      {
+        imzMLSpc.imzMLmass.assign(originalMassAxis.begin() + found_ioffset, originalMassAxis.begin() + end_ioffset);
+      }
+      else
+      {
+        imzMLSpc.imzMLmass.resize(end_ioffset - found_ioffset);
+        readMzData(get_mzOffset(pixelID) + (std::streampos)((std::streamoff)found_ioffset*get_mzEncodingBytes()), imzMLSpc.imzMLmass.size(), imzMLSpc.imzMLmass.data());
+      }
       imzMLSpc.imzMLintensity.resize(imzMLSpc.imzMLmass.size());
       
       //Read the corresponding intensity
-      readIntData(get_intOffset(pixelID) + (std::streampos)(found_ioffset*get_intEncodingBytes()), imzMLSpc.imzMLintensity.size(), imzMLSpc.imzMLintensity.data());
+      readIntData(get_intOffset(pixelID) + (std::streampos)((std::streamoff)found_ioffset*get_intEncodingBytes()), imzMLSpc.imzMLintensity.size(), imzMLSpc.imzMLintensity.data());
     }
     catch(std::runtime_error &e)
     {
@@ -613,8 +1077,61 @@ imzMLSpectrum ImzMLBinRead::ReadSpectrum(int pixelID, unsigned int ionIndex, uns
       InterpolateSpectrum(&imzMLSpc, ionIndex, ionCount, out);
     }
   }
+}
+
+//Search a mass value in the mass axis of a processed mode spectrum using binary search.
+//The ibd file is probed one mass channel at a time until the remaining window fits in MASS_LOOKUP_BLOCK channels, then the window is read at once.
+//pixelID: the pixel ID of the spectrum to search.
+//startIndex: the mass channel at which the search starts.
+//target: the mass value to look for.
+//bUpperBound: if false the index of the first mass greater or equal than target is returned, if true the index of the first mass strictly greater than target.
+unsigned int ImzMLBinRead::searchMassIndex(int pixelID, unsigned int startIndex, double target, bool bUpperBound)
+{
+  unsigned int lo = startIndex;
+  unsigned int hi = get_mzLength(pixelID);
+  unsigned int mid;
+  double probe;
   
-  return imzMLSpc;
+  //Memory mapped float64 data can be searched in place without any copy
+  const double* mappedMass = hi > lo ? mappedMzData(get_mzOffset(pixelID) + (std::streampos)((std::streamoff)lo*get_mzEncodingBytes()), hi - lo) : nullptr;
+  if(mappedMass != nullptr)
+  {
+    if(bUpperBound)
+    {
+      return lo + (std::upper_bound(mappedMass, mappedMass + (hi - lo), target) - mappedMass);
+    }
+    return lo + (std::lower_bound(mappedMass, mappedMass + (hi - lo), target) - mappedMass);
+  }
+  
+  while( (hi - lo) > MASS_LOOKUP_BLOCK )
+  {
+    mid = lo + (hi - lo)/2;
+    readMzData(get_mzOffset(pixelID) + (std::streampos)((std::streamoff)mid*get_mzEncodingBytes()), 1, &probe);
+    if( bUpperBound ? (probe <= target) : (probe < target) )
+    {
+      lo = mid + 1;
+    }
+    else
+    {
+      hi = mid;
+    }
+  }
+  
+  if(hi > lo)
+  {
+    std::vector<double> massLookupBuffer(hi - lo); //Local buffer so the search can run concurrently from multiple threads
+    readMzData(get_mzOffset(pixelID) + (std::streampos)((std::streamoff)lo*get_mzEncodingBytes()), massLookupBuffer.size(), massLookupBuffer.data());
+    if(bUpperBound)
+    {
+      lo += std::upper_bound(massLookupBuffer.begin(), massLookupBuffer.end(), target) - massLookupBuffer.begin();
+    }
+    else
+    {
+      lo += std::lower_bound(massLookupBuffer.begin(), massLookupBuffer.end(), target) - massLookupBuffer.begin();
+    }
+  }
+  
+  return lo;
 }
 
 void ImzMLBinRead::ReadSpectra(unsigned int numOfPixels, unsigned int *pixelIDs, unsigned int ionIndex, unsigned int ionCount, double *out, unsigned int number_of_threads, bool bUpdate_pixel_read_offsets)
@@ -723,7 +1240,20 @@ void ImzMLBinRead::ReadSpectraTemplateType(unsigned int numOfPixels, unsigned in
 //out: a pointer where data will be stored.
 void ImzMLBinRead::InterpolateSpectrum(imzMLSpectrum *imzMLSpc, unsigned int ionIndex, unsigned int ionCount, double *out)
 {
-  if(!get_continuous() || bForceResampling) 
+  if(get_continuous() && bForceResampling && resampleIndex.size() > 0)
+  {
+    //Apply the resampling plan, the left and right original values are weighted without any search
+    const double *y = imzMLSpc->imzMLintensity.data();
+    const unsigned int *index = resampleIndex.data() + ionIndex;
+    const double *weight = resampleWeight.data() + ionIndex;
+    const unsigned int offset = imzMLSpc->resample_offset;
+    for(unsigned int i = 0; i < ionCount; i++)
+    {
+      const unsigned int j = index[i] - offset;
+      out[i] = y[j + 1] + weight[i] * (y[j] - y[j + 1]);
+    }
+  }
+  else if(!get_continuous() || bForceResampling) 
   {
     //Only inpterpolate for data in processed mode or different mass axis in continuous mode
     
@@ -748,6 +1278,21 @@ void ImzMLBinRead::InterpolateSpectrum(imzMLSpectrum *imzMLSpc, unsigned int ion
 }
 
 PeakPicking::Peaks *ImzMLBinRead::ReadPeakList(int pixelID)
+{
+  PeakPicking::Peaks *mPeaks = new PeakPicking::Peaks;
+  try
+  {
+    ReadPeakList(pixelID, mPeaks);
+  }
+  catch(std::runtime_error &e)
+  {
+    delete mPeaks;
+    throw;
+  }
+  return mPeaks;
+}
+
+void ImzMLBinRead::ReadPeakList(int pixelID, PeakPicking::Peaks *mPeaks)
 {
   if(get_continuous())
   {
@@ -760,15 +1305,11 @@ PeakPicking::Peaks *ImzMLBinRead::ReadPeakList(int pixelID)
     throw std::runtime_error("Error: different mass and intensity length in the imzML data\n"); 
   }
   
-  PeakPicking::Peaks *mPeaks = new PeakPicking::Peaks;
   mPeaks->mass.resize(massLength);
   mPeaks->intensity.resize(massLength);
-  if(bPeakListInrMSIFormat)
-  {
-    mPeaks->area.resize(massLength);
-    mPeaks->SNR.resize(massLength);
-    mPeaks->binSize.resize(massLength);
-  }
+  mPeaks->area.resize(bPeakListInrMSIFormat ? massLength : 0);
+  mPeaks->SNR.resize(bPeakListInrMSIFormat ? massLength : 0);
+  mPeaks->binSize.resize(bPeakListInrMSIFormat ? massLength : 0);
   
   std::streampos rMSIPeakDataOffset;
   //Read peak list data
@@ -790,8 +1331,6 @@ PeakPicking::Peaks *ImzMLBinRead::ReadPeakList(int pixelID)
   {
     throw std::runtime_error(e.what());
   }
-  
-  return mPeaks;
 }
 
 bool ImzMLBinRead::get_rMSIPeakListFormat()
@@ -799,10 +1338,19 @@ bool ImzMLBinRead::get_rMSIPeakListFormat()
   return bPeakListInrMSIFormat;
 }
 
+bool ImzMLBinRead::get_interpolationRequired()
+{
+  return !get_continuous() || bForceResampling;
+}
+
 ImzMLBinWrite::ImzMLBinWrite(const char* ibd_fname,  unsigned int num_of_pixels, Rcpp::String Str_mzType, Rcpp::String Str_intType, bool continuous, bool sequentialMode, bool openIbd) :
   ImzMLBin(ibd_fname, num_of_pixels, Str_mzType, Str_intType, continuous, sequentialMode? Mode::SequentialWriteFile : Mode::ModifyFile ),
   sequentialWriteIndex_IntData(0), 
-  sequentialWriteIndex_MzData(0)
+  sequentialWriteIndex_MzData(0),
+#ifndef _WIN32
+  concurrentFd(-1),
+#endif
+  reservedEnd(0)
 {
   if(openIbd)
   {
@@ -812,7 +1360,7 @@ ImzMLBinWrite::ImzMLBinWrite(const char* ibd_fname,  unsigned int num_of_pixels,
 
 ImzMLBinWrite::~ImzMLBinWrite()
 {
-  //Empty desctructor
+  close(); //Base class destructor can not close the concurrent writing file descriptor
 }
 
 void ImzMLBinWrite::open(bool truncate)
@@ -1035,8 +1583,19 @@ void ImzMLBinWrite::writeDataCommon(unsigned int N, double* ptr, unsigned int da
   }
   
   unsigned int byteCount = N*dataPointBytes;
-  char* buffer = new char [byteCount];
+  ScratchArena::Scope scratch;
+  char* buffer = scratch.alloc<char>(byteCount);
+  encodeData(N, ptr, dataType, buffer);
   
+  ibdFile.write (buffer, byteCount);
+  if(ibdFile.fail() || ibdFile.bad())
+  {
+    throw std::runtime_error("FATAL ERROR: ImzMLBinWrite got fail or bad bit condition writing the imzML ibd file.\n"); 
+  }
+}
+
+void ImzMLBinWrite::encodeData(unsigned int N, double* ptr, imzMLDataType dataType, char* buffer)
+{
   //copy the ptr contents to the wrting buffer in the apropiate format 
   switch(dataType)
   {
@@ -1057,14 +1616,256 @@ void ImzMLBinWrite::writeDataCommon(unsigned int N, double* ptr, unsigned int da
       memcpy(buffer, ptr, sizeof(double)*N);
       break;
   }
+}
+
+void ImzMLBinWrite::openConcurrent(unsigned int N, double* massAxis)
+{
+  if(fileMode == Mode::ModifyFile)
+  {
+    throw std::runtime_error("ERROR: ibd file was opened in an invalid mode for concurrent writing");
+  }
   
-  ibdFile.write (buffer, byteCount);
-  if(ibdFile.fail() || ibdFile.bad())
+#ifndef _WIN32
+  if(concurrentFd >= 0)
   {
-    throw std::runtime_error("FATAL ERROR: ImzMLBinWrite got fail or bad bit condition writing the imzML ibd file.\n"); 
+    return; //Already opened
+  }
+  
+  concurrentFd = ::open(ibdFname.get_cstring(), O_WRONLY);
+  if(concurrentFd < 0)
+#else
+  if(concurrentFile.is_open())
+  {
+    return; //Already opened
+  }
+  
+  concurrentFile.open(ibdFname.get_cstring(), std::fstream::in | std::fstream::out | std::ios::binary);
+  if(!concurrentFile.is_open())
+#endif
+  {
+    throw std::runtime_error("Error: ImzMLBinWrite could not open the imzML ibd file.\n");
   }
   
-  delete[] buffer;
+  if(reservedEnd > 0)
+  {
+    return; //Reopened, the offsets were already reserved
+  }
+  
+  //Data is written after the UUID
+#ifndef _WIN32
+  struct stat fileStats;
+  if(fstat(concurrentFd, &fileStats) != 0)
+  {
+    close();
+    throw std::runtime_error("ERROR: ImzMLBinWrite could not get the size of the imzML ibd file.\n"); 
+  }
+  std::streamoff fileEnd = (std::streamoff)fileStats.st_size;
+#else
+  concurrentFile.seekp(0, std::ios::end);
+  std::streamoff fileEnd = (std::streamoff)concurrentFile.tellp();
+  if(concurrentFile.fail() || fileEnd < 0)
+  {
+    close();
+    throw std::runtime_error("ERROR: ImzMLBinWrite could not get the size of the imzML ibd file.\n"); 
+  }
+#endif
+  
+  if(get_continuous())
+  {
+    //The mass axis is shared by all pixels and it is followed by the intensities of each pixel in pixel order
+    std::streamoff intBytes = (std::streamoff)N*intDataPointBytes;
+    for(unsigned int i = 0; i < Npixels; i++)
+    {
+      Offsets[i].mzOffset = fileEnd;
+      Offsets[i].mzLength = N;
+      Offsets[i].intOffset = fileEnd + (std::streamoff)N*mzDataPointBytes + i*intBytes;
+      Offsets[i].intLength = N;
+    }
+    
+    try
+    {
+      ScratchArena::Scope scratch;
+      char* buffer = scratch.alloc<char>(N*mzDataPointBytes);
+      encodeData(N, massAxis, mzDataType, buffer);
+      positionedWrite(fileEnd, buffer, N*mzDataPointBytes);
+    }
+    catch(...)
+    {
+      close();
+      throw;
+    }
+    fileEnd += (std::streamoff)N*mzDataPointBytes + Npixels*intBytes;
+  }
+  reservedEnd = fileEnd;
+}
+
+void ImzMLBinWrite::writeIntDataAt(unsigned int pixelIndex, unsigned int N, double* ptr)
+{
+  if(!get_continuous())
+  {
+    throw std::runtime_error("ERROR: precomputed offsets are only available for imzML in continuous mode");
+  }
+  
+  if(pixelIndex >= Npixels || N != Offsets[pixelIndex].intLength)
+  {
+    throw std::runtime_error("ERROR: trying to write spectral data out of the reserved space of the imzML ibd file");
+  }
+  
+  ScratchArena::Scope scratch;
+  char* buffer = scratch.alloc<char>(N*intDataPointBytes);
+  encodeData(N, ptr, intDataType, buffer);
+  positionedWrite(Offsets[pixelIndex].intOffset, buffer, N*intDataPointBytes);
+}
+
+void ImzMLBinWrite::reserveSpectrumAt(unsigned int pixelIndex, unsigned int N)
+{
+  if(get_continuous())
+  {
+    throw std::runtime_error("ERROR: the space of each pixel is precomputed for imzML in continuous mode, use writeIntDataAt()");
+  }
+  
+  if(pixelIndex >= Npixels)
+  {
+    throw std::runtime_error("ERROR: trying to write more spectral data than the maximum number of pixels set in the constructor");
+  }
+  
+  std::streamoff offset = reserveBytes((std::streamoff)N*(mzDataPointBytes + intDataPointBytes));
+  Offsets[pixelIndex].mzOffset = offset;
+  Offsets[pixelIndex].mzLength = N;
+  Offsets[pixelIndex].intOffset = offset + (std::streamoff)N*mzDataPointBytes;
+  Offsets[pixelIndex].intLength = N;
+}
+
+void ImzMLBinWrite::reservePeakListAt(unsigned int pixelIndex, unsigned int N)
+{
+  if(get_continuous())
+  {
+    throw std::runtime_error("ERROR: peaklist are only supported for imzML in processed mode");
+  }
+  
+  if(pixelIndex >= Npixels)
+  {
+    throw std::runtime_error("ERROR: trying to write more spectral data than the maximum number of pixels set in the constructor");
+  }
+  
+  //Same layout as writePeakList(): the peak masses followed by intensity, area, SNR and binSize
+  std::streamoff offset = reserveBytes((std::streamoff)N*(mzDataPointBytes + 4*intDataPointBytes));
+  Offsets[pixelIndex].mzOffset = offset;
+  Offsets[pixelIndex].mzLength = N;
+  Offsets[pixelIndex].intOffset = offset + (std::streamoff)N*mzDataPointBytes;
+  Offsets[pixelIndex].intLength = N;
+}
+
+void ImzMLBinWrite::writeSpectrumAt(unsigned int pixelIndex, unsigned int N, double* ptrMass, double* ptrIntensity)
+{
+  if(get_continuous())
+  {
+    throw std::runtime_error("ERROR: the space of each pixel is precomputed for imzML in continuous mode, use writeIntDataAt()");
+  }
+  
+  if(pixelIndex >= Npixels || Offsets[pixelIndex].mzOffset == (std::streampos)0 || N != Offsets[pixelIndex].mzLength)
+  {
+    throw std::runtime_error("ERROR: trying to write spectral data out of the reserved space of the imzML ibd file");
+  }
+  
+  //Mass and intensities are encoded to a single buffer to write them at once
+  const size_t mzBytes = (size_t)N*mzDataPointBytes;
+  const size_t byteCount = mzBytes + (size_t)N*intDataPointBytes;
+  ScratchArena::Scope scratch;
+  char* buffer = scratch.alloc<char>(byteCount);
+  encodeData(N, ptrMass, mzDataType, buffer);
+  encodeData(N, ptrIntensity, intDataType, buffer + mzBytes);
+  positionedWrite(Offsets[pixelIndex].mzOffset, buffer, byteCount);
+}
+
+void ImzMLBinWrite::writePeakListAt(unsigned int pixelIndex, unsigned int N, double* ptrMass, double* ptrIntensity, double* ptrArea, double* ptrSNR, double* ptrBinSize)
+{
+  if(get_continuous())
+  {
+    throw std::runtime_error("ERROR: peaklist are only supported for imzML in processed mode");
+  }
+  
+  if(pixelIndex >= Npixels || Offsets[pixelIndex].mzOffset == (std::streampos)0 || N != Offsets[pixelIndex].mzLength)
+  {
+    throw std::runtime_error("ERROR: trying to write spectral data out of the reserved space of the imzML ibd file");
+  }
+  
+  const size_t mzBytes = (size_t)N*mzDataPointBytes;
+  const size_t intBytes = (size_t)N*intDataPointBytes;
+  const size_t byteCount = mzBytes + 4*intBytes;
+  ScratchArena::Scope scratch;
+  char* buffer = scratch.alloc<char>(byteCount);
+  encodeData(N, ptrMass, mzDataType, buffer);
+  encodeData(N, ptrIntensity, intDataType, buffer + mzBytes);
+  encodeData(N, ptrArea, intDataType, buffer + mzBytes + intBytes);
+  encodeData(N, ptrSNR, intDataType, buffer + mzBytes + 2*intBytes);
+  encodeData(N, ptrBinSize, intDataType, buffer + mzBytes + 3*intBytes);
+  positionedWrite(Offsets[pixelIndex].mzOffset, buffer, byteCount);
+}
+
+void ImzMLBinWrite::close()
+{
+#ifndef _WIN32
+  if(concurrentFd >= 0)
+  {
+    ::close(concurrentFd);
+    concurrentFd = -1;
+  }
+#else
+  if(concurrentFile.is_open())
+  {
+    concurrentFile.close();
+  }
+#endif
+  ImzMLBin::close();
+}
+
+std::streamoff ImzMLBinWrite::reserveBytes(std::streamoff byteCount)
+{
+  std::lock_guard<std::mutex> lock(reserveMutex);
+  std::streamoff offset = reservedEnd;
+  reservedEnd += byteCount;
+  return offset;
+}
+
+void ImzMLBinWrite::positionedWrite(std::streamoff offset, const char* buffer, size_t byteCount)
+{
+#ifndef _WIN32
+  if(concurrentFd < 0)
+  {
+    throw std::runtime_error("ERROR: the imzML ibd file was not opened for concurrent writing\n");
+  }
+  
+  while(byteCount > 0)
+  {
+    ssize_t written = pwrite(concurrentFd, buffer, byteCount, (off_t)offset);
+    if(written < 0)
+    {
+      if(errno == EINTR)
+      {
+        continue;
+      }
+      throw std::runtime_error("FATAL ERROR: ImzMLBinWrite could not write the imzML ibd file.\n"); 
+    }
+    buffer += written;
+    offset += written;
+    byteCount -= written;
+  }
+#else
+  //There is no positioned write, so the writes are serialized on a stream
+  std::lock_guard<std::mutex> lock(concurrentFileMutex);
+  if(!concurrentFile.is_open())
+  {
+    throw std::runtime_error("ERROR: the imzML ibd file was not opened for concurrent writing\n");
+  }
+  
+  concurrentFile.seekp(offset);
+  concurrentFile.write(buffer, byteCount);
+  if(concurrentFile.fail() || concurrentFile.bad())
+  {
+    throw std::runtime_error("FATAL ERROR: ImzMLBinWrite could not write the imzML ibd file.\n"); 
+  }
+#endif
 }
 
 ///R METHODS////////////////////////////////////////////////////////////////////////
@@ -1161,6 +1962,95 @@ Rcpp::DataFrame testingimzMLBinWriteSequential(const char* ibdFname, Rcpp::Strin
   return NULL;
 }
 
+namespace
+{
+  //Times the selected and the scalar conversion kernels of a data type, returns the nanoseconds per element of each one
+  template<typename T>
+  Rcpp::NumericVector timeDataConversion(const double *values, unsigned int N, int reps)
+  {
+    std::vector<char> bytes(N*sizeof(T));
+    std::vector<double> decoded(N);
+    double ns[4];
+    for(int k = 0; k < 4; k++)
+    {
+      std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+      for(int r = 0; r < reps; r++)
+      {
+        switch(k)
+        {
+          case 0: encodeKernel<T>(values, bytes.data(), N); break;
+          case 1: decodeKernel<T>(bytes.data(), decoded.data(), N); break;
+          case 2: encodeScalar<T>(values, bytes.data(), N); break;
+          case 3: decodeScalar<T>(bytes.data(), decoded.data(), N); break;
+        }
+      }
+      ns[k] = 1e9*std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count()/((double)reps*(double)N);
+      
+      //The round trip must give the same values as the C casts
+      if(k % 2 == 1)
+      {
+        for(unsigned int i = 0; i < N; i++)
+        {
+          if(decoded[i] != (double)((T)values[i]))
+          {
+            throw std::runtime_error("Error: the data conversion kernels do not give the same values as the C casts\n");
+          }
+        }
+      }
+    }
+    
+    return Rcpp::NumericVector::create(Rcpp::Named("encode") = ns[0], Rcpp::Named("decode") = ns[1], 
+                                       Rcpp::Named("encode_scalar") = ns[2], Rcpp::Named("decode_scalar") = ns[3]);
+  }
+}
+
+//' Testing the imzML data conversion kernels
+//' Encodes and decodes a buffer in memory without accessing any file, so only the conversion between double and the imzML data type is timed.
+//' The scalar kernels are timed too for comparison.
+//' @param dataTypeString: String to specify the imzML data type ("int", "long", "float" or "double").
+//' @param values: the values to convert, they must be representable in the data type.
+//' @param reps: number of times each conversion is repeated.
+//' @return a vector with the nanoseconds per element of the encode, decode, encode_scalar and decode_scalar conversions.
+// [[Rcpp::export(name=".debug_imzMLDataConversion")]]
+Rcpp::NumericVector testingImzMLDataConversion(Rcpp::String dataTypeString, Rcpp::NumericVector values, int reps)
+{
+  Rcpp::NumericVector times;
+  try
+  {
+    if(reps < 1 || values.length() == 0)
+    {
+      throw std::runtime_error("Error: at least one value and one repetition are needed\n");
+    }
+    
+    if( dataTypeString == "int" )
+    {
+      times = timeDataConversion<int32_t>(values.begin(), values.length(), reps);
+    }
+    else if( dataTypeString == "long" )
+    {
+      times = timeDataConversion<int64_t>(values.begin(), values.length(), reps);
+    }
+    else if( dataTypeString == "float" )
+    {
+      times = timeDataConversion<float>(values.begin(), values.length(), reps);
+    }
+    else if( dataTypeString == "double" )
+    {
+      times = timeDataConversion<double>(values.begin(), values.length(), reps);
+    }
+    else
+    {
+      throw std::runtime_error("Error: invalid imzML datatype\n");
+    }
+  }
+  catch(std::runtime_error &e)
+  {
+    Rcpp::stop(e.what());
+  }
+  
+  return times;
+}
+
 //' CimzMLBinCreateNewIBD.
 //' This function creates a new ibd file with the provided uuid
 //' @param ibdFname: full path to the ibd file.
@@ -1412,7 +2302,11 @@ Rcpp::NumericMatrix Cload_imzMLSpectra(Rcpp::List rMSIobj, Rcpp::IntegerVector p
                              imzMLrun.nrows(), 
                              Rcpp::as<Rcpp::String>(imzML["mz_dataType"]),
                              Rcpp::as<Rcpp::String>(imzML["int_dataType"]) ,
-                             Rcpp::as<bool>(imzML["continuous_mode"]));
+                             Rcpp::as<bool>(imzML["continuous_mode"]),
+                             true, //Open the ibd file now
+                             false, //Spectral data, not a peak list
+                             true); //Memory mapped access
+    imzMLReader.setAccessPattern(false); //Pixels to display are usually scattered in the ibd file
     
     imzMLReader.setCommonMassAxis(commonMassAxis.length(), commonMassAxis.begin());
     
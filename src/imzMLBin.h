@@ -22,6 +22,10 @@
 
 #include <fstream>
 #include <vector>
+#include <mutex>
+#include <atomic>
+#include <map>
+#include <thread>
 #include <Rcpp.h>
 #include "peakpicking.h" //Used to get the datatype Peaks to allow a direct acces to imzML with peak lists
 #include "encoder_settings.h"
@@ -30,9 +34,10 @@ typedef struct
 {
   int pixelID;
   unsigned int last_offset; //The last position in the ibd file when the spectrum was read
+  unsigned int resample_offset; //Original mass channel of the first imzMLintensity value when continuous data is resampled using the resampling plan
   std::vector<double> imzMLmass; 
   std::vector<double> imzMLintensity; 
-}imzMLSpectrum; //If data is in continuous mode the std::vectors will be empty
+}imzMLSpectrum; //If data is in continuous mode the std::vectors will be empty, except imzMLintensity when resampling
 
 class ImzMLBin
 {
@@ -48,7 +53,7 @@ class ImzMLBin
     enum Mode { Read, SequentialWriteFile, ModifyFile }; //The mode must be spcified in the constructor
     
     ImzMLBin(const char* ibd_fname, unsigned int num_of_pixels, Rcpp::String Str_mzType, Rcpp::String Str_intType, bool continuous, Mode mode);
-    ~ImzMLBin();
+    virtual ~ImzMLBin();
     
     const char* getIbdFilePath();
     bool get_continuous();
@@ -70,7 +75,7 @@ class ImzMLBin
     unsigned int get_intEncodingBytes();
     
     //Close the file connection
-    void close();
+    virtual void close();
     
   protected:
     Mode fileMode; //Define the mode used to acces the binary file
@@ -95,7 +100,7 @@ class ImzMLBin
     imzMLDataType string2imzMLDatatype(Rcpp::String data_type);
     
     template<typename T> 
-    void convertBytes2Double(char* inBytes, double* outPtr, unsigned int N);
+    void convertBytes2Double(const char* inBytes, double* outPtr, unsigned int N);
     
     template<typename T> 
     void convertDouble2Bytes(double* inPtr, char* outBytes, unsigned int N);
@@ -104,13 +109,45 @@ class ImzMLBin
 class ImzMLBinRead : public ImzMLBin
 {
   public: 
+    //memoryMapped: if true the ibd file is accessed through a read-only memory map instead of a std::fstream (only available on POSIX systems, ignored otherwise).
     ImzMLBinRead(const char* ibd_fname, unsigned int num_of_pixels, Rcpp::String Str_mzType, Rcpp::String Str_intType, bool continuous, 
-                 bool openIbd = true, bool peakListrMSIformat = false);
+                 bool openIbd = true, bool peakListrMSIformat = false, bool memoryMapped = false);
     ~ImzMLBinRead();
     
     //Open the ibd file in reading mode
+    //Once opened, spectra and peak lists can be read concurrently from multiple threads. Opening and closing must not overlap with reads.
     void open();
     
+    //Close the file connection and release the memory map if any
+    void close();
+    
+    //Set the expected access pattern to the ibd file. It is used to provide hints to the kernel when the file is memory mapped.
+    //sequential: true if data will be read mostly in file order (processing stages), false for scattered reads (i.e. loading a few pixels to display)
+    void setAccessPattern(bool sequential);
+    
+    //Returns true if the ibd file is currently accessed through a memory map
+    bool get_memoryMapped();
+    
+    //Get the byte range of the ibd file read to load a pixel with ReadSpectrum() or ReadPeakList(): [begin, end)
+    //The mass axis of continuous data is shared so only the intensities are included, as well as in processed mode if both arrays are not close.
+    void getPixelByteRange(int pixelID, std::streamoff &begin, std::streamoff &end);
+    
+    //Announce that the following reads of the calling thread will be inside the given byte range, so it is read at once.
+    //If the file is memory mapped the kernel is requested to load the range. Otherwise the range is read to a buffer of the calling thread and 
+    //its following reads inside it are served from the buffer, until it prefetches another range or the file is closed.
+    void prefetch(std::streamoff offset, std::streamoff byteCount);
+    
+    //Accesses to the ibd files made by a thread, accumulated over all the readers
+    typedef struct
+    {
+      unsigned long fileReads; //Read calls to the std::fstream backend, including the prefetched ranges
+      double fileReadBytes; //Bytes read by those calls
+      double mappedBytes; //Bytes decoded from memory mapped files, the kernel decides how they are actually read
+    } ReadCounters;
+    
+    //Returns the counters of the calling thread, the accesses of a task are obtained as the difference of two calls
+    static ReadCounters getThreadReadCounters();
+    
     //Get the 16 bytes UUID from the imzML ibd file. uuid must be allocated by the user.
     void readUUID(char* uuid);
     
@@ -140,6 +177,9 @@ class ImzMLBinRead : public ImzMLBin
     //bRunLinearInterpolationOnLoad: set this boolean to true to run linear interpolation on load automatically
     imzMLSpectrum ReadSpectrum(int pixelID, unsigned int ionIndex, unsigned int ionCount, double *out, bool bRunLinearInterpolationOnLoad = true, unsigned int offset_proc_data = 0);
     
+    //Same as above but the original spectrum is loaded in the given imzMLSpectrum, so the capacity of its vectors is reused between calls.
+    void ReadSpectrum(int pixelID, unsigned int ionIndex, unsigned int ionCount, double *out, imzMLSpectrum &imzMLSpc, bool bRunLinearInterpolationOnLoad = true, unsigned int offset_proc_data = 0);
+    
     //Read multiple specta from the imzML data
     //If data is in processed mode the spectrum will be interpolated to the common mass axis using a multi-threaded approach.
     //numOfPixels: number of pixels to read.
@@ -168,9 +208,15 @@ class ImzMLBinRead : public ImzMLBin
     // return a pointer to a PeakPicking::Peaks datatype.
     PeakPicking::Peaks *ReadPeakList(int pixelID);
     
+    //Same as above but the peak list is loaded in an existing Peaks struct reusing the capacity of its vectors.
+    void ReadPeakList(int pixelID, PeakPicking::Peaks *mPeaks);
+    
     //Returns true if the peaklist is in rMSI dataformat
     bool get_rMSIPeakListFormat();
     
+    //Returns true if the spectra must be interpolated to the common mass axis after reading them. Valid once a spectrum has been read.
+    bool get_interpolationRequired();
+    
     //Exectue the linear interpolation from a given spectrum. 
     //This allows to exectue the interpolator from each thread instead of running it from the main thread.
     //imzMLSpc: pointer to a spectrum already read from the imzML file.
@@ -181,25 +227,64 @@ class ImzMLBinRead : public ImzMLBin
     
   private:
     //Read N elements from the ibd file and decode them.
-    //offset: offset in bytes at which the reading operation is started. If set to -1 no seek operation is used.
+    //Reads with an explicit offset are positional and can be called concurrently from multiple threads.
+    //offset: offset in bytes at which the reading operation is started. If set to -1 no seek operation is used (not thread-safe).
     //N: number of elements to read from the ibd file (N is elements, not bytes!)
     //ptr: Data will be stored at the ptr pointer
     //dataPointBytes: number of bytes used to encode a single data point.
     //dataType: data type used for the encoding.
     void readDataCommon(std::streampos offset, unsigned int N, double* ptr, unsigned int dataPointBytes, imzMLDataType dataType);
     
-    //Process both mass axis and compare them. If diferent, the bForceResampling flag will be set to true.
+    //Decode N elements of the given data type from bytes to ptr
+    void decodeDataCommon(const char* bytes, unsigned int N, double* ptr, imzMLDataType dataType);
+    
+    //Returns a pointer to N mass channels stored as float64 directely in the memory map without copying them.
+    //nullptr is returned if the file is not memory mapped, data is not encoded as float64 or the data is not properly aligned.
+    const double* mappedMzData(std::streampos offset, unsigned int N);
+    
+    //Process both mass axis and compare them. If diferent, the bForceResampling flag will be set to true and the resampling plan is computed.
     void checkCompareOriginalMassAxisAndCommonMassAxis();
     
+    //Compute the original mass channel and the weight used to resample each common mass axis point of continuous data.
+    //The plan follows the same rules as mlinterp, so values out of the original mass range take the value of the nearest edge.
+    void computeResamplingPlan();
+    
+    //Binary search of a mass value in the mass axis of a spectrum in processed mode.
+    //pixelID: the pixel ID of the spectrum to search.
+    //startIndex: the mass channel at which the search starts.
+    //target: the mass value to look for.
+    //bUpperBound: if false returns the first mass channel greater or equal than target, if true the first mass channel strictly greater than target.
+    unsigned int searchMassIndex(int pixelID, unsigned int startIndex, double target, bool bUpperBound);
+    
     bool bForceResampling; //Used in continuous mode to force resampling to different mass axis
-    bool bOriginalMassAxisOnMem; //A boolean to signal when the original mass axis is already available in memory for continuous mode
+    std::atomic<bool> bOriginalMassAxisOnMem; //A boolean to signal when the original mass axis is already available in memory for continuous mode
+    std::mutex originalMassAxisMutex; //Serializes the lazy loading of the original mass axis when reading from multiple threads
     std::vector<double> originalMassAxis; //A local copy of the original mass axis for continuous data interpolation (obtained from the rMSI object)
     std::vector<double> commonMassAxis; //A local copy of the common mass axis used for data interpolation when needed.
+    std::vector<unsigned int> resampleIndex; //Resampling plan: original mass channel at the left of each common mass axis point (empty if no plan available)
+    std::vector<double> resampleWeight; //Resampling plan: weight of the left original mass channel for each common mass axis point
     
     std::vector<unsigned int>  pixels_read_offsets; //A vector to store all the previous offset readed to allow a faster acces in processed mode;
     
     bool bPeakListInrMSIFormat; //If peak list must be readed using rMSI trick of appending Area, SNR and binsize after intensity
     
+    bool bMemoryMapped; //True if the ibd file must be accessed through a memory map
+    bool bSequentialAccess; //Access pattern hint for the memory map
+    const char* ibdMap; //Pointer to the memory mapped ibd file, nullptr if not mapped
+    std::streamoff ibdMapSize; //Size in bytes of the memory mapped ibd file
+    std::atomic<std::streamoff> ibdMapCursor; //Current reading position in the memory map, used when reading without seeking
+    std::mutex ibdFileMutex; //Keeps the seek and read of the std::fstream backend together when reading from multiple threads
+    
+    //Last range prefetched by a thread when the ibd file is not memory mapped
+    typedef struct
+    {
+      std::vector<char> buffer;
+      std::streamoff offset; //Offset of the first byte in buffer
+    } PrefetchedRange;
+    std::map<std::thread::id, PrefetchedRange> prefetchedRanges; //A range for each thread that has prefetched, protected by ibdFileMutex
+    
+    static thread_local ReadCounters threadReadCounters; //Counters of the calling thread
+    
     //Read multiple specta from the imzML data
     //If data is in processed mode the spectrum will be interpolated to the common mass axis using a multi-threaded approach.
     //numOfPixels: number of pixels to read.
@@ -255,9 +340,54 @@ class ImzMLBinWrite : public ImzMLBin
     //Data is obtained from ptr pointers
     void writePeakList( unsigned int N, double* ptrMass, double* ptrIntensity, double* ptrArea, double* ptrSNR, double* ptrBinSize);
     
+    //Concurrent writing: each pixel is written at its own offset with positioned writes, so multiple threads can store pixels in any order.
+    //The offsets are precomputed in continuous mode and reserved at the end of the ibd file before writing the pixel in processed mode.
+    //On Windows the positioned writes are serialized using a second stream.
+    
+    //Open the ibd file for concurrent writing. The UUID must be already written.
+    //In continuous mode the first call writes the common mass axis provided in massAxis (N elements) and reserves the intensities of all pixels in pixel order, 
+    //so the resulting ibd file is the same obtained in sequential mode. 
+    void openConcurrent(unsigned int N = 0, double* massAxis = nullptr);
+    
+    //Write the N intensities of a pixel at its precomputed offset. Continuous mode only. Thread safe.
+    void writeIntDataAt(unsigned int pixelIndex, unsigned int N, double* ptr);
+    
+    //Reserve space for the N mass channels and intensities of a pixel at the end of the ibd file. Processed mode only. Thread safe.
+    //Pixels are placed in the calling order, so the caller must reserve them in a fixed order to get a reproducible ibd file.
+    void reserveSpectrumAt(unsigned int pixelIndex, unsigned int N);
+    
+    //Same as reserveSpectrumAt() for a peak list of N peaks, using the layout of writePeakList()
+    void reservePeakListAt(unsigned int pixelIndex, unsigned int N);
+    
+    //Write the N mass channels and intensities of a pixel in the space reserved with reserveSpectrumAt(). Thread safe.
+    void writeSpectrumAt(unsigned int pixelIndex, unsigned int N, double* ptrMass, double* ptrIntensity);
+    
+    //Write a peak list in the space reserved with reservePeakListAt(). Thread safe.
+    void writePeakListAt(unsigned int pixelIndex, unsigned int N, double* ptrMass, double* ptrIntensity, double* ptrArea, double* ptrSNR, double* ptrBinSize);
+    
+    //Close the file connection, including the concurrent writing one
+    void close();
+    
   private:
     unsigned int sequentialWriteIndex_MzData; //When sequentially writing data, this integers provides the index of the next pixel to store
     unsigned int sequentialWriteIndex_IntData; //When sequentially writing data, this integers provides the index of the next pixel to store
+#ifndef _WIN32
+    int concurrentFd; //File descriptor used for concurrent writing, -1 if not opened
+#else
+    std::fstream concurrentFile; //Stream used for concurrent writing
+    std::mutex concurrentFileMutex; //Serializes the seek and write of each positioned write
+#endif
+    std::mutex reserveMutex; //Protects reservedEnd
+    std::streamoff reservedEnd; //Offset of the first byte not reserved yet, zero until the first call to openConcurrent()
+    
+    //Encode N elements in the specified format to buffer, which must hold N elements of dataType
+    void encodeData(unsigned int N, double* ptr, imzMLDataType dataType, char* buffer);
+    
+    //Reserve byteCount bytes at the end of the ibd file and return its offset. Thread safe.
+    std::streamoff reserveBytes(std::streamoff byteCount);
+    
+    //Write a buffer at the given offset using the concurrent writing file descriptor
+    void positionedWrite(std::streamoff offset, const char* buffer, size_t byteCount);
     
     //Write N elements to the ibd file encoded in the specified format.
     //This method is tailored to data modification mode
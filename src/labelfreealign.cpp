@@ -19,6 +19,7 @@
 #include <Rcpp.h>
 #include <cmath>
 #include "labelfreealign.h"
+#include "fftengine.h"
 #include "mlinterp.hpp" //Used for linear interpolation
 
 using namespace Rcpp;
@@ -48,13 +49,13 @@ FFTInterpolationOverSampling(fftOverSampling)
   
   FFT_Size_direct = (int)pow(2.0, std::ceil(log2(WinLength)));
   FFT_Size_inverse = (int)pow(2.0, std::ceil(log2(WinLength*FFTInterpolationOverSampling)));
-  fft_direct_in = fftw_alloc_real(FFT_Size_direct);
-  fft_direct_out = fftw_alloc_real(FFT_Size_direct);
-  fft_inverse_in = fftw_alloc_real(FFT_Size_inverse);
-  fft_inverse_out = fftw_alloc_real(FFT_Size_inverse);
+  fft_direct_in = fftw_alloc_real(3*FFT_Size_direct);
+  fft_direct_out = fftw_alloc_real(3*FFT_Size_direct);
+  fft_inverse = fftw_alloc_real(3*FFT_Size_inverse);
   
-  fft_pdirect = fftw_plan_r2r_1d(FFT_Size_direct, fft_direct_in, fft_direct_out, FFTW_R2HC, FFTW_ESTIMATE);
-  fft_pinvers = fftw_plan_r2r_1d(FFT_Size_inverse, fft_inverse_in, fft_inverse_out, FFTW_HC2R, FFTW_ESTIMATE);
+  fft_pdirect = FFTEngine::getPlan(FFT_Size_direct, FFTW_R2HC);
+  fft_pdirect_batch = FFTEngine::getPlan(FFT_Size_direct, FFTW_R2HC, 3);
+  fft_pinvers_batch = FFTEngine::getPlan(FFT_Size_inverse, FFTW_HC2R, 3, true);
   
   fft_ref_low = new  double[FFT_Size_inverse];
   fft_ref_center = new  double[FFT_Size_inverse];
@@ -98,12 +99,9 @@ FFTInterpolationOverSampling(fftOverSampling)
 
 LabelFreeAlign::~LabelFreeAlign()
 {
-  fftw_destroy_plan(fft_pdirect);
-  fftw_destroy_plan(fft_pinvers);
   fftw_free(fft_direct_in); 
   fftw_free(fft_direct_out);
-  fftw_free(fft_inverse_in); 
-  fftw_free(fft_inverse_out);
+  fftw_free(fft_inverse);
   delete[] fft_ref_low;
   delete[] fft_ref_center;
   delete[] fft_ref_high;
@@ -153,7 +151,7 @@ void LabelFreeAlign::ComputeRef(double *data_ref, int spectrumPart)
   }
 #endif  
   
-  fftw_execute(fft_pdirect);
+  FFTEngine::execute(fft_pdirect, fft_direct_in, fft_direct_out);
   
   //FFT domain Interpolation
   if(FFT_Size_direct < FFT_Size_inverse)
@@ -257,10 +255,10 @@ void LabelFreeAlign::TimeWindow(double *data,  int spectrumPart)
 
 LabelFreeAlign::TLags LabelFreeAlign::AlignSpectrum(double *intensityDataInterpolated, double *massData, double *intensityData, int N)
 {
-  //Hanning Windowing
-  double *topWin_data = new double[FFT_Size_direct];
-  double *midWin_data = new double[FFT_Size_direct];
-  double *botWin_data = new double[FFT_Size_direct];
+  //Hanning Windowing, the windows are placed directly in the FFT batch buffer
+  double *topWin_data = fft_direct_in + TOP_SPECTRUM*FFT_Size_direct;
+  double *midWin_data = fft_direct_in + CENTER_SPECTRUM*FFT_Size_direct;
+  double *botWin_data = fft_direct_in + BOTTOM_SPECTRUM*FFT_Size_direct;
   TLags firstLag;
   
   //Prepare data pointer for continuous mode:
@@ -313,10 +311,7 @@ LabelFreeAlign::TLags LabelFreeAlign::AlignSpectrum(double *intensityDataInterpo
 #endif  
     
     //Get lags
-    TLags lags;
-    lags.lagLow = FourierBestCor(botWin_data, fft_ref_low);
-    lags.lagMid = FourierBestCor(midWin_data, fft_ref_center);
-    lags.lagHigh = FourierBestCor(topWin_data, fft_ref_high);
+    TLags lags = FourierBestCor();
 
 #ifdef EXTRA_DEBUG_INFO    
     Rcpp::Rcout<<"\n===============================================\n";
@@ -440,9 +435,6 @@ LabelFreeAlign::TLags LabelFreeAlign::AlignSpectrum(double *intensityDataInterpo
     );
   }
   
-  delete[] topWin_data;
-  delete[] botWin_data;
-  delete[] midWin_data;
   if(bDataInContinuousMode)
   {
     delete[] ptrMass;
@@ -452,73 +444,85 @@ LabelFreeAlign::TLags LabelFreeAlign::AlignSpectrum(double *intensityDataInterpo
   return firstLag;
 }
 
-double LabelFreeAlign::FourierBestCor(double *data, double *ref)
+LabelFreeAlign::TLags LabelFreeAlign::FourierBestCor()
 {
-  double *fft_direct_out_interpolated = new double[FFT_Size_inverse];
-  memcpy(fft_direct_in, data, sizeof(double)*FFT_Size_direct);
-  fftw_execute(fft_pdirect);
+  //Direct FFT of the three windows at once
+  FFTEngine::execute(fft_pdirect_batch, fft_direct_in, fft_direct_out);
   
-  //FFT domain Interpolation
-  if(FFT_Size_direct < FFT_Size_inverse)
-  {
-    memcpy(fft_direct_out_interpolated, fft_direct_out, sizeof(double)*(1+(FFT_Size_direct/2)));  //Fill the real part
-    memcpy(fft_direct_out_interpolated + (FFT_Size_inverse - (FFT_Size_direct/2) + 1), fft_direct_out + (1+(FFT_Size_direct/2)), sizeof(double)*((FFT_Size_direct/2)-1)); //Fill the imaginary part
-    for(int i = (1+(FFT_Size_direct/2)); i < (FFT_Size_inverse - (FFT_Size_direct/2) + 1); i++) fft_direct_out_interpolated[i] = 0.0; //Zero padding
-  }
-  else
-  {
-    //No interpolation... just copy
-    memcpy(fft_direct_out_interpolated, fft_direct_out, sizeof(double)*FFT_Size_direct);
-  }
-
-  //Mult fft complex values, the ref is assumed already Conj (this is automatically done by ComputeRef method)
-  for( int i = 0; i <= FFT_Size_inverse/2; i++)
+  double *refs[3];
+  refs[BOTTOM_SPECTRUM] = fft_ref_low;
+  refs[CENTER_SPECTRUM] = fft_ref_center;
+  refs[TOP_SPECTRUM] = fft_ref_high;
+  
+  //FFT domain Interpolation is done by zero padding, so only the bins up to the direct FFT nyquist are non-zero
+  const int lastBin = FFT_Size_direct/2;
+  for( int k = 0; k < 3; k++)
   {
-    if( i > 0 && i < FFT_Size_inverse/2)
-    {
-      fft_inverse_in[i] = ref[i] * fft_direct_out_interpolated[i] - ref[FFT_Size_inverse - i] * fft_direct_out_interpolated[FFT_Size_inverse - i];
-      fft_inverse_in[FFT_Size_inverse - i] = ref[i] * fft_direct_out_interpolated[FFT_Size_inverse - i] + ref[FFT_Size_inverse - i] * fft_direct_out_interpolated[i];
-    }
-    else
+    double *spectrum = fft_direct_out + k*FFT_Size_direct;
+    double *ref = refs[k];
+    double *corr = fft_inverse + k*FFT_Size_inverse;
+    memset(corr, 0, sizeof(double)*FFT_Size_inverse);
+    
+    //Mult fft complex values, the ref is assumed already Conj (this is automatically done by ComputeRef method)
+    for( int i = 0; i <= lastBin; i++)
     {
-      fft_inverse_in[i] = ref[i] * fft_direct_out_interpolated[i];
+      if( i > 0 && i < FFT_Size_inverse/2)
+      {
+        const double im = i < lastBin ? spectrum[FFT_Size_direct - i] : 0.0; 
+        corr[i] = ref[i] * spectrum[i] - ref[FFT_Size_inverse - i] * im;
+        corr[FFT_Size_inverse - i] = ref[i] * im + ref[FFT_Size_inverse - i] * spectrum[i];
+      }
+      else
+      {
+        corr[i] = ref[i] * spectrum[i];
+      }
     }
   }
-  delete[] fft_direct_out_interpolated;
   
-  fftw_execute(fft_pinvers);
+  //Inverse FFT of the three correlations at once
+  FFTEngine::execute(fft_pinvers_batch, fft_inverse, fft_inverse);
   
-  //Locate the max correlation
-  double dMax = 0.0;
-  int lag = 0;
-  for( int i = 0; i < FFT_Size_inverse; i++)
+  double lag[3];
+  for( int k = 0; k < 3; k++)
   {
-    if(fft_inverse_out[i] > dMax)
+    double *corr = fft_inverse + k*FFT_Size_inverse;
+    
+    //Locate the max correlation
+    double dMax = 0.0;
+    int iMax = 0;
+    for( int i = 0; i < FFT_Size_inverse; i++)
     {
-      dMax = fft_inverse_out[i];
-      lag = i;
+      if(corr[i] > dMax)
+      {
+        dMax = corr[i];
+        iMax = i;
+      }
     }
-  }
-
+    
 #ifdef EXTRA_DEBUG_INFO   
-  Rcpp::Rcout<<"\n===============================================\n";
-  Rcpp::Rcout<<"DBG: lag RAW = "<<lag<<"\n";
-  Rcpp::Rcout<<"DBG: FFT_Size_direct = "<<FFT_Size_direct<<"\n";
-  Rcpp::Rcout<<"DBG: FFT_Size_inverse = "<<FFT_Size_inverse<<"\n";
-  Rcpp::Rcout<<"===============================================\n";
+    Rcpp::Rcout<<"\n===============================================\n";
+    Rcpp::Rcout<<"DBG: lag RAW = "<<iMax<<"\n";
+    Rcpp::Rcout<<"DBG: FFT_Size_direct = "<<FFT_Size_direct<<"\n";
+    Rcpp::Rcout<<"DBG: FFT_Size_inverse = "<<FFT_Size_inverse<<"\n";
+    Rcpp::Rcout<<"===============================================\n";
 #endif
-  
-  if( lag >= FFT_Size_inverse/2)
-  {
-    lag = FFT_Size_inverse - lag; 
-  }
-  else
-  {
-    lag = -lag;
+    
+    if( iMax >= FFT_Size_inverse/2)
+    {
+      iMax = FFT_Size_inverse - iMax; 
+    }
+    else
+    {
+      iMax = -iMax;
+    }
+    lag[k] = ((double)iMax) * (((double)(FFT_Size_direct)) / ((double)(FFT_Size_inverse)) );
   }
   
-
-  return ((double)lag) * (((double)(FFT_Size_direct)) / ((double)(FFT_Size_inverse)) );
+  TLags lags;
+  lags.lagLow = lag[BOTTOM_SPECTRUM];
+  lags.lagMid = lag[CENTER_SPECTRUM];
+  lags.lagHigh = lag[TOP_SPECTRUM];
+  return lags;
 }
 
 NumericVector LabelFreeAlign::getHannWindow()
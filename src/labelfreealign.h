@@ -74,7 +74,7 @@ class LabelFreeAlign
     void ZeroPadding(double *data,bool reverse, int targetSize, int dataSize);
     void CopyData2Window(double *data_int, double *data_out,  int spectrumPart);
     void TimeWindow(double *data, int spectrumPart);
-    double FourierBestCor(double *data, double *ref);
+    TLags FourierBestCor(); //Computes the lags of the three windows stored in fft_direct_in
     
     int dataLength; //Number of points used in each spectrum
     double *commonMassAxis; //The common mass axis for the whole dataset
@@ -82,13 +82,14 @@ class LabelFreeAlign
     int FFT_Size_direct; //Number of points used for fft direct
     int FFT_Size_inverse; //Number of points used for fft inverse (which is diferent than direct to allow interpolation for lag values)
     
+    //Shared plans owned by FFTEngine, the batched ones transform the bottom, center and top windows in a single call
     fftw_plan fft_pdirect;
-    fftw_plan fft_pinvers;
+    fftw_plan fft_pdirect_batch;
+    fftw_plan fft_pinvers_batch;
     
-    double *fft_direct_in;
+    double *fft_direct_in; //The three windows, each one of FFT_Size_direct points in the order given by BOTTOM/CENTER/TOP_SPECTRUM
     double *fft_direct_out;
-    double *fft_inverse_in;
-    double *fft_inverse_out;
+    double *fft_inverse; //The three correlations, each one of FFT_Size_inverse points, transformed in-place
     
     //Mem space to store pre-computed reference FFT space values
     double *fft_ref_low;
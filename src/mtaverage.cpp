@@ -21,8 +21,8 @@
 #include "mtaverage.h"
 using namespace Rcpp;
 
-MTAverage::MTAverage(Rcpp::List rMSIObj_list, int numberOfThreads, double memoryPerThreadMB, Rcpp::NumericVector commonMassAxis, double minTIC, double maxTIC) : 
-  ThreadingMsiProc(rMSIObj_list, numberOfThreads, memoryPerThreadMB, commonMassAxis),
+MTAverage::MTAverage(Rcpp::List rMSIObj_list, int numberOfThreads, double memoryPerThreadMB, Rcpp::NumericVector commonMassAxis, double minTIC, double maxTIC, bool float32DataCubes) : 
+  ThreadingMsiProc(rMSIObj_list, numberOfThreads, memoryPerThreadMB, commonMassAxis, DataCubeIOMode::DATA_READ, Rcpp::StringVector(), "", Rcpp::StringVector(), float32DataCubes),
   TICmin(minTIC), 
   TICmax(maxTIC)
 {
@@ -85,6 +85,14 @@ NumericVector MTAverage::Run()
 }
 
 
+template<typename T> void MTAverage::AccumulateNormalizedSpectrum(const T *spectrum, int ncols, double TIC, double *sum)
+{
+  for (int k= 0; k < ncols; k++)
+  {
+    sum[k] += spectrum[k] / TIC;
+  }
+}
+
 void MTAverage::ProcessingFunction(int threadSlot)
 {
   
@@ -104,11 +112,16 @@ void MTAverage::ProcessingFunction(int threadSlot)
     
     if(TICval >= TICmin && TICval <= TICmax)
     {
-      for (int k= 0; k < cubes[threadSlot]->ncols; k++)
+      //Average with TIC Normalization
+      if(ioObj->get_float32DataCubes())
+      {
+        AccumulateNormalizedSpectrum(cubes[threadSlot]->dataInterpolatedFloat[j], cubes[threadSlot]->ncols, TICval, partialAverage);
+      }
+      else
       {
-        partialAverage[k] += (cubes[threadSlot]->dataInterpolated[j][k])/TICval; //Average with TIC Normalization
-        validPixelCount[cubes[threadSlot]->cubeID]++;
+        AccumulateNormalizedSpectrum(cubes[threadSlot]->dataInterpolated[j], cubes[threadSlot]->ncols, TICval, partialAverage);
       }
+      validPixelCount[cubes[threadSlot]->cubeID] += cubes[threadSlot]->ncols;
     }
   }
   
@@ -132,7 +145,8 @@ NumericVector COverallAverageSpectrum(Rcpp::List rMSIObj_list,
                                int numOfThreads, 
                                double memoryPerThreadMB,
                                Rcpp::NumericVector commonMassAxis,
-                               double minTIC, double maxTic)
+                               double minTIC, double maxTic,
+                               bool float32DataCubes = false)
 {
   NumericVector out;
   try
@@ -142,7 +156,8 @@ NumericVector COverallAverageSpectrum(Rcpp::List rMSIObj_list,
                       memoryPerThreadMB, 
                       commonMassAxis,
                       minTIC,
-                      maxTic);
+                      maxTic,
+                      float32DataCubes);
  
     out = myAverage.Run();
   }
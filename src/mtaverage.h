@@ -32,7 +32,7 @@ class MTAverage : public ThreadingMsiProc
     // memoryPerThreadMB: Maximum memory allocated by each thread in MB. The total allocated memory will be: 2*numberOfThreads*memoryPerThreadMB
     // commonMassAxis: The common mass axis used to process and interpolate multiple datasets.
     // minTIC and maxTIC: spectra with a TIC value outside this range will not be used for average calculation
-    MTAverage(Rcpp::List rMSIObj_list, int numberOfThreads, double memoryPerThreadMB, Rcpp::NumericVector commonMassAxis, double minTIC, double maxTIC);
+    MTAverage(Rcpp::List rMSIObj_list, int numberOfThreads, double memoryPerThreadMB, Rcpp::NumericVector commonMassAxis, double minTIC, double maxTIC, bool float32DataCubes = false);
     ~MTAverage();
     
     //Execute a full imatge processing using threaded methods
@@ -47,5 +47,8 @@ class MTAverage : public ThreadingMsiProc
     
     //Thread Processing function definition
     void ProcessingFunction(int threadSlot);
+    
+    //Adds the TIC-normalized spectrum to sum. It is templated on the sample type of the data cube, so float32 rows are read in place.
+    template<typename T> void AccumulateNormalizedSpectrum(const T *spectrum, int ncols, double TIC, double *sum);
 };
 #endif
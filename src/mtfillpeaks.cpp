@@ -19,14 +19,17 @@
 #include <Rcpp.h>
 #include <cmath>
 #include <memory>
+#include <limits>
 #include "mtfillpeaks.h"
 using namespace Rcpp;
 
 MTFillPeaks::MTFillPeaks(Rcpp::List rMSIObj_list, int numberOfThreads, double memoryPerThreadMB, 
                          Rcpp::Reference preProcessingParams,
                          Rcpp::NumericVector commonMassAxis,
-                         Rcpp::List peakMatrix):
-  ThreadingMsiProc(rMSIObj_list, numberOfThreads, memoryPerThreadMB, commonMassAxis, DataCubeIOMode::DATA_AND_PEAKLIST_READ)
+                         Rcpp::List peakMatrix,
+                         bool float32DataCubes,
+                         bool sparseOutput):
+  ThreadingMsiProc(rMSIObj_list, numberOfThreads, memoryPerThreadMB, commonMassAxis, DataCubeIOMode::DATA_AND_PEAKLIST_READ, Rcpp::StringVector(), "", Rcpp::StringVector(), float32DataCubes)
 {
   replacedZerosCounters = new unsigned int[numOfThreadsDouble];
   for( int i = 0; i < numOfThreadsDouble; i++)
@@ -51,12 +54,20 @@ MTFillPeaks::MTFillPeaks(Rcpp::List rMSIObj_list, int numberOfThreads, double me
     peakObj[i] = new PeakPicking(peakWinSize, massAxis.begin(), massAxis.length(), peakInterpolationUpSampling );  
   }
   
-  //Get the peak matrices parts, in theory this is passed by reference accoring to Rcpp documentation
-  pkMatintensity = as<NumericMatrix>(peakMatrix["intensity"]);
-  pkMatarea = as<NumericMatrix>(peakMatrix["area"]);
-  pkMatsnr = as<NumericMatrix>(peakMatrix["SNR"]);
+  //Get the peak matrix mass channels and create the matrices to fill
   pkMatmass = as<NumericVector>(peakMatrix["mass"]);
   pkMatbinSize = as<NumericVector>(peakMatrix["binSize"]);
+  if(sparseOutput)
+  {
+    pkMat = new SparsePeakMatrix(numPixels, pkMatmass.length());
+  }
+  else
+  {
+    pkMat = nullptr;
+    pkMatintensity = NumericMatrix(numPixels, pkMatmass.length());
+    pkMatarea = NumericMatrix(numPixels, pkMatmass.length());
+    pkMatsnr = NumericMatrix(numPixels, pkMatmass.length());
+  }
   
   //Build the mass index vector
   Rcout<<"Creating the mass index vector...\n";
@@ -90,9 +101,13 @@ MTFillPeaks::~MTFillPeaks()
   delete[] peakObj;
   delete[] replacedZerosCounters;
   delete[] mass_index;
+  if(pkMat != nullptr)
+  {
+    delete pkMat;
+  }
 }
 
-void MTFillPeaks::Run()
+List MTFillPeaks::Run()
 {
   Rcout<<"Filling the peak matrix...\n";
   peaklists_in_rMSIformat = ioObj->get_all_peakLists_are_rMSIformated();
@@ -107,6 +122,30 @@ void MTFillPeaks::Run()
     }
     Rcout << "A total of " << replacedZerosSum << " low intensity peaks were retrieved\n";
   }
+  
+  if(pkMat == nullptr)
+  {
+    return List::create( Named("mass") = pkMatmass, Named("binSize") = pkMatbinSize, 
+                         Named("intensity") = pkMatintensity, Named("SNR") = pkMatsnr, Named("area") = pkMatarea );
+  }
+  
+  List pkMatValues = pkMat->exportToR();
+  return List::create( Named("mass") = pkMatmass, Named("binSize") = pkMatbinSize, 
+                       Named("intensity") = pkMatValues["intensity"], Named("SNR") = pkMatValues["SNR"], Named("area") = pkMatValues["area"] );
+}
+
+void MTFillPeaks::setPeakValue(unsigned int row, unsigned int col, double intensity, double snr, double area)
+{
+  if(pkMat != nullptr)
+  {
+    pkMat->setValue(row, col, intensity, snr, area);
+  }
+  else
+  {
+    pkMatintensity(row, col) = intensity;
+    pkMatsnr(row, col) = snr;
+    pkMatarea(row, col) = area;
+  }
 }
 
 void MTFillPeaks::ProcessingFunction(int threadSlot)
@@ -118,27 +157,29 @@ void MTFillPeaks::ProcessingFunction(int threadSlot)
     //Get the row in the peak matrix of the current pixel
     peakMat_row_index = ioObj->getPeakMatrixRow(cubes[threadSlot]->cubeID, j);
     
+    //Both the peak matrix masses and the peak list are sorted, so they are joined with a single forward pass
+    mpeaks = cubes[threadSlot]->peakLists[j];
+    double *spectrum = dataStoreMode == DataCubeIOMode::DATA_AND_PEAKLIST_READ ? getSpectrum(threadSlot, j) : nullptr;
+    unsigned int nextPeak = 0; //First peak with a mass greater than the current peak matrix mass
     for( int imass = 0; imass < pkMatmass.length(); imass++)
     {
-      //Look for the current mass in the peaklist
+      while( nextPeak < mpeaks->mass.size() && mpeaks->mass[nextPeak] <= pkMatmass[imass] )
+      {
+        nextPeak++;
+      }
+      
+      //Look for the current mass in the peaklist, the closest peak is the previous or the next one
       double minMassDistance = std::numeric_limits<double>::max();
       int minDistanceIndex = -1;
-      double currentMassDistance;
-      mpeaks = cubes[threadSlot]->peakLists[j];
-      for(int ipeak = 0; ipeak < mpeaks->mass.size(); ipeak++)
+      if(nextPeak > 0)
       {
-        currentMassDistance = pkMatmass[imass] - mpeaks->mass[ipeak];
-        
-        if(fabs(currentMassDistance) < fabs(minMassDistance))
-        {
-          minMassDistance = currentMassDistance;
-          minDistanceIndex = ipeak;
-        }
-        
-        if(currentMassDistance < 0)
-        {
-          break;
-        }
+        minMassDistance = pkMatmass[imass] - mpeaks->mass[nextPeak - 1];
+        minDistanceIndex = nextPeak - 1;
+      }
+      if(nextPeak < mpeaks->mass.size() && fabs(pkMatmass[imass] - mpeaks->mass[nextPeak]) < fabs(minMassDistance))
+      {
+        minMassDistance = pkMatmass[imass] - mpeaks->mass[nextPeak];
+        minDistanceIndex = nextPeak;
       }
       
       //Check tolerance
@@ -156,15 +197,11 @@ void MTFillPeaks::ProcessingFunction(int threadSlot)
       
       if( (minDistanceIndex >= 0) && (fabs(minMassDistance) <= compTolerance))
       {
-        //Fill peak matrix using the peak list
-        pkMatintensity(peakMat_row_index, imass) = mpeaks->intensity[minDistanceIndex] > pkMatintensity(peakMat_row_index, imass) ? mpeaks->intensity[minDistanceIndex] : pkMatintensity(peakMat_row_index, imass) ;
-        
-        //Fill SNR and area matrices when available
-        if(peaklists_in_rMSIformat)
-        {
-          pkMatarea(peakMat_row_index, imass) = mpeaks->area[minDistanceIndex] > pkMatarea(peakMat_row_index, imass) ? mpeaks->area[minDistanceIndex] : pkMatarea(peakMat_row_index, imass) ;
-          pkMatsnr(peakMat_row_index, imass) = mpeaks->SNR[minDistanceIndex] > pkMatsnr(peakMat_row_index, imass) ? mpeaks->SNR[minDistanceIndex] : pkMatsnr(peakMat_row_index, imass) ;
-        }
+        //Fill peak matrix using the peak list, SNR and area only when available. Values are never lower than the zero initialization
+        setPeakValue(peakMat_row_index, imass, 
+                     mpeaks->intensity[minDistanceIndex] > 0.0 ? mpeaks->intensity[minDistanceIndex] : 0.0,
+                     (peaklists_in_rMSIformat && mpeaks->SNR[minDistanceIndex] > 0.0) ? mpeaks->SNR[minDistanceIndex] : 0.0,
+                     (peaklists_in_rMSIformat && mpeaks->area[minDistanceIndex] > 0.0) ? mpeaks->area[minDistanceIndex] : 0.0);
       }
       else
       {
@@ -175,32 +212,40 @@ void MTFillPeaks::ProcessingFunction(int threadSlot)
           replacedZerosCounters[threadSlot]++;
         
           //Fill matrix position with proper intensity
-          pkMatintensity(peakMat_row_index, imass) = cubes[threadSlot]->dataInterpolated[j][mass_index[imass]]; 
-          pkMatarea(peakMat_row_index, imass) = peakObj[threadSlot]->predictPeakArea(cubes[threadSlot]->dataInterpolated[j], mass_index[imass]);
+          setPeakValue(peakMat_row_index, imass,
+                       spectrum[mass_index[imass]],
+                       0.0,
+                       peakObj[threadSlot]->predictPeakArea(spectrum, mass_index[imass]));
         }
       }
     }
   }
 }
 
-//Returning void since it directely modify the peak matrix without returning anything
+//Returns the peak matrix with the intensity, SNR and area as dense matrices, or as rMSIprocSparseMatrix objects if sparseOutput is true
 // [[Rcpp::export]]
-void CRunFillPeaks( Rcpp::List rMSIObj_list,int numOfThreads, double memoryPerThreadMB, 
+List CRunFillPeaks( Rcpp::List rMSIObj_list,int numOfThreads, double memoryPerThreadMB, 
                     Rcpp::Reference preProcessingParams, 
                     Rcpp::NumericVector commonMassAxis,
-                    Rcpp::List peakMatrix)
+                    Rcpp::List peakMatrix,
+                    bool float32DataCubes = false,
+                    bool sparseOutput = false)
 {
+  List out;
   try
   {
     MTFillPeaks myFillPeaks(rMSIObj_list, numOfThreads, memoryPerThreadMB,
                             preProcessingParams,
                             commonMassAxis,
-                            peakMatrix);
+                            peakMatrix,
+                            float32DataCubes,
+                            sparseOutput);
     
-    myFillPeaks.Run();
+    out = myFillPeaks.Run();
   }
   catch(std::runtime_error &e)
   {
     Rcpp::stop(e.what());
   }
+  return out;
 }
@@ -21,6 +21,7 @@
 #include <Rcpp.h>
 #include "peakpicking.h"
 #include "threadingmsiproc.h"
+#include "sparsepeakmatrix.h"
 
 class MTFillPeaks : public ThreadingMsiProc 
 {
@@ -33,16 +34,19 @@ class MTFillPeaks : public ThreadingMsiProc
     // preProcessingParams: An R reference class with the pre-processing parameters.
     // mass: a numeric vector with the common mass axis
     // commonMassAxis: The common mass axis used to process and interpolate multiple datasets.
-    // peakMatrix: a peak matrix as it is returned by the peak binning algorithm
+    // peakMatrix: the mass channels of the peak matrix as returned by the peak binning algorithm
+    // sparseOutput: return the intensity, SNR and area as rMSIprocSparseMatrix objects instead of dense matrices
     MTFillPeaks(Rcpp::List rMSIObj_list, int numberOfThreads, double memoryPerThreadMB, 
                 Rcpp::Reference preProcessingParams,
                 Rcpp::NumericVector commonMassAxis,
-                Rcpp::List peakMatrix);
+                Rcpp::List peakMatrix,
+                bool float32DataCubes = false,
+                bool sparseOutput = false);
     
     ~MTFillPeaks();
     
-    //Exectur a full imatge processing using threaded methods, nothing is returned becasue the peakmatrix is directely modified
-    void Run(); 
+    //Exectur a full imatge processing using threaded methods, returns the peak matrix with the intensity, SNR and area as dense or sparse matrices
+    Rcpp::List Run(); 
     
   private:
     unsigned int *replacedZerosCounters;
@@ -51,15 +55,18 @@ class MTFillPeaks : public ThreadingMsiProc
     bool tolerance_in_ppm; //If true the binning tolerance is specified in  ppm, if false then the number of datapoints per peak is used instead
     bool peaklists_in_rMSIformat; //True when peaklists are in rMSI format.
     
-    //In theory, Rcpp passes arguments like Rcpp::Lists an matrices as reference... so it should be as simple as follows
     Rcpp::NumericVector pkMatmass;
     Rcpp::NumericVector pkMatbinSize;
-    Rcpp::NumericMatrix pkMatintensity;
+    Rcpp::NumericMatrix pkMatintensity; //Dense peak matrix values, not allocated with sparse output
     Rcpp::NumericMatrix pkMatarea;
     Rcpp::NumericMatrix pkMatsnr;
+    SparsePeakMatrix *pkMat; //The peak matrix values in sparse format, null with dense output. Each pixel row is filled from a single thread
     PeakPicking **peakObj;
   
     //Thread Processing function definition
     void ProcessingFunction(int threadSlot);
+    
+    //Sets the values of a peak matrix entry in the dense or sparse matrices
+    void setPeakValue(unsigned int row, unsigned int col, double intensity, double snr, double area);
 };
 #endif
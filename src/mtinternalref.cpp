@@ -22,8 +22,8 @@
 #include "mtinternalref.h"
 using namespace Rcpp;
 
-MTInternalRef::MTInternalRef(Rcpp::List rMSIObj_list, int numberOfThreads, double memoryPerThreadMB, Rcpp::NumericVector commonMassAxis, Rcpp::NumericVector reference) : 
-  ThreadingMsiProc(rMSIObj_list, numberOfThreads, memoryPerThreadMB, commonMassAxis), ref(reference)
+MTInternalRef::MTInternalRef(Rcpp::List rMSIObj_list, int numberOfThreads, double memoryPerThreadMB, Rcpp::NumericVector commonMassAxis, Rcpp::NumericVector reference, bool float32DataCubes) : 
+  ThreadingMsiProc(rMSIObj_list, numberOfThreads, memoryPerThreadMB, commonMassAxis, DataCubeIOMode::DATA_READ, Rcpp::StringVector(), "", Rcpp::StringVector(), float32DataCubes), ref(reference)
 {
   if(commonMassAxis.length() != reference.length())
   {
@@ -63,11 +63,7 @@ List MTInternalRef::Run()
 
 void MTInternalRef::ProcessingFunction(int threadSlot)
 {
-  double x;
-  double current_mean;
   double current_correlation;
-  double covariance;
-  double sdev;
   MaxCor threadMaxCor;
   threadMaxCor.cor = 0.0;
   threadMaxCor.imageID = -1;
@@ -75,19 +71,15 @@ void MTInternalRef::ProcessingFunction(int threadSlot)
   
   for (int j = 0; j < cubes[threadSlot]->nrows; j++)
   {
-    current_mean = computeMean(cubes[threadSlot]->dataInterpolated[j]);
-    covariance = 0.0;
-    sdev = 0.0;
-   
-    for (int k= 0; k < cubes[threadSlot]->ncols; k++)
+    if(ioObj->get_float32DataCubes())
+    {
+      current_correlation = computeCorrelation(cubes[threadSlot]->dataInterpolatedFloat[j]);
+    }
+    else
     {
-      x = (cubes[threadSlot]->dataInterpolated[j][k]); //Extract current spectrum value
-      covariance += (x - current_mean) * (ref[k] - ref_mean); 
-      sdev += (x - current_mean)*(x - current_mean);
+      current_correlation = computeCorrelation(cubes[threadSlot]->dataInterpolated[j]);
     }
-    sdev = sqrt(sdev);
     
-    current_correlation = covariance/(sdev * ref_sdev);
     if(current_correlation > threadMaxCor.cor)
     {
       threadMaxCor.cor = current_correlation;
@@ -105,7 +97,25 @@ void MTInternalRef::ProcessingFunction(int threadSlot)
   maxCorMutex.unlock();
 }
 
-double MTInternalRef::computeMean(double *data)
+template<typename T> double MTInternalRef::computeCorrelation(const T *spectrum)
+{
+  double x;
+  double current_mean = computeMean(spectrum);
+  double covariance = 0.0;
+  double sdev = 0.0;
+  
+  for (int k= 0; k < ref.length(); k++)
+  {
+    x = (spectrum[k]); //Extract current spectrum value
+    covariance += (x - current_mean) * (ref[k] - ref_mean); 
+    sdev += (x - current_mean)*(x - current_mean);
+  }
+  sdev = sqrt(sdev);
+  
+  return covariance/(sdev * ref_sdev);
+}
+
+template<typename T> double MTInternalRef::computeMean(const T *data)
 {
   double mean_x = 0.0;
   for(unsigned int i = 0; i < ref.length(); i++)
@@ -121,7 +131,8 @@ List CInternalReferenceSpectrum(Rcpp::List rMSIObj_list,
                                int numOfThreads, 
                                double memoryPerThreadMB,
                                Rcpp::NumericVector referenceSpectrum,  
-                               Rcpp::NumericVector commonMassAxis)
+                               Rcpp::NumericVector commonMassAxis,
+                               bool float32DataCubes = false)
 {
   List out;
   try
@@ -130,7 +141,8 @@ List CInternalReferenceSpectrum(Rcpp::List rMSIObj_list,
                       numOfThreads, 
                       memoryPerThreadMB, 
                       commonMassAxis,
-                      referenceSpectrum);
+                      referenceSpectrum,
+                      float32DataCubes);
  
     out = myRef.Run();
   }
@@ -32,7 +32,7 @@ class MTInternalRef : public ThreadingMsiProc
     // memoryPerThreadMB: Maximum memory allocated by each thread in MB. The total allocated memory will be: 2*numberOfThreads*memoryPerThreadMB
     // commonMassAxis: The common mass axis used to process and interpolate multiple datasets.
     // reference: The reference spectrum
-    MTInternalRef(Rcpp::List rMSIObj_list, int numberOfThreads, double memoryPerThreadMB, Rcpp::NumericVector commonMassAxis, Rcpp::NumericVector reference);
+    MTInternalRef(Rcpp::List rMSIObj_list, int numberOfThreads, double memoryPerThreadMB, Rcpp::NumericVector commonMassAxis, Rcpp::NumericVector reference, bool float32DataCubes = false);
     ~MTInternalRef();
     
     //Execute a full imatge processing using threaded methods
@@ -57,7 +57,10 @@ class MTInternalRef : public ThreadingMsiProc
     void ProcessingFunction(int threadSlot);
     
     //Methods to compute the mean, number of elements is the same as the global mass axis
-    double computeMean(double *data);
+    template<typename T> double computeMean(const T *data);
+    
+    //Pearson correlation of a spectrum with the reference. It is templated on the sample type of the data cube, so float32 rows are read in place.
+    template<typename T> double computeCorrelation(const T *spectrum);
     
 };
 #endif
@@ -18,13 +18,15 @@
 
 #include <Rcpp.h>
 #include "mtpeakpicking.h"
+#include "scratcharena.h"
 using namespace Rcpp;
 
 MTPeakPicking::MTPeakPicking(Rcpp::List rMSIObj_list, int numberOfThreads, double memoryPerThreadMB,
                              Rcpp::Reference preProcessingParams,
                              Rcpp::StringVector uuid, Rcpp::String outputImzMLPath, Rcpp::StringVector outputImzMLfnames, 
-                             Rcpp::NumericVector commonMassAxis) : 
-  ThreadingMsiProc(rMSIObj_list, numberOfThreads, memoryPerThreadMB, commonMassAxis, DataCubeIOMode::PEAKLIST_STORE, uuid, outputImzMLPath, outputImzMLfnames)
+                             Rcpp::NumericVector commonMassAxis,
+                             bool float32DataCubes, bool recomputeNoise) : 
+  ThreadingMsiProc(rMSIObj_list, numberOfThreads, memoryPerThreadMB, commonMassAxis, DataCubeIOMode::PEAKLIST_STORE, uuid, outputImzMLPath, outputImzMLfnames, float32DataCubes)
 {
   //Get the peak-picking params
   Rcpp::Reference peakPickingParams = preProcessingParams.field("peakpicking");
@@ -37,6 +39,39 @@ MTPeakPicking::MTPeakPicking(Rcpp::List rMSIObj_list, int numberOfThreads, doubl
   {
     peakObj[i] = new PeakPicking(peakWinSize, massAxis.begin(), massAxis.length(), peakInterpolationUpSampling );  
   }
+  
+  //Bin the peaks while they are in memory instead of reading back the peak lists
+  Rcpp::Reference peakBinningParams = preProcessingParams.field("peakbinning");
+  bool bEnablePeakBinning = peakBinningParams.field("enable");
+  massBins = bEnablePeakBinning ? new MassBinAccumulator(preProcessingParams, numOfThreadsDouble) : nullptr;
+  
+  //Use the noise stored by the pre-processing when it was estimated for the same data and window
+  unsigned int cachedImages = 0;
+  for( int i = 0; i < rMSIObj_list.length(); i++)
+  {
+    NoiseCache *cache = nullptr;
+    Rcpp::List data = Rcpp::as<Rcpp::List>(rMSIObj_list[i])["data"];
+    Rcpp::List imzML = data["imzML"];
+    if(!recomputeNoise && imzML.containsElementNamed("uuid"))
+    {
+      cache = new NoiseCache(NoiseCache::fileName(Rcpp::as<std::string>(data["path"]), Rcpp::as<std::string>(imzML["file"])),
+                             Rcpp::as<std::string>(imzML["uuid"]), massAxis.length(), PeakPicking::getNoiseWinSize(peakWinSize));
+      if(!cache->isValid())
+      {
+        delete cache;
+        cache = nullptr;
+      }
+    }
+    if(cache != nullptr)
+    {
+      cachedImages++;
+    }
+    noiseCaches.push_back(cache);
+  }
+  if(cachedImages > 0)
+  {
+    Rcpp::Rcout<<"Using the noise cache of "<<cachedImages<<" of "<<noiseCaches.size()<<" images\n";
+  }
 }
 
 MTPeakPicking::~MTPeakPicking()
@@ -46,6 +81,11 @@ MTPeakPicking::~MTPeakPicking()
     delete peakObj[i];
   }
   delete[] peakObj;
+  for( unsigned int i = 0; i < noiseCaches.size(); i++)
+  {
+    delete noiseCaches[i];
+  }
+  delete massBins;
 }
 
 Rcpp::List MTPeakPicking::Run()
@@ -62,7 +102,11 @@ Rcpp::List MTPeakPicking::Run()
     offsetLst.push_back(ioObj->get_OffsetsLengths(i));
   }
   
-  return offsetLst;
+  if(massBins != nullptr)
+  {
+    return List::create( Named("Offsets") = offsetLst, Named("Bins") = massBins->GetMassBins() );
+  }
+  return List::create( Named("Offsets") = offsetLst );
 }
 
 void MTPeakPicking::ProcessingFunction(int threadSlot)
@@ -70,7 +114,23 @@ void MTPeakPicking::ProcessingFunction(int threadSlot)
   //Perform peak-picking of each spectrum in the current loaded cube
   for( int j = 0; j < cubes[threadSlot]->nrows; j++)
   {
-     cubes[threadSlot]->peakLists[j] = peakObj[threadSlot]->peakPicking( cubes[threadSlot]->dataInterpolated[j], minSNR ); 
+     ScratchArena::Scope scratch;
+     double *noise = nullptr;
+     NoiseCache *cache = noiseCaches[ioObj->getImageIndex(cubes[threadSlot]->cubeID, j)];
+     if(cache != nullptr)
+     {
+       noise = scratch.alloc<double>(massAxis.length());
+       if(!cache->load(cubes[threadSlot]->dataOriginal[j].pixelID, noise))
+       {
+         noise = nullptr; //Pixel not in the cache, estimate it
+       }
+     }
+     cubes[threadSlot]->peakLists[j] = peakObj[threadSlot]->peakPicking( getSpectrum(threadSlot, j), minSNR, noise ); 
+  }
+  
+  if(massBins != nullptr)
+  {
+    massBins->AddPeakLists(threadSlot, cubes[threadSlot]->peakLists, cubes[threadSlot]->nrows);
   }
 }
 
@@ -78,7 +138,9 @@ void MTPeakPicking::ProcessingFunction(int threadSlot)
 Rcpp::List CRunPeakPicking(   Rcpp::List rMSIObj_list,int numOfThreads, double memoryPerThreadMB, 
                         Rcpp::Reference preProcessingParams, 
                         Rcpp::StringVector uuid, Rcpp::String outputDataPath, Rcpp::StringVector imzMLoutFnames,
-                        Rcpp::NumericVector commonMassAxis)
+                        Rcpp::NumericVector commonMassAxis,
+                        bool float32DataCubes = false,
+                        bool recomputeNoise = false)
 {
   Rcpp::List out;
   try
@@ -86,7 +148,9 @@ Rcpp::List CRunPeakPicking(   Rcpp::List rMSIObj_list,int numOfThreads, double m
     MTPeakPicking myPeakPicking (rMSIObj_list, numOfThreads, memoryPerThreadMB,
                                preProcessingParams,
                                uuid, outputDataPath, imzMLoutFnames, 
-                               commonMassAxis);
+                               commonMassAxis,
+                               float32DataCubes,
+                               recomputeNoise);
   
     out = myPeakPicking.Run();
   }
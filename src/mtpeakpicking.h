@@ -21,6 +21,9 @@
 #include <Rcpp.h>
 #include "peakpicking.h"
 #include "threadingmsiproc.h"
+#include "noisecache.h"
+#include "peakbinning.h"
+#include <vector>
 
 class MTPeakPicking : public ThreadingMsiProc 
 {
@@ -35,20 +38,26 @@ class MTPeakPicking : public ThreadingMsiProc
     // outputImzMLPath: an existing target path to store imzML files with the processed data
     // outputImzMLfnames: a string vector with the file names for the output imzML files
     // commonMassAxis: The common mass axis used to process and interpolate multiple datasets.
+    // recomputeNoise: Estimate the noise of all spectra even if the pre-processing stored it in a noise cache.
     MTPeakPicking(Rcpp::List rMSIObj_list, int numberOfThreads, double memoryPerThreadMB,
                   Rcpp::Reference preProcessingParams,
                   Rcpp::StringVector uuid, Rcpp::String outputImzMLPath, Rcpp::StringVector outputImzMLfnames, 
-                  Rcpp::NumericVector commonMassAxis
+                  Rcpp::NumericVector commonMassAxis,
+                  bool float32DataCubes = false,
+                  bool recomputeNoise = false
                   );
     
     ~MTPeakPicking();
     
     //Exectur a full imatge processing using threaded methods
+    //Returns the peak lists offsets and, when peak binning is enabled, the mass bins of the picked peaks.
     Rcpp::List Run();
 
   private:
     PeakPicking **peakObj;
     double minSNR;
+    std::vector<NoiseCache*> noiseCaches; //Noise cache of each image, null if it must be estimated
+    MassBinAccumulator *massBins; //Peaks are binned while picked if peak binning is enabled, null otherwise
 
     //Thread Processing function definition
     void ProcessingFunction(int threadSlot);
@@ -19,14 +19,21 @@
 #include <Rcpp.h>
 #include <cmath>
 #include "mtpreprocessing.h"
+#include "peakpicking.h"
+#include "scratcharena.h"
 using namespace Rcpp;
 
 MTPreProcessing::MTPreProcessing(Rcpp::List rMSIObj_list, int numberOfThreads, double memoryPerThreadMB,
                                  Rcpp::Reference preProcessingParams, Rcpp::NumericVector reference,
                                  Rcpp::StringVector uuid,  Rcpp::String outputImzMLPath, Rcpp::StringVector outputImzMLfnames, 
                                  Rcpp::NumericVector commonMassAxis,
-                                 int bitDepthReductionNoiseWindows) : 
-  ThreadingMsiProc(rMSIObj_list, numberOfThreads, memoryPerThreadMB, commonMassAxis, DataCubeIOMode::DATA_STORE, uuid, outputImzMLPath, outputImzMLfnames), 
+                                 int bitDepthReductionNoiseWindows,
+                                 bool float32DataCubes,
+                                 bool fusedPeakPicking) : 
+  ThreadingMsiProc(rMSIObj_list, numberOfThreads, memoryPerThreadMB, commonMassAxis, 
+                   fusedPeakPicking ? DataCubeIOMode::PEAKLIST_STORE : DataCubeIOMode::DATA_STORE, 
+                   uuid, outputImzMLPath, outputImzMLfnames, float32DataCubes), 
+  bFusedPeakPicking(fusedPeakPicking),
   NoiseWinSize(bitDepthReductionNoiseWindows)
 {
   //TODO add baseline params here!
@@ -48,6 +55,50 @@ MTPreProcessing::MTPreProcessing(Rcpp::List rMSIObj_list, int numberOfThreads, d
   int fftOverSampling = alignmentParams.field("overSampling");
   double winSizeRelative = alignmentParams.field("winSizeRelative");
   
+  //Get the peak-picking params to keep the noise of the processed spectra for the peak detector
+  Rcpp::Reference peakPickingParams = preProcessingParams.field("peakpicking");
+  bool bEnablePeakPicking = peakPickingParams.field("enable");
+  int peakWinSize = peakPickingParams.field("WinSize");
+  int peakInterpolationUpSampling = peakPickingParams.field("overSampling");
+  minSNR = peakPickingParams.field("SNR");
+  peakNoiseWinSize = PeakPicking::getNoiseWinSize(peakWinSize);
+  peakObj = nullptr;
+  if(bFusedPeakPicking)
+  {
+    //The fill-peaks algorithm reads the processed spectra, so they must be stored when the peaks are binned
+    Rcpp::Reference peakBinningParams = preProcessingParams.field("peakbinning");
+    bool bEnablePeakBinning = peakBinningParams.field("enable");
+    if(bEnablePeakBinning)
+    {
+      throw std::runtime_error("Error: the peaks can not be picked during the pre-processing with peak binning enabled, the fill-peaks algorithm needs the processed spectra\n");
+    }
+    
+    peakObj = new PeakPicking*[numOfThreadsDouble];
+    for(int i = 0; i < numOfThreadsDouble; i++)
+    {
+      peakObj[i] = new PeakPicking(peakWinSize, massAxis.begin(), massAxis.length(), peakInterpolationUpSampling );  
+    }
+  }
+  else if(bEnablePeakPicking)
+  {
+    //The peak picking of processed mode images interpolates the bit depth reduced original spectra again, so their noise is not cached
+    for( int i = 0; i < rMSIObj_list.length(); i++)
+    {
+      Rcpp::List data = Rcpp::as<Rcpp::List>(rMSIObj_list[i])["data"];
+      Rcpp::List imzML = data["imzML"];
+      if(!Rcpp::as<bool>(imzML["continuous_mode"]))
+      {
+        noiseCaches.push_back(nullptr);
+        continue;
+      }
+      Rcpp::DataFrame imzMLrun = Rcpp::as<Rcpp::DataFrame>(imzML["run"]);
+      Rcpp::String outFname = outputImzMLfnames[i];
+      Rcpp::String outUUID = uuid[i];
+      noiseCaches.push_back(new NoiseCache(NoiseCache::fileName(outputImzMLPath.get_cstring(), outFname.get_cstring()),
+                                           outUUID.get_cstring(), imzMLrun.nrows(), massAxis.length(), peakNoiseWinSize));
+    }
+  }
+  
   smoothObj = new Smoothing*[numOfThreadsDouble];
   alngObj = new LabelFreeAlign*[numOfThreadsDouble];
   noiseModel = new NoiseEstimation*[numOfThreadsDouble];
@@ -61,6 +112,16 @@ MTPreProcessing::MTPreProcessing(Rcpp::List rMSIObj_list, int numberOfThreads, d
     
     noiseModel[i] = new NoiseEstimation(massAxis.length()); //Used by the bitdepth reduction
   }
+  
+  peakNoiseModel = nullptr;
+  if(!noiseCaches.empty())
+  {
+    peakNoiseModel = new NoiseEstimation*[numOfThreadsDouble];
+    for(int i = 0; i < numOfThreadsDouble; i++)
+    {
+      peakNoiseModel[i] = new NoiseEstimation(massAxis.length());
+    }
+  }
 
   mLags  =  new LabelFreeAlign::TLags[numPixels]; 
   
@@ -84,11 +145,31 @@ MTPreProcessing::~MTPreProcessing()
   delete[] alngObj;
   delete[] noiseModel;
   delete[] mLags;
+  for( unsigned int i = 0; i < noiseCaches.size(); i++)
+  {
+    delete noiseCaches[i];
+  }
+  if(peakNoiseModel != nullptr)
+  {
+    for(int i = 0; i < numOfThreadsDouble; i++)
+    {
+      delete peakNoiseModel[i];
+    }
+    delete[] peakNoiseModel;
+  }
+  if(peakObj != nullptr)
+  {
+    for(int i = 0; i < numOfThreadsDouble; i++)
+    {
+      delete peakObj[i];
+    }
+    delete[] peakObj;
+  }
 }
 
 List MTPreProcessing::Run()
 {
-  Rcpp::Rcout<<"Spectral pre-processing...\n";
+  Rcpp::Rcout<<(bFusedPeakPicking ? "Spectral pre-processing and peak-picking...\n" : "Spectral pre-processing...\n");
   
   //Run preprocessing in mutli-threading
   runMSIProcessingCpp();
@@ -102,6 +183,20 @@ List MTPreProcessing::Run()
     LagsHigh[i] = mLags[i].lagHigh;
   }
   
+  //With fused peak picking only the peak lists are stored
+  if(bFusedPeakPicking)
+  {
+    Rcpp::List offsetLst;
+    for( unsigned int i = 0; i < ioObj->get_images_count(); i++)
+    {
+      offsetLst.push_back(ioObj->get_OffsetsLengths(i));
+    }
+    return List::create( Named("LagLow") = LagsLow, 
+                         Named("LagHigh") = LagsHigh, 
+                         Named("Offsets") = offsetLst
+                          );
+  }
+  
   //Get the imzMLwriters offset and average/base spectrums
   Rcpp::List offsetLst;
   Rcpp::List averageSpectraLst;
@@ -126,13 +221,14 @@ void MTPreProcessing::ProcessingFunction(int threadSlot)
   //Process each spectrum in the current loaded cube
   for( int j = 0; j < cubes[threadSlot]->nrows; j++)
   {
+    double *spectrum = getSpectrum(threadSlot, j);
    
    //TODO add the baseline reduction
    
     if(bEnableSmoothing)
     {
       smoothObj[threadSlot]->smoothSavitzkyGolay( massAxis.begin(),
-                                                  cubes[threadSlot]->dataInterpolated[j],
+                                                  spectrum,
                                                   massAxis.length(), 
                                                   cubes[threadSlot]->dataOriginal[j].imzMLmass.data(),
                                                   cubes[threadSlot]->dataOriginal[j].imzMLintensity.data(),
@@ -143,7 +239,7 @@ void MTPreProcessing::ProcessingFunction(int threadSlot)
     
     if(bEnableAlignment)
     {
-      mLags[cubes[threadSlot]->dataOriginal[j].pixelID] = alngObj[threadSlot]->AlignSpectrum( cubes[threadSlot]->dataInterpolated[j], 
+      mLags[cubes[threadSlot]->dataOriginal[j].pixelID] = alngObj[threadSlot]->AlignSpectrum( spectrum, 
                                                                                               cubes[threadSlot]->dataOriginal[j].imzMLmass.data(),
                                                                                               cubes[threadSlot]->dataOriginal[j].imzMLintensity.data(),
                                                                                               cubes[threadSlot]->dataOriginal[j].imzMLmass.size()
@@ -151,21 +247,54 @@ void MTPreProcessing::ProcessingFunction(int threadSlot)
     }
     
    
-    if(bEnableSmoothing || bEnableAlignment)
+    if(bFusedPeakPicking)
     {
+      //The peaks are picked from the spectrum as it would be stored and read back by the peak picking
       if(cubes[threadSlot]->dataOriginal[j].imzMLmass.size() == 0)
       {
         //Continuous mode
-        BitDepthReduction(cubes[threadSlot]->dataInterpolated[j], cubes[threadSlot]->ncols, threadSlot);
+        BitDepthReduction(spectrum, cubes[threadSlot]->ncols, threadSlot);
       }
       else
       {
-        //Processed mode
+        //Processed mode, the reduced original spectrum is interpolated again
+        if((int)cubes[threadSlot]->dataOriginal[j].imzMLintensity.size() <= cubes[threadSlot]->ncols)
+        {
+          BitDepthReduction(cubes[threadSlot]->dataOriginal[j].imzMLintensity.data(), cubes[threadSlot]->dataOriginal[j].imzMLintensity.size(), threadSlot);
+        }
+        ioObj->interpolateSpectrum(cubes[threadSlot], j, spectrum);
+      }
+      setSpectrum(threadSlot, j, spectrum); //Keeps the precision of float32 data cubes
+      cubes[threadSlot]->peakLists[j] = peakObj[threadSlot]->peakPicking(getSpectrum(threadSlot, j), minSNR);
+    }
+    else if(bEnableSmoothing || bEnableAlignment)
+    {
+      if(cubes[threadSlot]->dataOriginal[j].imzMLmass.size() == 0)
+      {
+        //Continuous mode
+        BitDepthReduction(spectrum, cubes[threadSlot]->ncols, threadSlot);
+        
+        //The peak picking reads the reduced spectrum, so its noise is estimated after the reduction
+        NoiseCache *cache = noiseCaches.empty() ? nullptr : noiseCaches[ioObj->getImageIndex(cubes[threadSlot]->cubeID, j)];
+        if(cache != nullptr)
+        {
+          ScratchArena::Scope scratch;
+          double *peakNoise = scratch.alloc<double>(cubes[threadSlot]->ncols);
+          memcpy(peakNoise, spectrum, sizeof(double)*cubes[threadSlot]->ncols);
+          peakNoiseModel[threadSlot]->NoiseEstimationFFTExpWin(peakNoise, cubes[threadSlot]->ncols, peakNoiseWinSize);
+          cache->store(cubes[threadSlot]->dataOriginal[j].pixelID, peakNoise);
+        }
+      }
+      else
+      {
+        //Processed mode, the bit depth reduction is applied to the original spectrum
         if(cubes[threadSlot]->dataOriginal[j].imzMLintensity.size() <= cubes[threadSlot]->ncols)
         {
           BitDepthReduction(cubes[threadSlot]->dataOriginal[j].imzMLintensity.data(), cubes[threadSlot]->dataOriginal[j].imzMLintensity.size(), threadSlot);
         }
       }
+      
+      setSpectrum(threadSlot, j, spectrum);
     }
    
   }
@@ -178,7 +307,8 @@ void MTPreProcessing::ProcessingFunction(int threadSlot)
 void MTPreProcessing::BitDepthReduction(double *data, int dataLength, int noiseModelThreadSlot)
 {
   int resolution_bits;
-  double *noise_floor = new double[dataLength];
+  ScratchArena::Scope scratch;
+  double *noise_floor = scratch.alloc<double>(dataLength);
   memcpy(noise_floor, data, sizeof(double)*dataLength);
   noiseModel[noiseModelThreadSlot]->NoiseEstimationFFTExpWin(noise_floor, dataLength, NoiseWinSize);
   
@@ -203,15 +333,15 @@ void MTPreProcessing::BitDepthReduction(double *data, int dataLength, int noiseM
     data[i] = data[i] < 0.0 ? 0.0 : data[i];
     
   }
-  
-  delete[] noise_floor;
 }
 
 // [[Rcpp::export]]
 List CRunPreProcessing( Rcpp::List rMSIObj_list,int numOfThreads, double memoryPerThreadMB, 
                      Rcpp::Reference preProcessingParams, Rcpp::NumericVector reference, 
                      Rcpp::StringVector uuid, Rcpp::String outputDataPath, Rcpp::StringVector imzMLoutFnames,
-                     Rcpp::NumericVector commonMassAxis)
+                     Rcpp::NumericVector commonMassAxis,
+                     bool float32DataCubes = false,
+                     bool fusedPeakPicking = false)
 {
   List out;
   try
@@ -219,7 +349,10 @@ List CRunPreProcessing( Rcpp::List rMSIObj_list,int numOfThreads, double memoryP
    MTPreProcessing myPreProcessing(rMSIObj_list, numOfThreads, memoryPerThreadMB,
                                   preProcessingParams, reference, 
                                   uuid, outputDataPath, imzMLoutFnames, 
-                                  commonMassAxis);
+                                  commonMassAxis,
+                                  16,
+                                  float32DataCubes,
+                                  fusedPeakPicking);
    out =  myPreProcessing.Run();
   }
   catch(std::runtime_error &e)
@@ -22,8 +22,11 @@
 
 #include "smoothing.h"
 #include "labelfreealign.h"
+#include "peakpicking.h"
 #include "threadingmsiproc.h"
 #include "noiseestimation.h"
+#include "noisecache.h"
+#include <vector>
 
 class MTPreProcessing : public ThreadingMsiProc 
 {
@@ -41,14 +44,19 @@ class MTPreProcessing : public ThreadingMsiProc
     // outputImzMLfnames: a string vector with the file names for the output imzML files
     // commonMassAxis: The common mass axis used to process and interpolate multiple datasets.
     // bitDepthReductionNoiseWindows: The noise estimation windows used by the bitdepth reduction
+    // fusedPeakPicking: Pick the peaks of the pre-processed spectra in memory and store only the peak lists, so uuid and outputImzMLfnames are used for the peak lists imzML files.
     MTPreProcessing(Rcpp::List rMSIObj_list, int numberOfThreads, double memoryPerThreadMB,
                     Rcpp::Reference preProcessingParams, Rcpp::NumericVector reference,
                     Rcpp::StringVector uuid, Rcpp::String outputImzMLPath, Rcpp::StringVector outputImzMLfnames, 
                     Rcpp::NumericVector commonMassAxis,
-                    int bitDepthReductionNoiseWindows = 16);
+                    int bitDepthReductionNoiseWindows = 16,
+                    bool float32DataCubes = false,
+                    bool fusedPeakPicking = false);
     ~MTPreProcessing();
  
     //Exectue a full imatge processing using threaded methods and returns the used shifts in the first iteration
+    //With fused peak picking the returned offsets are the ones of the peak lists and no average or base spectra are returned.
+    //The mass bins of the picked peaks are also returned if peak binning is enabled.
     Rcpp::List Run(); 
     
     //Single spectrum bit depth reduction
@@ -62,9 +70,20 @@ class MTPreProcessing : public ThreadingMsiProc
     LabelFreeAlign **alngObj;
     LabelFreeAlign::TLags *mLags; //A place to store alignment lags
     
+    //Fused peak picking data
+    bool bFusedPeakPicking;
+    PeakPicking **peakObj; //Only allocated with fused peak picking
+    double minSNR;
+    
     //Bit depth reduction data
     NoiseEstimation **noiseModel;
     int NoiseWinSize;
+    
+    //Noise of the processed spectra estimated with the peak picking window, one cache for each output imzML.
+    //It is empty if peak picking is disabled and the cache of processed mode images is null.
+    std::vector<NoiseCache*> noiseCaches;
+    NoiseEstimation **peakNoiseModel; //Only allocated if there are noise caches
+    int peakNoiseWinSize;
     unsigned long long maskLUT_double[52];
     
     //Thread Processing function definition
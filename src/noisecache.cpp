@@ -0,0 +1,180 @@
+/*************************************************************************
+ *     rMSIproc - R package for MSI data processing
+ *     Copyright (C) 2014 Pere Rafols Soler
+ * 
+ *     This program is free software: you can redistribute it and/or modify
+ *     it under the terms of the GNU General Public License as published by
+ *     the Free Software Foundation, either version 3 of the License, or
+ *     (at your option) any later version.
+ * 
+ *     This program is distributed in the hope that it will be useful,
+ *     but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *     MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *     GNU General Public License for more details.
+ * 
+ *     You should have received a copy of the GNU General Public License
+ *     along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ **************************************************************************/
+#include <Rcpp.h>
+#include <cmath>
+#include <cstring>
+#include <vector>
+#include "noisecache.h"
+using namespace Rcpp;
+
+#define NOISE_CACHE_MAGIC "rMSInois"
+#define NOISE_CACHE_VERSION 1
+#define NOISE_CACHE_STORED 0x4E4F4953 //Marker written before the samples of each stored pixel, unstored pixels read as zeros
+
+NoiseCache::NoiseCache(std::string fname, std::string uuid, int numOfPixels, int dataLength, int WinSize)
+{
+  setHeader(uuid, numOfPixels, dataLength, WinSize);
+  cacheFile.open(fname, std::fstream::in | std::fstream::out | std::fstream::binary | std::fstream::trunc);
+  if(!cacheFile.is_open())
+  {
+    throw std::runtime_error("Error: Could not create the noise cache file " + fname + "\n");
+  }
+  cacheFile.write((const char*)&header, sizeof(Header));
+  bValid = true;
+}
+
+NoiseCache::NoiseCache(std::string fname, std::string uuid, int dataLength, int WinSize)
+{
+  bValid = false;
+  cacheFile.open(fname, std::fstream::in | std::fstream::binary);
+  if(!cacheFile.is_open())
+  {
+    return; //There is no cache for this imzML
+  }
+  
+  Header expected;
+  Header stored;
+  setHeader(uuid, 0, dataLength, WinSize);
+  expected = header;
+  if( !cacheFile.read((char*)&stored, sizeof(Header)) )
+  {
+    return;
+  }
+  
+  bValid = memcmp(stored.magic, expected.magic, sizeof(stored.magic)) == 0 &&
+           stored.version == expected.version &&
+           stored.dataLength == expected.dataLength &&
+           stored.winSize == expected.winSize &&
+           stored.step == expected.step &&
+           stored.numOfSamples == expected.numOfSamples &&
+           memcmp(stored.uuid, expected.uuid, sizeof(stored.uuid)) == 0;
+  header = stored;
+}
+
+NoiseCache::~NoiseCache()
+{
+  if(cacheFile.is_open())
+  {
+    cacheFile.close();
+  }
+}
+
+bool NoiseCache::isValid()
+{
+  return bValid;
+}
+
+void NoiseCache::setHeader(std::string uuid, int numOfPixels, int dataLength, int WinSize)
+{
+  memset(&header, 0, sizeof(Header));
+  memcpy(header.magic, NOISE_CACHE_MAGIC, sizeof(header.magic));
+  header.version = NOISE_CACHE_VERSION;
+  header.numOfPixels = numOfPixels;
+  header.dataLength = dataLength;
+  header.winSize = WinSize;
+  
+  //The estimation window keeps the frequencies up to WinSize bins of the power of two FFT
+  int fftSize = (int)pow(2.0, std::ceil(log2(dataLength)));
+  int step = fftSize / (NOISE_CACHE_OVERSAMPLING * WinSize);
+  header.step = step < 1 ? 1 : step;
+  header.numOfSamples = (dataLength - 1 + header.step - 1)/header.step + 1; //The last sample is always at the last mass channel
+  memcpy(header.uuid, uuid.c_str(), uuid.length() < sizeof(header.uuid) ? uuid.length() : sizeof(header.uuid));
+}
+
+std::streamoff NoiseCache::pixelOffset(int pixelID)
+{
+  return (std::streamoff)sizeof(Header) + (std::streamoff)pixelID * (std::streamoff)(sizeof(uint32_t) + sizeof(float)*header.numOfSamples);
+}
+
+void NoiseCache::store(int pixelID, const double *noise)
+{
+  if( pixelID < 0 || (uint32_t)pixelID >= header.numOfPixels )
+  {
+    throw std::runtime_error("Error: Pixel out of range in the noise cache\n");
+  }
+  
+  //Downsample the noise
+  std::vector<char> record(sizeof(uint32_t) + sizeof(float)*header.numOfSamples);
+  uint32_t marker = NOISE_CACHE_STORED;
+  memcpy(record.data(), &marker, sizeof(uint32_t));
+  float *samples = (float*)(record.data() + sizeof(uint32_t));
+  for( uint32_t k = 0; k < header.numOfSamples; k++)
+  {
+    uint32_t i = k*header.step;
+    samples[k] = (float)noise[ i < header.dataLength ? i : header.dataLength - 1 ];
+  }
+  
+  std::lock_guard<std::mutex> lock(fileMutex);
+  cacheFile.seekp(pixelOffset(pixelID));
+  cacheFile.write(record.data(), record.size());
+  if(cacheFile.fail())
+  {
+    throw std::runtime_error("Error: Could not write the noise cache file\n");
+  }
+}
+
+bool NoiseCache::load(int pixelID, double *noise)
+{
+  if( !bValid || pixelID < 0 || (uint32_t)pixelID >= header.numOfPixels )
+  {
+    return false;
+  }
+  
+  std::vector<char> record(sizeof(uint32_t) + sizeof(float)*header.numOfSamples);
+  {
+    std::lock_guard<std::mutex> lock(fileMutex);
+    cacheFile.seekg(pixelOffset(pixelID));
+    cacheFile.read(record.data(), record.size());
+    if(cacheFile.fail())
+    {
+      cacheFile.clear(); //The pixel is beyond the end of an incomplete cache
+      return false;
+    }
+  }
+  
+  uint32_t marker;
+  memcpy(&marker, record.data(), sizeof(uint32_t));
+  if( marker != NOISE_CACHE_STORED )
+  {
+    return false;
+  }
+  
+  //Interpolate the samples back to all mass channels
+  const float *samples = (const float*)(record.data() + sizeof(uint32_t));
+  for( uint32_t i = 0; i < header.dataLength; i++)
+  {
+    uint32_t k = i / header.step;
+    uint32_t iLeft = k * header.step;
+    if( i == iLeft || k + 1 >= header.numOfSamples )
+    {
+      noise[i] = samples[k];
+    }
+    else
+    {
+      uint32_t iRight = iLeft + header.step < header.dataLength ? iLeft + header.step : header.dataLength - 1;
+      double w = ((double)(i - iLeft))/((double)(iRight - iLeft));
+      noise[i] = samples[k] + w*(samples[k+1] - samples[k]);
+    }
+  }
+  return true;
+}
+
+std::string NoiseCache::fileName(std::string path, std::string imzMLfname)
+{
+  return path + "/" + imzMLfname + ".noise";
+}
@@ -0,0 +1,75 @@
+/*************************************************************************
+ *     rMSIproc - R package for MSI data processing
+ *     Copyright (C) 2014 Pere Rafols Soler
+ * 
+ *     This program is free software: you can redistribute it and/or modify
+ *     it under the terms of the GNU General Public License as published by
+ *     the Free Software Foundation, either version 3 of the License, or
+ *     (at your option) any later version.
+ * 
+ *     This program is distributed in the hope that it will be useful,
+ *     but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *     MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *     GNU General Public License for more details.
+ * 
+ *     You should have received a copy of the GNU General Public License
+ *     along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ **************************************************************************/
+#ifndef NOISE_CACHE_H
+  #define NOISE_CACHE_H
+
+#include <string>
+#include <fstream>
+#include <mutex>
+#include <cstdint>
+
+#define NOISE_CACHE_OVERSAMPLING 8 //Stored samples per period of the highest frequency kept by the noise estimation window
+
+//Per-pixel cache of the noise estimated for the spectra of an imzML, stored in a .noise file next to its .ibd file.
+//The noise is a smooth envelope, so it is downsampled according to the estimation window and linearly interpolated when loaded.
+//The file header keeps the imzML UUID, the mass axis length and the window size, so a cache is only used with the data it was computed from.
+class NoiseCache
+{
+  public:
+    //Creates a new cache file for numOfPixels spectra of dataLength points with the noise estimated using WinSize
+    NoiseCache(std::string fname, std::string uuid, int numOfPixels, int dataLength, int WinSize);
+    
+    //Opens an existing cache file, isValid() returns false if it can not be used for the given imzML UUID, mass axis length and WinSize
+    NoiseCache(std::string fname, std::string uuid, int dataLength, int WinSize);
+    ~NoiseCache();
+    
+    bool isValid();
+    
+    //Stores the noise of a pixel, it can be called from multiple threads
+    void store(int pixelID, const double *noise);
+    
+    //Loads the noise of a pixel into noise, which must hold dataLength points. It can be called from multiple threads.
+    //Returns false if the pixel has not been stored.
+    bool load(int pixelID, double *noise);
+    
+    //Returns the cache file of the imzML file named imzMLfname (without extension) in path
+    static std::string fileName(std::string path, std::string imzMLfname);
+    
+  private:
+    typedef struct
+    {
+      char magic[8];
+      uint32_t version;
+      uint32_t numOfPixels;
+      uint32_t dataLength;
+      uint32_t winSize;
+      uint32_t step; //Mass channels between stored samples
+      uint32_t numOfSamples; //Stored samples per pixel
+      char uuid[32];
+    } Header;
+    
+    Header header;
+    std::fstream cacheFile;
+    std::mutex fileMutex; //Keeps the seek and read/write of each pixel together
+    bool bValid;
+    
+    void setHeader(std::string uuid, int numOfPixels, int dataLength, int WinSize);
+    std::streamoff pixelOffset(int pixelID);
+};
+
+#endif
@@ -19,17 +19,20 @@
 #include <Rcpp.h>
 #include <cmath>
 #include "noiseestimation.h"
+#include "fftengine.h"
 using namespace Rcpp;
 
 
 NoiseEstimation::NoiseEstimation(int dataLength)
 {
   //Init FFT objects according dataLength
-  FFT_Size = (int)pow(2.0, std::ceil(log2(dataLength)));
+  //The FFT size is the smallest one FFTW handles efficiently, window sizes are still given in bins of the next power of two
+  FFT_Size = FFTEngine::goodSize(dataLength);
+  filWinScale = ((double)FFT_Size) / pow(2.0, std::ceil(log2(dataLength)));
   fft_in = fftw_alloc_real(FFT_Size);
   fft_out = fftw_alloc_real(FFT_Size);
-  fft_pdirect = fftw_plan_r2r_1d(FFT_Size, fft_in, fft_out, FFTW_R2HC, FFTW_ESTIMATE);
-  fft_pinvers = fftw_plan_r2r_1d(FFT_Size, fft_out, fft_in, FFTW_HC2R, FFTW_ESTIMATE);
+  fft_pdirect = FFTEngine::getPlan(FFT_Size, FFTW_R2HC);
+  fft_pinvers = FFTEngine::getPlan(FFT_Size, FFTW_HC2R);
   filWin = new double[1+FFT_Size/2];
   filWinMode = none;
   filWinSize = 0;
@@ -37,8 +40,6 @@ NoiseEstimation::NoiseEstimation(int dataLength)
 
 NoiseEstimation::~NoiseEstimation()
 {
-  fftw_destroy_plan(fft_pdirect);
-  fftw_destroy_plan(fft_pinvers);
   fftw_free(fft_in); 
   fftw_free(fft_out);
   delete[] filWin;
@@ -67,25 +68,20 @@ void NoiseEstimation::NoiseEstimationFFTExpWin( double *data, int dataLength, in
 void NoiseEstimation::NoiseEstimationFFT(double *data, int dataLength)
 {
   
-  //Copy data adding padding zeros
-  double *xc_data = new double[FFT_Size];
-  for( int i = 0; i < FFT_Size; i++)
-  {
-    xc_data[i] = i < dataLength? data[i] : 0.0;
-  }
-
   if( filWinSize == 0 || filWinMode == none )
   {
     stop("Error: Filtering Windows has not been calculated yet");
-    delete[] xc_data;
     return; 
   }
   
-  //Copy data to a FFT objects
-  memcpy(fft_in, xc_data, sizeof(double)*FFT_Size);
+  //Copy data to a FFT objects adding padding zeros
+  for( int i = 0; i < FFT_Size; i++)
+  {
+    fft_in[i] = i < dataLength? data[i] : 0.0;
+  }
 
   //FFT data
-  fftw_execute(fft_pdirect);
+  FFTEngine::execute(fft_pdirect, fft_in, fft_out);
   
   //Apply the window function
   for( int i = 0; i <= FFT_Size/2; i++)
@@ -98,15 +94,13 @@ void NoiseEstimation::NoiseEstimationFFT(double *data, int dataLength)
   }
   
   //The invers FFT
-  fftw_execute(fft_pinvers);
+  FFTEngine::execute(fft_pinvers, fft_out, fft_in);
   
   //Copy data from FFT object respecting original data size
   for( int i = 0; i < dataLength; i++)
   {
     data[i] = fft_in[i] / (double)FFT_Size; //Amplitude scaling to fit original range
   }
-  
-  delete[] xc_data;
 }
 
 NumericVector NoiseEstimation::NoiseEstimationFFTCosWin( NumericVector data, int WinSize )
@@ -134,9 +128,10 @@ NumericVector NoiseEstimation::NoiseEstimationFFTExpWin( NumericVector data, int
 void NoiseEstimation::ComputeCosWin(int WinSize)
 {
   filWinSize = WinSize;
+  const double winBins = filWinScale * (double)filWinSize;
   for( int i = 0; i <= FFT_Size/2; i++)
   {
-    filWin[i] = i < filWinSize ? (0.5 + 0.5*std::cos((2.0*M_PI*((double)i + 1.0))/(2.0 * (double)filWinSize))) : 0.0;
+    filWin[i] = i < winBins ? (0.5 + 0.5*std::cos((2.0*M_PI*((double)i + 1.0))/(2.0 * winBins))) : 0.0;
   }
   filWinMode = cos;
 }
@@ -144,9 +139,10 @@ void NoiseEstimation::ComputeCosWin(int WinSize)
 void NoiseEstimation::ComputeExpWin(int WinSize)
 {
   filWinSize = WinSize;
+  const double winBins = filWinScale * (double)filWinSize;
   for( int i = 0; i <= FFT_Size/2; i++)
   {
-    filWin[i] = std::exp(-5.0*i/(filWinSize));
+    filWin[i] = std::exp(-5.0*i/winBins);
   }
   filWinMode = exp;
 }
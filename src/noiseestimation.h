@@ -42,7 +42,8 @@ class NoiseEstimation
     enum FilWinType {none, cos, exp};
     FilWinType filWinMode;
     int filWinSize;
-    fftw_plan fft_pdirect;
+    double filWinScale; //Ratio between the FFT size and the power of two size in which the window sizes are given
+    fftw_plan fft_pdirect; //Shared plans owned by FFTEngine
     fftw_plan fft_pinvers;
     
     void ComputeCosWin(int WinSize);
@@ -19,21 +19,14 @@
 #include <Rcpp.h>
 #include "peakbinning.h"
 #include "progressbar.h"
-#include <limits>       // std::numeric_limits
+#include <algorithm>
+#include <thread>
 #include <stdexcept>
 using namespace Rcpp;
 
-PeakBinning::PeakBinning(Rcpp::List rMSIObj_list, int numberOfThreads, double memoryPerThreadMB, 
-                         Rcpp::Reference preProcessingParams):
-  ThreadingMsiProc(rMSIObj_list, numberOfThreads, memoryPerThreadMB, Rcpp::NumericVector(), DataCubeIOMode::PEAKLIST_READ)
+MassBinAccumulator::MassBinAccumulator(Rcpp::Reference preProcessingParams, int numOfSlots):
+  slotMassBins(numOfSlots), slotNumOfPixels(numOfSlots, 0)
 {
-  //Calculate the total number of pixels
-  totalNumOfPixels = 0;
-  for(int i=0; i < ioObj->getNumberOfCubes(); i++ )
-  {
-    totalNumOfPixels += ioObj->getNumberOfPixelsInCube(i);
-  }
-  
   //Get the parameters
   Rcpp::Reference binningParams = preProcessingParams.field("peakbinning");
   tolerance = binningParams.field("tolerance");
@@ -41,92 +34,70 @@ PeakBinning::PeakBinning(Rcpp::List rMSIObj_list, int numberOfThreads, double me
   binFilter = binningParams.field("binFilter"); 
 }
 
-PeakBinning::~PeakBinning()
-{
-
-}
-
-void PeakBinning::AppendMassChannel2MassBins(MassBin newMassBin, std::vector<MassBin> &targetMassBins)
+void MassBinAccumulator::AppendSortedMassBin(const MassBin &newMassBin, std::vector<MassBin> &targetMassBins)
 {
-  //Search the closest mass bin
-  double minMassDistance = std::numeric_limits<double>::max();
-  int minDistanceIndex = -1;
-  double currentMassDistance;
-  for(int icol = 0; icol < targetMassBins.size(); icol++)
+  if(!targetMassBins.empty())
   {
-    currentMassDistance = newMassBin.mass - targetMassBins[icol].mass;
+    MassBin &lastBin = targetMassBins.back();
+    double massDistance = newMassBin.mass - lastBin.mass; //Always positive since the bins are sorted
     
-    if(fabs(currentMassDistance) < fabs(minMassDistance))
+    //Select the kind of binning tolerance
+    bool bInTolerance;
+    if(tolerance_in_ppm)
+    {
+      bInTolerance = 1e6*(massDistance/newMassBin.mass) < tolerance; //Compute distance in ppm
+    }
+    else
     {
-      minMassDistance = currentMassDistance;
-      minDistanceIndex = icol;
+      bInTolerance = massDistance < tolerance * newMassBin.binSize;
     }
     
-    if(currentMassDistance < 0)
+    if(bInTolerance)
     {
-      break;
+      //The new mass bin must be binned with the last one, update the running mean of mass and bin size weighted by the counts
+      double totalCounts = (double)(lastBin.counts + newMassBin.counts);
+      lastBin.mass = ((double)lastBin.counts)/totalCounts * lastBin.mass + ((double)newMassBin.counts)/totalCounts * newMassBin.mass;
+      lastBin.binSize = ((double)lastBin.counts)/totalCounts * lastBin.binSize + ((double)newMassBin.counts)/totalCounts * newMassBin.binSize;
+      lastBin.counts += newMassBin.counts;
+      return;
     }
   }
   
-  //Select the kind of binning tolerance
-  double compTolerance;
-  if(tolerance_in_ppm)
-  {
-    minMassDistance = 1e6*(minMassDistance/newMassBin.mass); //Compute distance in ppm
-    compTolerance = tolerance;
-    newMassBin.binSize = newMassBin.binSize < 0.0 ? (tolerance * newMassBin.mass / 1e6) : newMassBin.binSize; //Overwrite binSize with tolerance when no binSize data is available
-  }
-  else
-  {
-    compTolerance = tolerance * newMassBin.binSize;
-  } 
+  targetMassBins.push_back(newMassBin);
+}
+
+void MassBinAccumulator::MergeMassBins(const std::vector<MassBin> &massBinsA, const std::vector<MassBin> &massBinsB, std::vector<MassBin> &out)
+{
+  out.clear();
+  out.reserve(massBinsA.size() + massBinsB.size());
   
-  if(minDistanceIndex >= 0)
+  unsigned int ia = 0;
+  unsigned int ib = 0;
+  while( ia < massBinsA.size() || ib < massBinsB.size() )
   {
-    if( (fabs(minMassDistance) < compTolerance))
+    if( ib >= massBinsB.size() || (ia < massBinsA.size() && massBinsA[ia].mass <= massBinsB[ib].mass) )
     {
-      //The peak must be binned with the minDistanceIndex column of the peak matrix
-      targetMassBins[minDistanceIndex].mass = 
-        ((double)targetMassBins[minDistanceIndex].counts)/((double)(targetMassBins[minDistanceIndex].counts + 1)) * targetMassBins[minDistanceIndex].mass 
-        + newMassBin.mass/((double)(targetMassBins[minDistanceIndex].counts + 1));
-      
-      targetMassBins[minDistanceIndex].binSize = 
-      ((double)targetMassBins[minDistanceIndex].counts)/((double)(targetMassBins[minDistanceIndex].counts + 1)) * targetMassBins[minDistanceIndex].binSize 
-        + newMassBin.binSize/((double)(targetMassBins[minDistanceIndex].counts + 1));
-      
-      targetMassBins[minDistanceIndex].counts+=newMassBin.counts;
+      AppendSortedMassBin(massBinsA[ia], out);
+      ia++;
     }
     else
     {
-      if(minMassDistance > 0)
-      {
-        //Insert the new mass channel after the minDistanceIndex
-        targetMassBins.insert(targetMassBins.begin() + minDistanceIndex + 1, newMassBin);
-      }
-      else
-      {
-        //Insert the new mass channel before the minDistanceIndex
-        targetMassBins.insert(targetMassBins.begin() + minDistanceIndex, newMassBin);
-      }
+      AppendSortedMassBin(massBinsB[ib], out);
+      ib++;
     }
   }
-  else
-  {
-    //targetMassBins is empty, so add the first element to it
-    targetMassBins.push_back(newMassBin);
-  }
 }
 
-void PeakBinning::ProcessingFunction(int threadSlot)
+void MassBinAccumulator::AddPeakLists(int slot, PeakPicking::Peaks **peakLists, int nrows)
 {
-  std::vector<MassBin> thread_binMass; //The mass name for each matrix column (local thread space)
+  std::vector<MassBin> cube_peaks; //All the peaks in the cube (local thread space)
   MassBin current_bin;
 
   //Thread local worker
   PeakPicking::Peaks *mpeaks; //Pointer to the current peaklist
-  for( int irow = 0; irow < cubes[threadSlot]->nrows; irow++)
+  for( int irow = 0; irow < nrows; irow++)
   {
-    mpeaks = cubes[threadSlot]->peakLists[irow];
+    mpeaks = peakLists[irow];
     for(int ipeak = 0; ipeak < mpeaks->mass.size(); ipeak++)
     {
       current_bin.mass = mpeaks->mass[ipeak];
@@ -138,30 +109,64 @@ void PeakBinning::ProcessingFunction(int threadSlot)
       {
         current_bin.binSize = -1; //Set to negative to indicate no bin size data is available
       }
+      if(tolerance_in_ppm && current_bin.binSize < 0.0)
+      {
+        current_bin.binSize = tolerance * current_bin.mass / 1e6; //Overwrite binSize with tolerance when no binSize data is available
+      }
       current_bin.counts = 1;
-      AppendMassChannel2MassBins(current_bin, thread_binMass);
+      cube_peaks.push_back(current_bin);
     }
   }
   
-  //Append local thread result to the main bins
-  if(!thread_binMass.empty())
+  //Sort the peaks and bin them in a single pass
+  std::sort(cube_peaks.begin(), cube_peaks.end(), [](const MassBin &a, const MassBin &b){ return a.mass < b.mass; });
+  std::vector<MassBin> cube_bins;
+  for( auto it = cube_peaks.begin(); it != cube_peaks.end(); ++it)
   {
-    mainBinsMutex.lock();
-    for( auto it = thread_binMass.begin(); it != thread_binMass.end(); ++it)
-    {
-      AppendMassChannel2MassBins(*it, mainMassBins);
-    }
-    mainBinsMutex.unlock();
+    AppendSortedMassBin(*it, cube_bins);
   }
+  
+  //Merge with the bins previously accumulated in this data slot
+  std::vector<MassBin> merged_bins;
+  MergeMassBins(slotMassBins[slot], cube_bins, merged_bins);
+  slotMassBins[slot].swap(merged_bins);
+  slotNumOfPixels[slot] += nrows;
 }
 
-
-List PeakBinning::Run()
+List MassBinAccumulator::GetMassBins()
 {
-  //Run the mass binning in multithreading
-  mainMassBins.clear();
-  Rcout<<"Binning peaks...\n";
-  runMSIProcessingCpp(); //After the multithreaded binning the mainMassBins object contains the sorted mass channels and the counts on each
+  //Parallel tree reduction of the data slots results, at each level pairs of slots are merged in different threads
+  const int numOfSlots = slotMassBins.size();
+  for( int step = 1; step < numOfSlots; step *= 2)
+  {
+    std::vector<std::thread> mergeThreads;
+    for( int i = 0; (i + step) < numOfSlots; i += 2*step)
+    {
+      mergeThreads.push_back(std::thread([this, i, step]()
+      {
+        std::vector<MassBin> merged_bins;
+        MergeMassBins(slotMassBins[i], slotMassBins[i + step], merged_bins);
+        slotMassBins[i].swap(merged_bins);
+        std::vector<MassBin>().swap(slotMassBins[i + step]); //Release memory
+      }));
+    }
+    for( unsigned int i = 0; i < mergeThreads.size(); i++)
+    {
+      mergeThreads[i].join();
+    }
+  }
+  
+  int totalNumOfPixels = 0;
+  for( int i = 0; i < numOfSlots; i++)
+  {
+    totalNumOfPixels += slotNumOfPixels[i];
+    slotNumOfPixels[i] = 0;
+  }
+  std::vector<MassBin> mainMassBins; //After the multithreaded binning the mainMassBins object contains the sorted mass channels and the counts on each
+  if(numOfSlots > 0)
+  {
+    mainMassBins.swap(slotMassBins[0]);
+  }
   
   //Apply binFilter
   NumericVector massR;
@@ -180,12 +185,33 @@ List PeakBinning::Run()
   }
   Rcout<<"Bining complete with a total number of "<<massR.length()<<" bins\n"; 
   
-  //Prepare the R bin matrix
-  NumericMatrix binMatIntensity(totalNumOfPixels, massR.length());
-  NumericMatrix binMatSNR(totalNumOfPixels, massR.length());
-  NumericMatrix binMatArea(totalNumOfPixels, massR.length());
-  
-  return List::create( Named("mass") = massR, Named("binSize") = binSizeR, Named("intensity") = binMatIntensity, Named("SNR") = binMatSNR, Named("area") = binMatArea );
+  //The peak matrix values are not allocated here, they will be created in sparse format by the fill peaks algorithm
+  return List::create( Named("mass") = massR, Named("binSize") = binSizeR );
+}
+
+PeakBinning::PeakBinning(Rcpp::List rMSIObj_list, int numberOfThreads, double memoryPerThreadMB, 
+                         Rcpp::Reference preProcessingParams):
+  ThreadingMsiProc(rMSIObj_list, numberOfThreads, memoryPerThreadMB, Rcpp::NumericVector(), DataCubeIOMode::PEAKLIST_READ)
+{
+  massBins = new MassBinAccumulator(preProcessingParams, numOfThreadsDouble);
+}
+
+PeakBinning::~PeakBinning()
+{
+  delete massBins;
+}
+
+void PeakBinning::ProcessingFunction(int threadSlot)
+{
+  massBins->AddPeakLists(threadSlot, cubes[threadSlot]->peakLists, cubes[threadSlot]->nrows);
+}
+
+List PeakBinning::Run()
+{
+  //Run the mass binning in multithreading
+  Rcout<<"Binning peaks...\n";
+  runMSIProcessingCpp(); 
+  return massBins->GetMassBins();
 }
 
 // [[Rcpp::export]]
@@ -19,32 +19,30 @@
 #ifndef PEAKBINNING_H
 #define PEAKBINNING_H
 #include <Rcpp.h>
-#include <mutex>
+#include <vector>
 #include "threadingmsiproc.h"
 #include "peakpicking.h"
 
-class PeakBinning : public ThreadingMsiProc 
+//Accumulates the peaks of data cubes into sorted mass bins. Each data slot keeps its own bins, so a slot must only be used by one thread at a time.
+//It is used by the peak binning and also during the peak-picking to bin the peaks while they are still in memory.
+class MassBinAccumulator
 {
 public:
-  
   //Constructor arguments:
-  // rMSIObj_list: A list of rMSI objects to process
-  // numberOfThreads: Total number of threads to use during processing
-  // memoryPerThreadMB: Maximum memory allocated by each thread in MB. The total allocated memory will be: 2*numberOfThreads*memoryPerThreadMB
   // preProcessingParams: An R reference class with the pre-processing parameters.
-  PeakBinning(Rcpp::List rMSIObj_list, int numberOfThreads, double memoryPerThreadMB, 
-              Rcpp::Reference preProcessingParams);
+  // numOfSlots: The number of data slots that will be accumulated concurrently.
+  MassBinAccumulator(Rcpp::Reference preProcessingParams, int numOfSlots);
   
-  ~PeakBinning();
+  //Bin all the peak lists of a data cube in the given data slot.
+  void AddPeakLists(int slot, PeakPicking::Peaks **peakLists, int nrows);
+  
+  //Merge the bins of all slots and return the mass and binSize of the bins that pass the bin filter.
+  Rcpp::List GetMassBins();
   
-  //Perform the peak binning, returns a binned peak matrix with all the mass channels in place ready to be filled by the peak-fill algorithm
-  Rcpp::List Run(); 
-
 private:
   double binFilter;
   double tolerance;
   bool tolerance_in_ppm; //If true the binning tolerance is specified in  ppm, if false then the number of datapoints per peak is used instead
-  int totalNumOfPixels;
   
   //Mass bin data structure
   typedef struct
@@ -54,13 +52,39 @@ private:
     unsigned int counts; //Number of counts (pixels) in the mass bin
   }MassBin;
   
-  std::vector<MassBin> mainMassBins; //The main mass bins object
-  std::mutex mainBinsMutex; //Mutex to lock the main mass bins object for safe multithreaded editing
+  std::vector<std::vector<MassBin>> slotMassBins; //Sorted mass bins accumulated in each data slot, reduced at the end
+  std::vector<int> slotNumOfPixels; //Number of pixels accumulated in each data slot
+  
+  //Append a mass bin to a list of mass bins sorted by mass. The new mass bin must not be lower than the last one in the list.
+  //Since the list is sorted the closest mass bin is always the last one, so it is binned with it or appended at the end.
+  //newMassBin: the new mass channel to add in the peak matrix.
+  void AppendSortedMassBin(const MassBin &newMassBin, std::vector<MassBin> &targetMassBins);
+  
+  //Merge two lists of sorted mass bins applying the binning tolerance. The result is stored in out.
+  void MergeMassBins(const std::vector<MassBin> &massBinsA, const std::vector<MassBin> &massBinsB, std::vector<MassBin> &out);
+};
+
+class PeakBinning : public ThreadingMsiProc 
+{
+public:
+  
+  //Constructor arguments:
+  // rMSIObj_list: A list of rMSI objects to process
+  // numberOfThreads: Total number of threads to use during processing
+  // memoryPerThreadMB: Maximum memory allocated by each thread in MB. The total allocated memory will be: 2*numberOfThreads*memoryPerThreadMB
+  // preProcessingParams: An R reference class with the pre-processing parameters.
+  PeakBinning(Rcpp::List rMSIObj_list, int numberOfThreads, double memoryPerThreadMB, 
+              Rcpp::Reference preProcessingParams);
+  
+  ~PeakBinning();
+  
+  //Perform the peak binning, returns the mass and binSize of all the mass channels ready to be filled by the peak-fill algorithm
+  Rcpp::List Run(); 
+
+private:
+  MassBinAccumulator *massBins;
   
   //Thread Processing function definition
   void ProcessingFunction(int threadSlot);
-  
-  //newMassBin: the new mass channel to add in the peak matrix.
-  void AppendMassChannel2MassBins(MassBin newMassBin, std::vector<MassBin> &targetMassBins);
 };
 #endif
@@ -18,15 +18,130 @@
 
 #include <Rcpp.h>
 #include <cmath>
+#include <algorithm>
   #include "peakpicking.h"
+  #include "scratcharena.h"
+  #include "fftengine.h"
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+  #define PEAKPICKING_X86_SIMD //Local maximum detection kernels using AVX are available and selected at runtime
+  #include <immintrin.h>
+#endif
 using namespace Rcpp;
 
 #define AREA_WINDOW_SIDE_WIDTH 3
 
+//Local maximum detection kernels, they return the number of candidate peaks found and store their indexes in candidates
+//A candidate is a zero crossing at first derivate and a negative 2nd derivate value with a SNR above the threshold
+namespace
+{
+  inline bool isPeakCandidate(double slope, double slope_ant, double intensity, double noise, double SNR)
+  {
+    return slope*slope_ant <= 0.0 && (slope - slope_ant) < 0.0 && intensity/noise >= SNR;
+  }
+  
+  //Scalar detection in the range [iStart, iEnd), the spectrum must be accessible from iStart - 1 to iEnd
+  //Used as fallback for the remaining elements of the SIMD kernels
+  int findCandidatesScalar(const double *spectrum, const double *noise, double SNR, int iStart, int iEnd, int *candidates)
+  {
+    int n = 0;
+    for( int i = iStart; i < iEnd; i++)
+    {
+      if(isPeakCandidate(spectrum[i + 1] - spectrum[i], spectrum[i] - spectrum[i - 1], spectrum[i], noise[i], SNR))
+      {
+        candidates[n++] = i;
+      }
+    }
+    return n;
+  }
+  
+#ifdef PEAKPICKING_X86_SIMD
+  //The CPU features are checked only once
+  bool cpuHasAVX()
+  {
+    static const bool bAVX = __builtin_cpu_supports("avx");
+    return bAVX;
+  }
+  
+  __attribute__((target("avx"))) int findCandidatesAVX(const double *spectrum, const double *noise, double SNR, int iStart, int iEnd, int *candidates)
+  {
+    const __m256d zero = _mm256_setzero_pd();
+    const __m256d minSNR = _mm256_set1_pd(SNR);
+    int n = 0;
+    int i = iStart;
+    for( ; i + 4 <= iEnd; i += 4)
+    {
+      const __m256d curr = _mm256_loadu_pd(spectrum + i);
+      const __m256d slope = _mm256_sub_pd(_mm256_loadu_pd(spectrum + i + 1), curr);
+      const __m256d slope_ant = _mm256_sub_pd(curr, _mm256_loadu_pd(spectrum + i - 1));
+      __m256d mask = _mm256_and_pd(_mm256_cmp_pd(_mm256_mul_pd(slope, slope_ant), zero, _CMP_LE_OQ),
+                                   _mm256_cmp_pd(_mm256_sub_pd(slope, slope_ant), zero, _CMP_LT_OQ));
+      mask = _mm256_and_pd(mask, _mm256_cmp_pd(_mm256_div_pd(curr, _mm256_loadu_pd(noise + i)), minSNR, _CMP_GE_OQ));
+      for( int bits = _mm256_movemask_pd(mask); bits != 0; bits &= bits - 1)
+      {
+        candidates[n++] = i + __builtin_ctz(bits);
+      }
+    }
+    return n + findCandidatesScalar(spectrum, noise, SNR, i, iEnd, candidates + n);
+  }
+#endif
+
+#ifdef __SSE2__
+  //SSE2 is always available in x86_64 so it is used when AVX is not supported
+  int findCandidatesSSE2(const double *spectrum, const double *noise, double SNR, int iStart, int iEnd, int *candidates)
+  {
+    const __m128d zero = _mm_setzero_pd();
+    const __m128d minSNR = _mm_set1_pd(SNR);
+    int n = 0;
+    int i = iStart;
+    for( ; i + 2 <= iEnd; i += 2)
+    {
+      const __m128d curr = _mm_loadu_pd(spectrum + i);
+      const __m128d slope = _mm_sub_pd(_mm_loadu_pd(spectrum + i + 1), curr);
+      const __m128d slope_ant = _mm_sub_pd(curr, _mm_loadu_pd(spectrum + i - 1));
+      __m128d mask = _mm_and_pd(_mm_cmple_pd(_mm_mul_pd(slope, slope_ant), zero),
+                                _mm_cmplt_pd(_mm_sub_pd(slope, slope_ant), zero));
+      mask = _mm_and_pd(mask, _mm_cmpge_pd(_mm_div_pd(curr, _mm_loadu_pd(noise + i)), minSNR));
+      for( int bits = _mm_movemask_pd(mask); bits != 0; bits &= bits - 1)
+      {
+        candidates[n++] = i + __builtin_ctz(bits);
+      }
+    }
+    return n + findCandidatesScalar(spectrum, noise, SNR, i, iEnd, candidates + n);
+  }
+#endif
+  
+  //Detect the candidates of a whole spectrum, candidates must hold dataLength elements
+  int findPeakCandidates(const double *spectrum, const double *noise, double SNR, int dataLength, int *candidates)
+  {
+    if(dataLength < 2)
+    {
+      return 0;
+    }
+    
+    //The first data point has no previous slope
+    int n = 0;
+    if(isPeakCandidate(spectrum[1] - spectrum[0], 0.0, spectrum[0], noise[0], SNR))
+    {
+      candidates[n++] = 0;
+    }
+    
+#ifdef PEAKPICKING_X86_SIMD
+    if(cpuHasAVX())
+    {
+      return n + findCandidatesAVX(spectrum, noise, SNR, 1, dataLength - 1, candidates + n);
+    }
+#endif
+#ifdef __SSE2__
+    return n + findCandidatesSSE2(spectrum, noise, SNR, 1, dataLength - 1, candidates + n);
+#else
+    return n + findCandidatesScalar(spectrum, noise, SNR, 1, dataLength - 1, candidates + n);
+#endif
+  }
+}
+
 PeakPicking::PeakPicking(int WinSize, double *massAxis, int numOfDataPoints, int UpSampling )
 {
-  FFT_Size = (int)pow(2.0, std::ceil(log2(WinSize)));
-  FFT_Size = FFT_Size < 16 ? 16 : FFT_Size; //Minimum allowed windows size is 16 points.
+  FFT_Size = getNoiseWinSize(WinSize)/2;
   FFTInter_Size = (int)pow(2.0, std::ceil(log2(UpSampling*FFT_Size))); //FFT interpolation buffer
   
   dataLength = numOfDataPoints;
@@ -74,12 +189,14 @@ PeakPicking::PeakPicking(int WinSize, double *massAxis, int numOfDataPoints, int
   }
   
   //Prepare FFT objects
-  fft_in1 = fftw_alloc_real(FFT_Size);
-  fft_out1 = fftw_alloc_real(FFT_Size);
-  fft_in2 = fftw_alloc_real(FFTInter_Size);
-  fft_out2 = fftw_alloc_real(FFTInter_Size);
-  fft_pdirect = fftw_plan_r2r_1d(FFT_Size, fft_in1, fft_out1, FFTW_R2HC, FFTW_ESTIMATE);
-  fft_pinvers = fftw_plan_r2r_1d(FFTInter_Size, fft_in2, fft_out2, FFTW_HC2R, FFTW_ESTIMATE);
+  fft_in1 = fftw_alloc_real(PEAK_FFT_BATCH*FFT_Size);
+  fft_out1 = fftw_alloc_real(PEAK_FFT_BATCH*FFT_Size);
+  fft_in2 = fftw_alloc_real(PEAK_FFT_BATCH*FFTInter_Size);
+  fft_out2 = fftw_alloc_real(PEAK_FFT_BATCH*FFTInter_Size);
+  fft_pdirect = FFTEngine::getPlan(FFT_Size, FFTW_R2HC);
+  fft_pinvers = FFTEngine::getPlan(FFTInter_Size, FFTW_HC2R);
+  fft_pdirect_batch = FFTEngine::getPlan(FFT_Size, FFTW_R2HC, PEAK_FFT_BATCH);
+  fft_pinvers_batch = FFTEngine::getPlan(FFTInter_Size, FFTW_HC2R, PEAK_FFT_BATCH);
   
   //Prepare NoiseEstimation oject
   neObj = new NoiseEstimation(dataLength);
@@ -90,8 +207,6 @@ PeakPicking::~PeakPicking()
   delete[] mass;
   delete[] HanningWin;
   delete[] AreaWin;
-  fftw_destroy_plan(fft_pdirect);
-  fftw_destroy_plan(fft_pinvers);
   fftw_free(fft_in1); 
   fftw_free(fft_out1);
   fftw_free(fft_in2); 
@@ -99,116 +214,174 @@ PeakPicking::~PeakPicking()
   delete neObj;
 }
 
-PeakPicking::Peaks *PeakPicking::peakPicking(double *spectrum, double SNR )
+int PeakPicking::getNoiseWinSize(int WinSize)
+{
+  int fftSize = (int)pow(2.0, std::ceil(log2(WinSize)));
+  fftSize = fftSize < 16 ? 16 : fftSize; //Minimum allowed windows size is 16 points.
+  return fftSize*2;
+}
+
+PeakPicking::Peaks *PeakPicking::peakPicking(double *spectrum, double SNR, double *noise )
 {
   //Calculate noise
-  double *noise = new double[dataLength];
-  memcpy(noise, spectrum, sizeof(double)*dataLength);
-  neObj->NoiseEstimationFFTExpWin(noise, dataLength, FFT_Size*2);
+  ScratchArena::Scope scratch;
+  if( noise == nullptr )
+  {
+    noise = scratch.alloc<double>(dataLength);
+    memcpy(noise, spectrum, sizeof(double)*dataLength);
+    neObj->NoiseEstimationFFTExpWin(noise, dataLength, FFT_Size*2);
+  }
   
   //Detect peaks
   PeakPicking::Peaks *pks = detectPeaks(spectrum, noise, SNR);
-  delete[] noise;
   return pks;
 }
 
 //Detect all local maximums and Filter peaks using SNR min value in a sliding window
 PeakPicking::Peaks *PeakPicking::detectPeaks( double *spectrum, double *noise, double SNR )
 {
-  const int HalfWinSize = FFT_Size/2;
-  double slope = 0.0;
-  double slope_ant = 0.0;
-  double mass_centroide = -1.0;
-  double mass_centroide_previous = -1.0;
-  double local_binSize = 0.0;
   PeakPicking::Peaks *m_peaks = new PeakPicking::Peaks();
-  for( int i=0; i < (dataLength - 1); i++)
+  ScratchArena::Scope scratch;
+  int iPeak[PEAK_FFT_BATCH];
+  
+  //First phase: local maximums above the SNR
+  int *candidates = scratch.alloc<int>(dataLength);
+  const int numOfCandidates = findPeakCandidates(spectrum, noise, SNR, dataLength, candidates);
+  
+  //Second phase: compute the mass of all candidates accurately using FFT interpolation, it is required to discard the duplicates
+  double *candidatesMass = scratch.alloc<double>(numOfCandidates);
+  for( int i = 0; i < numOfCandidates; i += PEAK_FFT_BATCH)
   {
-    slope = spectrum[i + 1] - spectrum[i]; //Compute 1st derivative
-    //Look for a zero crossing at first derivate (negative sign of product) and negative 2nd derivate value (local maxim)
-    if(slope*slope_ant <= 0.0 && (slope - slope_ant) < 0.0)
+    const int count = std::min(PEAK_FFT_BATCH, numOfCandidates - i);
+    interpolateFFT(spectrum, candidates + i, count, true, iPeak);
+    for( int k = 0; k < count; k++)
     {
-      if(spectrum[i]/noise[i] >= SNR)
-      {
-        mass_centroide = predictPeakMass(spectrum, i); //Compute peak accurately using FFT interpolation);
-        local_binSize = fabs(mass[i + 1] - mass[i]) ;
-        if(fabs(mass_centroide - mass_centroide_previous) >= local_binSize  ) //Avoid duplicates
-        {
-          m_peaks->mass.push_back(mass_centroide); 
-          m_peaks->intensity.push_back(spectrum[i]);
-          m_peaks->SNR.push_back(spectrum[i]/noise[i]); 
-          m_peaks->area.push_back(predictPeakArea(spectrum, i)); //Normalized to non-FFT sapce
-          m_peaks->binSize.push_back( local_binSize );
-        }
-        mass_centroide_previous = mass_centroide;
-      }
+      candidatesMass[i + k] = interpolatedPeakMass(candidates[i + k], iPeak[k]);
+    }
+  }
+  
+  //Avoid duplicates, the retained peaks are moved to the begining of the candidates arrays
+  double mass_centroide_previous = -1.0;
+  int numOfPeaks = 0;
+  for( int i = 0; i < numOfCandidates; i++)
+  {
+    const int iMass = candidates[i];
+    const double mass_centroide = candidatesMass[i];
+    if(fabs(mass_centroide - mass_centroide_previous) >= fabs(mass[iMass + 1] - mass[iMass]) )
+    {
+      candidates[numOfPeaks] = iMass;
+      candidatesMass[numOfPeaks] = mass_centroide;
+      numOfPeaks++;
+    }
+    mass_centroide_previous = mass_centroide;
+  }
+  
+  //Third phase: compute the area of the retained peaks
+  m_peaks->mass.reserve(numOfPeaks);
+  m_peaks->intensity.reserve(numOfPeaks);
+  m_peaks->SNR.reserve(numOfPeaks);
+  m_peaks->area.reserve(numOfPeaks);
+  m_peaks->binSize.reserve(numOfPeaks);
+  for( int i = 0; i < numOfPeaks; i += PEAK_FFT_BATCH)
+  {
+    const int count = std::min(PEAK_FFT_BATCH, numOfPeaks - i);
+    interpolateFFT(spectrum, candidates + i, count, false, iPeak);
+    for( int k = 0; k < count; k++)
+    {
+      const int iMass = candidates[i + k];
+      m_peaks->mass.push_back(candidatesMass[i + k]); 
+      m_peaks->intensity.push_back(spectrum[iMass]);
+      m_peaks->SNR.push_back(spectrum[iMass]/noise[iMass]); 
+      m_peaks->area.push_back(interpolatedPeakArea(spectrum, iMass, iPeak[k], fft_out2 + k*FFTInter_Size)); //Normalized to non-FFT sapce
+      m_peaks->binSize.push_back( fabs(mass[iMass + 1] - mass[iMass]) );
     }
-    slope_ant = slope;
   }
   return m_peaks;
 }
 
 int PeakPicking::interpolateFFT(double *spectrum, int iPeakMass, bool ApplyHanning)
 {
-  //Fill fft data vector taking care of extrems
-  int idata = 0; //Indeix of data
-  for( int i = 0; i < FFT_Size; i++)
+  int iPeak;
+  interpolateFFT(spectrum, &iPeakMass, 1, ApplyHanning, &iPeak);
+  return iPeak;
+}
+
+void PeakPicking::interpolateFFT(double *spectrum, const int *iPeakMass, int count, bool ApplyHanning, int *iPeak)
+{
+  //Fill fft data vectors taking care of extrems
+  const double *window = ApplyHanning ? HanningWin : AreaWin; //No Hanning here so apply area windows to avoid Gibbs
+  for( int k = 0; k < count; k++)
   {
-    idata = iPeakMass - FFT_Size/2 + i;
-    fft_in1[i] = (idata >= 0 && idata < dataLength) ? spectrum[idata] : 0.0;
-    if(ApplyHanning)
+    double *in1 = fft_in1 + k*FFT_Size;
+    int idata = 0; //Indeix of data
+    for( int i = 0; i < FFT_Size; i++)
     {
-      fft_in1[i] *= HanningWin[i]; 
+      idata = iPeakMass[k] - FFT_Size/2 + i;
+      in1[i] = (idata >= 0 && idata < dataLength) ? spectrum[idata]*window[i] : 0.0;
     }
-    else
+  }
+  
+  //Compute FFT, a full batch is transformed with a single plan execution
+  if(count == PEAK_FFT_BATCH)
+  {
+    FFTEngine::execute(fft_pdirect_batch, fft_in1, fft_out1);
+  }
+  else
+  {
+    for( int k = 0; k < count; k++)
     {
-      //No Hanning here so apply area windows to avoid Gibbs
-      fft_in1[i] *= AreaWin[i];
+      FFTEngine::execute(fft_pdirect, fft_in1 + k*FFT_Size, fft_out1 + k*FFT_Size);
     }
   }
   
-  //Compute FFT
-  fftw_execute(fft_pdirect);
+  //Zero padding in fft space, the positive frequencies are kept at the begining and the negative ones at the end
+  const int headLength = FFT_Size/2 + 1;
+  const int tailLength = FFT_Size - headLength;
+  for( int k = 0; k < count; k++)
+  {
+    double *out1 = fft_out1 + k*FFT_Size;
+    double *in2 = fft_in2 + k*FFTInter_Size;
+    memcpy(in2, out1, sizeof(double)*headLength);
+    memset(in2 + headLength, 0, sizeof(double)*(FFTInter_Size - FFT_Size));
+    memcpy(in2 + FFTInter_Size - tailLength, out1 + headLength, sizeof(double)*tailLength);
+  }
   
-  //Zero padding in fft space
-  int i1 = 0;
-  for( int i = 0; i < FFTInter_Size; i++)
+  //Compute Inverse FFT, fft_out2 contains the interpolated peaks
+  if(count == PEAK_FFT_BATCH)
   {
-    if( i <= (FFT_Size/2) || (FFTInter_Size - i) <= ((FFT_Size + 1)/2 - 1 )  )
-    {
-      fft_in2[i] = fft_out1[i1];
-      i1++;
-    }
-    else
+    FFTEngine::execute(fft_pinvers_batch, fft_in2, fft_out2);
+  }
+  else
+  {
+    for( int k = 0; k < count; k++)
     {
-      fft_in2[i] = 0.0;  
+      FFTEngine::execute(fft_pinvers, fft_in2 + k*FFTInter_Size, fft_out2 + k*FFTInter_Size);
     }
   }
   
-  //Compute Inverse FFT, fft_out2 contains the interpolated peak
-  fftw_execute(fft_pinvers);
-  
   //Peak is around FFT_Size/2 so just look there for it
-  int imax = -1;
-  double dmax = -1.0;
-  for( int i = (int)std::floor((((double)FFTInter_Size)/((double)FFT_Size))*(0.5*(double)FFT_Size - 1.0)); 
-       i <= (int)std::ceil((((double)FFTInter_Size)/((double)FFT_Size))*(0.5*(double)FFT_Size + 1.0)); 
-       i++)
+  const int iStart = (int)std::floor((((double)FFTInter_Size)/((double)FFT_Size))*(0.5*(double)FFT_Size - 1.0));
+  const int iEnd = (int)std::ceil((((double)FFTInter_Size)/((double)FFT_Size))*(0.5*(double)FFT_Size + 1.0));
+  for( int k = 0; k < count; k++)
   {
-    if( fft_out2[i] > dmax )
+    const double *out2 = fft_out2 + k*FFTInter_Size;
+    int imax = -1;
+    double dmax = -1.0;
+    for( int i = iStart; i <= iEnd; i++)
     {
-      imax = i;
-      dmax = fft_out2[i];
+      if( out2[i] > dmax )
+      {
+        imax = i;
+        dmax = out2[i];
+      }
     }
+    iPeak[k] = imax;
   }
-  
-  return imax;
 }
 
-double PeakPicking::predictPeakMass( double *spectrum, int iPeakMass )
+double PeakPicking::interpolatedPeakMass( int iPeakMass, int iPeak )
 {
   double pMass; 
-  int iPeak = interpolateFFT(spectrum, iPeakMass, true);
   
   //Compute the original mass indexing space
   double imass = (double)iPeakMass - (0.5*(double)FFT_Size) + ((double)iPeak) * ((double)FFT_Size)/((double)FFTInter_Size);
@@ -231,6 +404,12 @@ double PeakPicking::predictPeakMass( double *spectrum, int iPeakMass )
 }
 
 double PeakPicking::predictPeakArea( double *spectrum, int iPeakMass )
+{
+  int iPeak = interpolateFFT(spectrum, iPeakMass, false);
+  return interpolatedPeakArea(spectrum, iPeakMass, iPeak, fft_out2);
+}
+
+double PeakPicking::interpolatedPeakArea( double *spectrum, int iPeakMass, int iPeak, double *interpolated )
 {
   //Calculate integration range befor interpolation to avoid FFT Gibbs issues (left part).
   int integrationLimitLeft = FFT_Size/2;
@@ -280,23 +459,20 @@ double PeakPicking::predictPeakArea( double *spectrum, int iPeakMass )
   integrationLimitLeft = integrationLimitLeft < 0 ? 0 : integrationLimitLeft;
   integrationLimitRight = integrationLimitRight > (FFTInter_Size - 1) ? (FFTInter_Size - 1) : integrationLimitRight;
 
-  //Peak interpolation
-  int iPeak = interpolateFFT(spectrum, iPeakMass, false);
-  
   //Area integration
   double pArea = 0.0;
   for( int i = integrationLimitLeft; i <= integrationLimitRight; i++)
   {
-    pArea+=fft_out2[i];
+    pArea+=interpolated[i];
   }
  
-  if( fft_out2[iPeak] == 0.0 )
+  if( interpolated[iPeak] == 0.0 )
   {
     pArea = 0.0; //Avoid zero division
   }
   else
   {
-    pArea *= (spectrum[iPeakMass] / fft_out2[iPeak]) * massStep;
+    pArea *= (spectrum[iPeakMass] / interpolated[iPeak]) * massStep;
   }
   return pArea; //Return the area de-normalizing the FFT space
 }
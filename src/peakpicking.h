@@ -23,6 +23,8 @@
 #include <vector>
 #include "noiseestimation.h"
 
+#define PEAK_FFT_BATCH 8 //Number of peaks interpolated with a single execution of the batched FFT plans
+
 class PeakPicking
 {
   public:
@@ -42,7 +44,11 @@ class PeakPicking
     
     //Detect all local maximums and Filter peaks using SNR min value in a sliding window
     //Returns a pointer to a Peaks structur, is programer responsability to free memory of returned data pointer.
-    Peaks *peakPicking(double *spectrum, double SNR = 5);
+    //If noise is provided it is used as the spectrum noise instead of estimating it.
+    Peaks *peakPicking(double *spectrum, double SNR = 5, double *noise = nullptr);
+    
+    //Window size used to estimate the spectrum noise by a peak detector of WinSize
+    static int getNoiseWinSize(int WinSize);
     
     Rcpp::List PeakObj2List(PeakPicking::Peaks *pks);
     
@@ -65,16 +71,24 @@ class PeakPicking
     
     NoiseEstimation *neObj;
     
-    //Data for FFT interpolation
+    //Data for FFT interpolation, the buffers hold PEAK_FFT_BATCH consecutive windows to interpolate many peaks at once
     double *fft_in1; //Used for first fft input buffer with a length off FFT_Size
     double *fft_out1; //Used for first fft output buffer with a length off FFT_Size
     double *fft_in2; //Used for second fft input buffer with a length off FFTInter_Size
     double *fft_out2; //Used for second fft output buffer with a length off FFTInter_Size
-    fftw_plan fft_pdirect;
+    fftw_plan fft_pdirect; //Shared plans owned by FFTEngine
     fftw_plan fft_pinvers;
+    fftw_plan fft_pdirect_batch; //Same plans for PEAK_FFT_BATCH windows
+    fftw_plan fft_pinvers_batch;
     
-    double predictPeakMass( double *spectrum, int iPeakMass );
+    double interpolatedPeakMass( int iPeakMass, int iPeak ); //Convert the location of an interpolated peak to mass
+    double interpolatedPeakArea( double *spectrum, int iPeakMass, int iPeak, double *interpolated ); //Integrate the area of an interpolated peak
     int interpolateFFT(double *spectrum, int iPeakMass, bool ApplyHanning); //Interpolatea m/z peak and return its location in interpolated space (fft_out2)
+    
+    //Interpolate count peaks (up to PEAK_FFT_BATCH), the peak k is interpolated in fft_out2 + k*FFTInter_Size and its location stored in iPeak[k]
+    void interpolateFFT(double *spectrum, const int *iPeakMass, int count, bool ApplyHanning, int *iPeak);
+    
+    //Peaks are detected in two phases, first the local maximums above the SNR are found and then they are refined with FFT interpolation
     Peaks *detectPeaks( double *spectrum, double *noise, double SNR );
 };
   
@@ -22,6 +22,8 @@
 #include <stdexcept>
 #include <string>
 #include <cstdlib>
+#include <cstring>
+#include <cstdio>
 #include <future>
 
 #include "rMSIXBin.h"
@@ -166,7 +168,7 @@ void rMSIXBin::CreateImgStream()
   imzML_intOffsets = imzMLrun["intOffset"];
 
   //Create and init the imzML reader
-  ImzMLBinRead* imzMLReader;
+  ImzMLBinRead* imzMLReader = nullptr;
   
   try
   {
@@ -219,10 +221,30 @@ void rMSIXBin::CreateImgStream()
    *  iIonImgCount = IONIMG_BUFFER_MB * 1024 * 1024 / bytesPerIonImg
    */
   unsigned int iIonImgCount = (unsigned int)(  ((double)((double)IONIMG_BUFFER_MB * (double)(1024 * 1024))) / ((double)( img_width *img_height * ENCODING_BITS/8 + 4 )) );
+  iIonImgCount = iIonImgCount > 0 ? iIonImgCount : 1;
+  iIonImgCount = iIonImgCount < (unsigned int)massAxis.length() ? iIonImgCount : massAxis.length();
   unsigned int iRemainingIons = massAxis.length();
   
+  //The transposed data is spilled to a temporary file next to the BrMSI
+  std::string sSpillFile = _rMSIXBin->Bin_file + ".spill";
+  std::fstream fSpill;
+  
   try
   {
+    //Read each spectrum once and store it in ion tiles of iIonImgCount ions
+    fSpill.open(sSpillFile, std::ios::in | std::ios::out | std::ios::trunc | std::ios::binary);
+    if(!fSpill.is_open())
+    {
+      throw std::runtime_error("Error: rMSIXBin could not open the imgStream spill file.\n");
+    }
+    Rcout << "Transposing spectra..." << std::endl;
+    transposeSpectra2Spill(imzMLReader, &fSpill, iIonImgCount);
+    Rcout << std::endl;
+    
+    //The ibd file is not needed anymore
+    delete imzMLReader;
+    imzMLReader = nullptr;
+    
     unsigned int iIon = 0;
     Rcout << "Encoding ion images..." << std::endl;
     
@@ -230,22 +252,24 @@ void rMSIXBin::CreateImgStream()
     imgstreamencoding_type *EncodeBuffer_ptr = nullptr;
     std::future <void> future;
     
-    std::vector<int> pixelIDs(_rMSIXBin->numOfPixels);
-    for(unsigned int i = 0; i < pixelIDs.size(); i++)
-    {
-      pixelIDs[i] = i; //Fill all pixel ID for the spectra reader
-    }
-    
     while( true )
     {
       //Refresh progress...
       progressBar(iIon, massAxis.length(), "=", " ");
       
-      if( iRemainingIons > 0 ) //check if there is available imzML data
+      if( iRemainingIons > 0 ) //check if there is available spilled data
       {
         iIonImgCount = iIonImgCount <  iRemainingIons ? iIonImgCount :  iRemainingIons;
         LoadBuffer_ptr = new imgstreamencoding_type[iIonImgCount*_rMSIXBin->numOfPixels];
-        imzMLReader->ReadSpectra(pixelIDs.size(), (unsigned int *) pixelIDs.data(), baseSpectrum.begin(), iIon, iIonImgCount, LoadBuffer_ptr, number_of_encoding_threads, true);
+        
+        //Each tile is stored contiguously in the spill file in the same layout expected by the encoder
+        fSpill.seekg((std::streamoff)iIon * (std::streamoff)_rMSIXBin->numOfPixels * sizeof(imgstreamencoding_type));
+        fSpill.read((char*)LoadBuffer_ptr, (std::streamsize)iIonImgCount * _rMSIXBin->numOfPixels * sizeof(imgstreamencoding_type));
+        if(fSpill.fail() || fSpill.bad())
+        {
+          delete[] LoadBuffer_ptr;
+          throw std::runtime_error("FATAL ERROR: rMSIXBin got fail or bad bit condition reading the imgStream spill file.\n"); 
+        }
         iRemainingIons = iRemainingIons - iIonImgCount;
       }
       else
@@ -279,10 +303,13 @@ void rMSIXBin::CreateImgStream()
   {
     Rcout << "\nEncoder Error, stopped\n";
     delete imzMLReader;
+    fSpill.close();
+    std::remove(sSpillFile.c_str());
     stop(e.what());
   }
 
-  delete imzMLReader;
+  fSpill.close();
+  std::remove(sSpillFile.c_str());
   
   Rcout << "Storing normalizations..." << std::endl;
   storeNormalizations2Binary();
@@ -297,6 +324,60 @@ void rMSIXBin::CreateImgStream()
   }
 }
 
+//Read all spectra in a single pass over the ibd file and store them quantized in ion tiles in the spill file
+//Tile t holds the ions [t*ionsPerTile, (t+1)*ionsPerTile) of all pixels in pixel-major order and it is
+//located at the byte offset t*ionsPerTile*numOfPixels*sizeof(imgstreamencoding_type) of the spill file.
+//imzMLReader: the reader of the imzML ibd file.
+//fSpill: an already opened binary file to store the transposed data.
+//ionsPerTile: the number of ions in each tile.
+void rMSIXBin::transposeSpectra2Spill(ImzMLBinRead *imzMLReader, std::fstream *fSpill, unsigned int ionsPerTile)
+{
+  const unsigned int numOfIons = massAxis.length();
+  const unsigned int numOfPixels = _rMSIXBin->numOfPixels;
+  const unsigned int numOfTiles = (numOfIons + ionsPerTile - 1) / ionsPerTile;
+  
+  //Complete spectra are loaded in blocks of pixels using the same memory budget as the ion tiles
+  unsigned int pixelsPerBlock = (unsigned int)(((double)IONIMG_BUFFER_MB * (double)(1024 * 1024)) / ((double)numOfIons * sizeof(imgstreamencoding_type)));
+  pixelsPerBlock = pixelsPerBlock > 0 ? pixelsPerBlock : 1;
+  pixelsPerBlock = pixelsPerBlock < numOfPixels ? pixelsPerBlock : numOfPixels;
+  
+  std::vector<imgstreamencoding_type> spectraBuffer((size_t)pixelsPerBlock * numOfIons);
+  std::vector<imgstreamencoding_type> tileBuffer((size_t)pixelsPerBlock * ionsPerTile);
+  std::vector<unsigned int> pixelIDs(pixelsPerBlock);
+  
+  for(unsigned int firstPixel = 0; firstPixel < numOfPixels; firstPixel += pixelsPerBlock)
+  {
+    progressBar(firstPixel, numOfPixels, "=", " ");
+    
+    unsigned int blockPixels = (numOfPixels - firstPixel) < pixelsPerBlock ? (numOfPixels - firstPixel) : pixelsPerBlock;
+    for(unsigned int i = 0; i < blockPixels; i++)
+    {
+      pixelIDs[i] = firstPixel + i;
+    }
+    imzMLReader->ReadSpectra(blockPixels, pixelIDs.data(), baseSpectrum.begin(), 0, numOfIons, spectraBuffer.data(), number_of_encoding_threads);
+    
+    //Scatter the block to each tile
+    for(unsigned int iTile = 0; iTile < numOfTiles; iTile++)
+    {
+      unsigned int firstIon = iTile * ionsPerTile;
+      unsigned int tileIons = (numOfIons - firstIon) < ionsPerTile ? (numOfIons - firstIon) : ionsPerTile;
+      for(unsigned int i = 0; i < blockPixels; i++)
+      {
+        std::memcpy(tileBuffer.data() + (size_t)i * tileIons, spectraBuffer.data() + (size_t)i * numOfIons + firstIon, tileIons * sizeof(imgstreamencoding_type));
+      }
+      
+      fSpill->seekp(((std::streamoff)firstIon * numOfPixels + (std::streamoff)firstPixel * tileIons) * sizeof(imgstreamencoding_type));
+      fSpill->write((const char*)tileBuffer.data(), (std::streamsize)blockPixels * tileIons * sizeof(imgstreamencoding_type));
+      if(fSpill->fail() || fSpill->bad())
+      {
+        throw std::runtime_error("FATAL ERROR: rMSIXBin got fail or bad bit condition writing the imgStream spill file.\n"); 
+      }
+    }
+  }
+  progressBar(numOfPixels, numOfPixels, "=", " ");
+  fSpill->flush();
+}
+
 //Method to be run in multithreading
 //Encode a single image in the ImgStream from a preloaded buffer
 //buffer: potiner to the preloaded buffer with imzML data
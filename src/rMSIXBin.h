@@ -27,6 +27,7 @@
 #include "imzMLBin.h"
 #include "encoder_settings.h"
 
+//Sets both the ion tile size and the pixel block size of the imgStream transposition
 #define IONIMG_BUFFER_MB 1024 //I think 1024 MB of RAM is a good balance for fast hdd operation and low memory footprint
 
 class rMSIXBin
@@ -98,6 +99,9 @@ class rMSIXBin
     //Copy of the baseSpectrum ()which is the same as scaling factors)
     Rcpp::NumericVector baseSpectrum;
     
+    //Read each spectrum once and spill the quantized data in ion tiles to a temporary file
+    void transposeSpectra2Spill(ImzMLBinRead *imzMLReader, std::fstream *fSpill, unsigned int ionsPerTile);
+    
     //Threaded encoding model 
     ImgStreamEncoder_result encodeBuffer2SingleImgStream(imgstreamencoding_type *buffer, unsigned int ionIndex, unsigned int bufferIonIndex, unsigned int bufferIonCount); //Threaded method
     void startThreadedEncoding(imgstreamencoding_type *buffer, unsigned int ionIndex, unsigned int ionCount); //Threaded method
@@ -22,15 +22,19 @@
 #include <sstream>
 #include <math.h> 
 #include <stdexcept>
+#include <cstdint>
+#include <algorithm>
 #include "rmsicdatacubeio.h"
+#include "scratcharena.h"
 using namespace Rcpp;
 
-CrMSIDataCubeIO::CrMSIDataCubeIO(Rcpp::NumericVector massAxis, double cubeMemoryLimitMB, DataCubeIOMode dataModeEnum, Rcpp::String imzMLOutputPath)
-  :mass(massAxis), dataMode(dataModeEnum), dataOutputPath(imzMLOutputPath.get_cstring()), next_peakMatrix_row(0)
+CrMSIDataCubeIO::CrMSIDataCubeIO(Rcpp::NumericVector massAxis, double cubeMemoryLimitMB, DataCubeIOMode dataModeEnum, Rcpp::String imzMLOutputPath, bool float32DataCubes)
+  :dataMode(dataModeEnum), bFloat32(float32DataCubes), dataOutputPath(imzMLOutputPath.get_cstring()), cubeMaxBytes(1024*1024*cubeMemoryLimitMB),
+  mass(massAxis), next_peakMatrix_row(0), nextCubeReserve(0)
 {
   if(mass.length() > 0)
   {
-    cubeMaxNumRows = std::ceil((1024*1024*cubeMemoryLimitMB)/(double)(8*mass.length()));
+    cubeMaxNumRows = std::ceil((1024*1024*cubeMemoryLimitMB)/(double)((bFloat32 ? sizeof(float) : sizeof(double))*mass.length()));
   }
   else
   {
@@ -54,6 +58,8 @@ CrMSIDataCubeIO::~CrMSIDataCubeIO()
   {
     delete imzMLPeaksReaders[i];
   }
+  
+  clearPendingCubes();
 }
 
 void CrMSIDataCubeIO::appedImageData(Rcpp::List rMSIobj, std::string outputImzMLuuid, std::string outputImzMLfname)
@@ -96,7 +102,8 @@ void CrMSIDataCubeIO::appedImageData(Rcpp::List rMSIobj, std::string outputImzML
                                        as<String>(imzML["int_dataType"]) ,
                                        (as<bool>(imzML["continuous_mode"])),
                                        false, //Do not call the file open() on constructor
-                                       false //Used to read spectral data so just keep the default
+                                       false, //Used to read spectral data so just keep the default
+                                       true //Memory mapped access, spectra are decoded directely from the mapped pages
                                        )); 
     
     //If data is in continuous mode but resampling is needed, then read the imzML in processed mode to enable interpolation.
@@ -110,6 +117,15 @@ void CrMSIDataCubeIO::appedImageData(Rcpp::List rMSIobj, std::string outputImzML
     imzMLReaders.back()->set_mzOffset(&imzML_mzOffsets);
     imzMLReaders.back()->set_intLength(&imzML_intLength);
     imzMLReaders.back()->set_intOffset(&imzML_intOffsets);
+    
+    //Continuous data is only interpolated if its mass axis differs from the common one, the original mass axis must be read to know it
+    if(imzMLReaders.back()->get_continuous() && imzMLrun.nrows() > 0)
+    {
+      std::vector<double> originalMass(imzMLReaders.back()->get_mzLength(0));
+      imzMLReaders.back()->open();
+      imzMLReaders.back()->readMzData(imzMLReaders.back()->get_mzOffset(0), originalMass.size(), originalMass.data());
+      imzMLReaders.back()->close();
+    }
   }
   
   //Create the imzMLPeaksReaders corresponding to the current imzMLread
@@ -142,7 +158,8 @@ void CrMSIDataCubeIO::appedImageData(Rcpp::List rMSIobj, std::string outputImzML
                                                  as<String>(peakListimzML["int_dataType"]),
                                                  false,
                                                  false, //Do not call the file open() on constructor
-                                                 as<bool>(peakListimzML["rMSIpeakList"])//true if the peak list is in rMSI format
+                                                 as<bool>(peakListimzML["rMSIpeakList"]),//true if the peak list is in rMSI format
+                                                 true //Memory mapped access
                                                  )); 
     
     NumericVector imzML_mzLength = peaksimzMLrun["mzLength"];
@@ -193,12 +210,18 @@ void CrMSIDataCubeIO::appedImageData(Rcpp::List rMSIobj, std::string outputImzML
     imzMLWriters.back()->close(); 
   }
   
+  
   //Initialize the cube description if this is the first call to appedImageData()
   if(dataCubesDesc.size() == 0)
   {
     dataCubesDesc.push_back(DataCubeDescription());
+    dataCubesBytes.push_back(0.0);
   }
   
+  //Cubes are balanced by memory, processed mode spectra may have very different lengths so the original spectra are also accounted
+  const double rowBytes = (bFloat32 ? sizeof(float) : sizeof(double))*mass.length(); //Interpolated spectrum
+  const bool bOriginalInCube = dataMode != DataCubeIOMode::PEAKLIST_READ && imzMLReaders.back()->get_interpolationRequired();
+  
   unsigned int iters;
   if( dataMode == DataCubeIOMode::PEAKLIST_READ)
   {
@@ -210,10 +233,18 @@ void CrMSIDataCubeIO::appedImageData(Rcpp::List rMSIobj, std::string outputImzML
   }
   for( unsigned int i = 0; i < iters; i++) //For each pixel in imzML file
   {
-    if(dataCubesDesc.back().size() == cubeMaxNumRows)
+    if(dataCubesDesc.back().size() == cubeMaxNumRows || (dataCubesDesc.back().size() > 0 && dataCubesBytes.back() >= cubeMaxBytes))
     {
       //No more space left in the cube, so create a new cube
       dataCubesDesc.push_back(DataCubeDescription());
+      dataCubesBytes.push_back(0.0);
+    }
+    
+    dataCubesBytes.back() += rowBytes;
+    if(bOriginalInCube)
+    {
+      //The original spectrum is read to the cube before interpolation, only the intensities when a continuous spectrum is resampled
+      dataCubesBytes.back() += sizeof(double)*((imzMLReaders.back()->get_continuous() ? 0 : imzMLReaders.back()->get_mzLength(i)) + imzMLReaders.back()->get_intLength(i));
     }
     
     dataCubesDesc.back().push_back(PixelDescription());
@@ -231,7 +262,7 @@ void CrMSIDataCubeIO::appedImageData(Rcpp::List rMSIobj, std::string outputImzML
   }
 }
 
-CrMSIDataCubeIO::DataCube *CrMSIDataCubeIO::loadDataCube(int iCube)
+CrMSIDataCubeIO::DataCube *CrMSIDataCubeIO::loadDataCube(int iCube, DataCube *reuse)
 {
   if(iCube >= dataCubesDesc.size())
   {
@@ -240,114 +271,421 @@ CrMSIDataCubeIO::DataCube *CrMSIDataCubeIO::loadDataCube(int iCube)
   
   //Rcpp::Rcout << "CrMSIDataCubeIO::loadDataCube()--> iCube=" << iCube << std::endl; //DEBUG line
   
-  DataCube *data_ptr = new DataCube();
+  DataCube *data_ptr = reuse != nullptr ? reuse : new DataCube(); //Zero initialized to allow freeing a partially allocated cube
   data_ptr->cubeID = iCube;
-  data_ptr->nrows = dataCubesDesc[iCube].size();
+  data_ptr->nrows = 0;
   data_ptr->ncols = mass.length();
+  try
+  {
+    allocateDataCube(data_ptr, dataCubesDesc[iCube].size());
+  }
+  catch(std::exception &e)
+  {
+    if(reuse == nullptr)
+    {
+      freeDataCube(data_ptr);
+    }
+    throw;
+  }
+  data_ptr->nrows = dataCubesDesc[iCube].size();
+  data_ptr->readRanges = 0;
+  data_ptr->fileReads = 0;
+  data_ptr->fileReadBytes = 0.0;
+  data_ptr->mappedBytes = 0.0;
+  if(data_ptr->nrows == 0)
+  {
+    return data_ptr; //Nothing to read, so no imzML file is acquired
+  }
+  
+  //Float32 cubes are read using a double row which is then converted to the cube when no interpolation is needed
+  ScratchArena::Scope scratch;
+  double *spectrumBuffer = bFloat32 ? scratch.alloc<double>(data_ptr->ncols) : nullptr;
   
+  //Pixels are read in ibd file order, nearby pixels are requested at once
+  CubeReadPlan spectraPlan, peaksPlan;
   if(dataMode != DataCubeIOMode::PEAKLIST_READ)
   {
-    data_ptr->dataOriginal = new imzMLSpectrum[data_ptr->nrows];
-    data_ptr->dataInterpolated = new double*[data_ptr->nrows];
+    planCubeReads(iCube, imzMLReaders, spectraPlan);
   }
-  
-  if(dataMode == DataCubeIOMode::PEAKLIST_STORE || dataMode == DataCubeIOMode::DATA_AND_PEAKLIST_READ || dataMode == DataCubeIOMode::PEAKLIST_READ)
+  if(dataMode == DataCubeIOMode::PEAKLIST_READ || dataMode == DataCubeIOMode::DATA_AND_PEAKLIST_READ)
   {
-    data_ptr->peakLists = new PeakPicking::Peaks*[data_ptr->nrows];
+    planCubeReads(iCube, imzMLPeaksReaders, peaksPlan);
   }
+  const std::vector<int> &rowOrder = dataMode != DataCubeIOMode::PEAKLIST_READ ? spectraPlan.rowOrder : peaksPlan.rowOrder;
+  int currentSpectraRequest = -1;
+  int currentPeaksRequest = -1;
+  const ImzMLBinRead::ReadCounters countersBegin = ImzMLBinRead::getThreadReadCounters(); //The cube is read by this thread only
   
   //Data reading
-  int current_imzML_id;
+  int current_imzML_id = -1;
   int previous_imzML_id = -1; //Start previous as -1 to indicate an unallocated imzML
-  for(unsigned int i = 0; i < data_ptr->nrows; i++) //For each spectrum belonging to the selected datacube
+  try
   {
-    current_imzML_id = dataCubesDesc[iCube][i].imzML_ID;
-    
-    //Rcpp::Rcout << "CrMSIDataCubeIO::loadDataCube()--> current_imzML_id=" << current_imzML_id << std::endl; //DEBUG line!
-    //Rcpp::Rcout << "CrMSIDataCubeIO::loadDataCube()--> mzLength(0)=" << imzMLReaders[current_imzML_id]->get_mzLength(0)  << std::endl; //DEBUG line
-    //Rcpp::Rcout << "CrMSIDataCubeIO::loadDataCube()--> ibd file=" << imzMLReaders[current_imzML_id]->getIbdFilePath()  << std::endl; //DEBUG line
-    
-    if(current_imzML_id != previous_imzML_id)
+    for(int k = 0; k < data_ptr->nrows; k++) //For each spectrum belonging to the selected datacube
     {
-      if(previous_imzML_id != -1)
+      const int i = rowOrder[k];
+      current_imzML_id = dataCubesDesc[iCube][i].imzML_ID;
+      
+      //Rcpp::Rcout << "CrMSIDataCubeIO::loadDataCube()--> current_imzML_id=" << current_imzML_id << std::endl; //DEBUG line!
+      //Rcpp::Rcout << "CrMSIDataCubeIO::loadDataCube()--> mzLength(0)=" << imzMLReaders[current_imzML_id]->get_mzLength(0)  << std::endl; //DEBUG line
+      //Rcpp::Rcout << "CrMSIDataCubeIO::loadDataCube()--> ibd file=" << imzMLReaders[current_imzML_id]->getIbdFilePath()  << std::endl; //DEBUG line
+      
+      if(current_imzML_id != previous_imzML_id)
       {
-        if( (dataMode == DataCubeIOMode::PEAKLIST_READ) || (dataMode == DataCubeIOMode::DATA_AND_PEAKLIST_READ))
+        if(previous_imzML_id != -1)
         {
-          imzMLPeaksReaders[previous_imzML_id]->close();
-        }
-        if(dataMode != DataCubeIOMode::PEAKLIST_READ)
-        {
-          imzMLReaders[previous_imzML_id]->close();
+          releaseImzMLReaders(previous_imzML_id);
+          previous_imzML_id = -1; //Nothing acquired until the following call returns
         }
+        acquireImzMLReaders(current_imzML_id);
+        previous_imzML_id = current_imzML_id;
       }
       
-      if( (dataMode == DataCubeIOMode::PEAKLIST_READ) || (dataMode == DataCubeIOMode::DATA_AND_PEAKLIST_READ))
+      if(dataMode != DataCubeIOMode::PEAKLIST_READ)
       {
-        imzMLPeaksReaders[current_imzML_id]->open();
+        prefetchCubeRow(imzMLReaders[current_imzML_id], spectraPlan, i, currentSpectraRequest, data_ptr);
+        imzMLReaders[current_imzML_id]->ReadSpectrum(dataCubesDesc[iCube][i].pixel_ID, //pixel id to read
+                                                    0, //unsigned int ionIndex
+                                                    mass.length(),//unsigned int ionCount
+                                                    bFloat32 ? spectrumBuffer : data_ptr->dataInterpolated[i], //Store data directely at the datacube mem
+                                                    data_ptr->dataOriginal[i], //Reuse the vectors of the previous cube loaded in this row
+                                                    false //Disable auto-interpolation
+                                                    );
+        if(bFloat32 && !imzMLReaders[current_imzML_id]->get_interpolationRequired())
+        {
+          setSpectrum(data_ptr, i, spectrumBuffer);
+        }
       }
-      if(dataMode != DataCubeIOMode::PEAKLIST_READ)
+      
+      if(dataMode == DataCubeIOMode::PEAKLIST_READ || dataMode == DataCubeIOMode::DATA_AND_PEAKLIST_READ)
       {
-        imzMLReaders[current_imzML_id]->open();
+        //Load the peak list in reading mode, the Peaks structs are kept in the cube when it is reused
+        if(data_ptr->peakLists[i] == nullptr)
+        {
+          data_ptr->peakLists[i] = new PeakPicking::Peaks;
+        }
+        prefetchCubeRow(imzMLPeaksReaders[current_imzML_id], peaksPlan, i, currentPeaksRequest, data_ptr);
+        imzMLPeaksReaders[current_imzML_id]->ReadPeakList(dataCubesDesc[iCube][i].pixel_ID, data_ptr->peakLists[i]); 
       }
     }
-    
-    if(dataMode != DataCubeIOMode::PEAKLIST_READ)
+  }
+  catch(std::exception &e)
+  {
+    //Do not keep the readers opened neither leak the partially loaded cube
+    if(previous_imzML_id != -1)
     {
-      data_ptr->dataInterpolated[i] = new double[data_ptr->ncols];
-      data_ptr->dataOriginal[i] = imzMLReaders[current_imzML_id]->ReadSpectrum(dataCubesDesc[iCube][i].pixel_ID, //pixel id to read
-                                                  0, //unsigned int ionIndex
-                                                  mass.length(),//unsigned int ionCount
-                                                  data_ptr->dataInterpolated[i], //Store data directely at the datacube mem
-                                                  false //Disable auto-interpolation
-                                                  );
+      releaseImzMLReaders(previous_imzML_id);
     }
-    
-    if(dataMode == DataCubeIOMode::PEAKLIST_READ || dataMode == DataCubeIOMode::DATA_AND_PEAKLIST_READ)
+    if(reuse != nullptr)
     {
-      //Load the peak list in reading mode
-      data_ptr->peakLists[i] = imzMLPeaksReaders[current_imzML_id]->ReadPeakList(dataCubesDesc[iCube][i].pixel_ID); 
+      releaseDataCube(data_ptr);
     }
-                                  
-    previous_imzML_id = current_imzML_id;
+    else
+    {
+      freeDataCube(data_ptr);
+    }
+    throw;
+  }
+  
+  //Release the last imzML, it is kept opened in the file cache
+  if(previous_imzML_id != -1)
+  {
+    releaseImzMLReaders(previous_imzML_id);
   }
   
-  //Force to close the last opened imzML
+  const ImzMLBinRead::ReadCounters countersEnd = ImzMLBinRead::getThreadReadCounters();
+  data_ptr->fileReads = countersEnd.fileReads - countersBegin.fileReads;
+  data_ptr->fileReadBytes = countersEnd.fileReadBytes - countersBegin.fileReadBytes;
+  data_ptr->mappedBytes = countersEnd.mappedBytes - countersBegin.mappedBytes;
+  return data_ptr;
+}
+
+void CrMSIDataCubeIO::acquireImzMLReaders(int imzML_ID)
+{
   if( (dataMode == DataCubeIOMode::PEAKLIST_READ) || (dataMode == DataCubeIOMode::DATA_AND_PEAKLIST_READ))
   {
-    imzMLPeaksReaders[current_imzML_id]->close();
+    acquireImzMLFile(PEAKS_READER, imzML_ID);
   }
   if(dataMode != DataCubeIOMode::PEAKLIST_READ)
   {
-    imzMLReaders[current_imzML_id]->close();
+    try
+    {
+      acquireImzMLFile(SPECTRA_READER, imzML_ID);
+    }
+    catch(std::exception &e)
+    {
+      if(dataMode == DataCubeIOMode::DATA_AND_PEAKLIST_READ)
+      {
+        releaseImzMLFile(PEAKS_READER, imzML_ID);
+      }
+      throw;
+    }
+  }
+}
+
+void CrMSIDataCubeIO::releaseImzMLReaders(int imzML_ID)
+{
+  if( (dataMode == DataCubeIOMode::PEAKLIST_READ) || (dataMode == DataCubeIOMode::DATA_AND_PEAKLIST_READ))
+  {
+    releaseImzMLFile(PEAKS_READER, imzML_ID);
+  }
+  if(dataMode != DataCubeIOMode::PEAKLIST_READ)
+  {
+    releaseImzMLFile(SPECTRA_READER, imzML_ID);
+  }
+}
+
+void CrMSIDataCubeIO::acquireImzMLWriter(int imzML_ID)
+{
+  acquireImzMLFile(WRITER, imzML_ID);
+}
+
+void CrMSIDataCubeIO::releaseImzMLWriter(int imzML_ID)
+{
+  releaseImzMLFile(WRITER, imzML_ID);
+}
+
+void CrMSIDataCubeIO::acquireImzMLFile(ImzMLFileType type, int imzML_ID)
+{
+  std::lock_guard<std::mutex> lock(filesMutex);
+  for(std::list<OpenedFile>::iterator it = openedFiles.begin(); it != openedFiles.end(); ++it)
+  {
+    if(it->type == type && it->imzML_ID == imzML_ID)
+    {
+      it->usageCount++;
+      openedFiles.splice(openedFiles.begin(), openedFiles, it); //Most recently used
+      return;
+    }
   }
   
-  return data_ptr;
+  //Make room for the new file closing the least recently used ones
+  std::list<OpenedFile>::iterator it = openedFiles.end();
+  while(openedFiles.size() >= MAX_OPENED_IMZML_FILES && it != openedFiles.begin())
+  {
+    --it;
+    if(it->usageCount == 0)
+    {
+      closeImzMLFile(it->type, it->imzML_ID);
+      it = openedFiles.erase(it);
+    }
+  }
+  
+  openImzMLFile(type, imzML_ID);
+  OpenedFile file;
+  file.type = type;
+  file.imzML_ID = imzML_ID;
+  file.usageCount = 1;
+  openedFiles.push_front(file);
 }
 
-void CrMSIDataCubeIO::freeDataCube(DataCube *data_ptr)
+void CrMSIDataCubeIO::releaseImzMLFile(ImzMLFileType type, int imzML_ID)
 {
-  for( int i = 0; i < data_ptr->nrows; i++ )
+  std::lock_guard<std::mutex> lock(filesMutex);
+  for(std::list<OpenedFile>::iterator it = openedFiles.begin(); it != openedFiles.end(); ++it)
   {
-    if(dataMode != DataCubeIOMode::PEAKLIST_READ)
+    if(it->type == type && it->imzML_ID == imzML_ID)
     {
-      delete[] data_ptr->dataInterpolated[i];
+      it->usageCount--;
+      return;
     }
-    if(dataMode == DataCubeIOMode::PEAKLIST_STORE || dataMode == DataCubeIOMode::DATA_AND_PEAKLIST_READ || dataMode == DataCubeIOMode::PEAKLIST_READ)
+  }
+}
+
+void CrMSIDataCubeIO::openImzMLFile(ImzMLFileType type, int imzML_ID)
+{
+  switch(type)
+  {
+    case SPECTRA_READER:
+      imzMLReaders[imzML_ID]->open();
+      break;
+      
+    case PEAKS_READER:
+      imzMLPeaksReaders[imzML_ID]->open();
+      break;
+      
+    case WRITER:
+      imzMLWriters[imzML_ID]->openConcurrent(mass.length(), mass.begin()); //The mass axis is only used the first time in continuous mode
+      break;
+  }
+}
+
+void CrMSIDataCubeIO::closeImzMLFile(ImzMLFileType type, int imzML_ID)
+{
+  switch(type)
+  {
+    case SPECTRA_READER:
+      imzMLReaders[imzML_ID]->close();
+      break;
+      
+    case PEAKS_READER:
+      imzMLPeaksReaders[imzML_ID]->close();
+      break;
+      
+    case WRITER:
+      imzMLWriters[imzML_ID]->close();
+      break;
+  }
+}
+
+void CrMSIDataCubeIO::closeImzMLFiles()
+{
+  std::lock_guard<std::mutex> lock(filesMutex);
+  for(std::list<OpenedFile>::iterator it = openedFiles.begin(); it != openedFiles.end(); ++it)
+  {
+    closeImzMLFile(it->type, it->imzML_ID);
+  }
+  openedFiles.clear();
+  
+  clearPendingCubes();
+}
+
+void CrMSIDataCubeIO::planCubeReads(int iCube, std::vector<ImzMLBinRead*> &readers, CubeReadPlan &plan)
+{
+  const int nrows = dataCubesDesc[iCube].size();
+  std::vector<std::streamoff> rowBegin(nrows);
+  std::vector<std::streamoff> rowEnd(nrows);
+  for(int i = 0; i < nrows; i++)
+  {
+    readers[dataCubesDesc[iCube][i].imzML_ID]->getPixelByteRange(dataCubesDesc[iCube][i].pixel_ID, rowBegin[i], rowEnd[i]);
+  }
+  
+  //The pixels of each imzML are kept together, so each reader is acquired once
+  plan.rowOrder.resize(nrows);
+  for(int i = 0; i < nrows; i++)
+  {
+    plan.rowOrder[i] = i;
+  }
+  const DataCubeDescription &desc = dataCubesDesc[iCube];
+  std::stable_sort(plan.rowOrder.begin(), plan.rowOrder.end(), [&desc, &rowBegin](int a, int b)
+  {
+    return desc[a].imzML_ID < desc[b].imzML_ID || (desc[a].imzML_ID == desc[b].imzML_ID && rowBegin[a] < rowBegin[b]);
+  });
+  
+  //Merge the ranges of consecutive rows while they are close enough
+  plan.rowRequest.resize(nrows);
+  plan.requestBegin.clear();
+  plan.requestEnd.clear();
+  for(int k = 0; k < nrows; k++)
+  {
+    const int i = plan.rowOrder[k];
+    const bool bMerge = k > 0 && 
+      desc[i].imzML_ID == desc[plan.rowOrder[k - 1]].imzML_ID &&
+      rowBegin[i] <= plan.requestEnd.back() + CUBE_READ_MERGE_GAP &&
+      std::max(rowEnd[i], plan.requestEnd.back()) - plan.requestBegin.back() <= CUBE_READ_MAX_BYTES;
+    if(bMerge)
     {
-      delete data_ptr->peakLists[i];
+      plan.requestEnd.back() = std::max(rowEnd[i], plan.requestEnd.back());
     }
+    else
+    {
+      plan.requestBegin.push_back(rowBegin[i]);
+      plan.requestEnd.push_back(rowEnd[i]);
+    }
+    plan.rowRequest[i] = plan.requestBegin.size() - 1;
+  }
+}
+
+void CrMSIDataCubeIO::prefetchCubeRow(ImzMLBinRead *reader, const CubeReadPlan &plan, int row, int &currentRequest, DataCube *data_ptr)
+{
+  data_ptr->readRanges++;
+  if(plan.rowRequest[row] == currentRequest)
+  {
+    return; //Already requested with a previous row
   }
   
-  if(dataMode != DataCubeIOMode::PEAKLIST_READ)
+  currentRequest = plan.rowRequest[row];
+  reader->prefetch(plan.requestBegin[currentRequest], plan.requestEnd[currentRequest] - plan.requestBegin[currentRequest]);
+}
+
+void CrMSIDataCubeIO::allocateDataCube(DataCube *data_ptr, int nrows)
+{
+  if(nrows <= data_ptr->maxRows && (dataMode == DataCubeIOMode::PEAKLIST_READ || data_ptr->rowStride >= data_ptr->ncols))
   {
-    delete[] data_ptr->dataOriginal;
-    delete[] data_ptr->dataInterpolated;
+    return; //The current storage is large enough
   }
+  nrows = nrows > data_ptr->maxRows ? nrows : data_ptr->maxRows; //Never shrink, a retry after a failed allocation only rebuilds the data block
   
   if(dataMode == DataCubeIOMode::PEAKLIST_STORE || dataMode == DataCubeIOMode::DATA_AND_PEAKLIST_READ || dataMode == DataCubeIOMode::PEAKLIST_READ)
   {
+    //Keep the already allocated peak lists, they are reused in reading modes
+    PeakPicking::Peaks **peakLists = new PeakPicking::Peaks*[nrows](); 
+    for( int i = 0; i < data_ptr->maxRows; i++ )
+    {
+      peakLists[i] = data_ptr->peakLists[i];
+    }
     delete[] data_ptr->peakLists;
+    data_ptr->peakLists = peakLists;
   }
+  
+  if(dataMode != DataCubeIOMode::PEAKLIST_READ)
+  {
+    delete[] data_ptr->dataOriginal;
+    delete[] data_ptr->dataInterpolated;
+    delete[] data_ptr->dataInterpolatedFloat;
+    delete[] data_ptr->dataBlockAlloc;
+    data_ptr->dataOriginal = nullptr;
+    data_ptr->dataInterpolated = nullptr;
+    data_ptr->dataInterpolatedFloat = nullptr;
+    data_ptr->dataBlock = nullptr;
+    data_ptr->dataBlockAlloc = nullptr;
+    data_ptr->rowStride = 0; //Mark the data block as not allocated until the following allocations succeed
+    
+    const size_t valueBytes = bFloat32 ? sizeof(float) : sizeof(double);
+    const int alignValues = DATACUBE_ALIGNMENT/valueBytes;
+    const int rowStride = ((data_ptr->ncols + alignValues - 1)/alignValues)*alignValues;
+    data_ptr->dataOriginal = new imzMLSpectrum[nrows];
+    data_ptr->dataBlockAlloc = new char[(size_t)nrows*rowStride*valueBytes + DATACUBE_ALIGNMENT];
+    data_ptr->dataBlock = reinterpret_cast<char*>((reinterpret_cast<uintptr_t>(data_ptr->dataBlockAlloc) + DATACUBE_ALIGNMENT - 1) & ~(uintptr_t)(DATACUBE_ALIGNMENT - 1));
+    if(bFloat32)
+    {
+      data_ptr->dataInterpolatedFloat = new float*[nrows];
+      for( int i = 0; i < nrows; i++ )
+      {
+        data_ptr->dataInterpolatedFloat[i] = reinterpret_cast<float*>(data_ptr->dataBlock) + (size_t)i*rowStride;
+      }
+    }
+    else
+    {
+      data_ptr->dataInterpolated = new double*[nrows];
+      for( int i = 0; i < nrows; i++ )
+      {
+        data_ptr->dataInterpolated[i] = reinterpret_cast<double*>(data_ptr->dataBlock) + (size_t)i*rowStride;
+      }
+    }
+    data_ptr->rowStride = rowStride;
+  }
+  data_ptr->maxRows = nrows;
+}
+
+void CrMSIDataCubeIO::releaseDataCube(DataCube *data_ptr)
+{
+  if(dataMode == DataCubeIOMode::PEAKLIST_STORE)
+  {
+    //Peak lists in store mode are allocated by the processing, so they can not be reused
+    for( int i = 0; i < data_ptr->maxRows; i++ )
+    {
+      delete data_ptr->peakLists[i];
+      data_ptr->peakLists[i] = nullptr;
+    }
+  }
+  data_ptr->nrows = 0;
+}
+
+void CrMSIDataCubeIO::freeDataCube(DataCube *data_ptr)
+{
+  if(data_ptr->peakLists != nullptr)
+  {
+    for( int i = 0; i < data_ptr->maxRows; i++ )
+    {
+      delete data_ptr->peakLists[i];
+    }
+  }
+  
+  delete[] data_ptr->peakLists;
+  delete[] data_ptr->dataOriginal;
+  delete[] data_ptr->dataInterpolated;
+  delete[] data_ptr->dataInterpolatedFloat;
+  delete[] data_ptr->dataBlockAlloc;
   delete data_ptr;
 }
 
@@ -361,82 +699,415 @@ void CrMSIDataCubeIO::interpolateDataCube(DataCube *data_ptr)
     }
     
     int current_imzML_id;
+    ScratchArena::Scope scratch;
+    double *spectrumBuffer = bFloat32 ? scratch.alloc<double>(data_ptr->ncols) : nullptr;
     for(unsigned int i = 0; i < data_ptr->nrows; i++) //For each spectrum belonging to the selected datacube
     {
       current_imzML_id = dataCubesDesc[data_ptr->cubeID][i].imzML_ID;
-      imzMLReaders[current_imzML_id]->InterpolateSpectrum( &(data_ptr->dataOriginal[i]), 0, mass.length(), data_ptr->dataInterpolated[i]);
+      if(!bFloat32)
+      {
+        imzMLReaders[current_imzML_id]->InterpolateSpectrum( &(data_ptr->dataOriginal[i]), 0, mass.length(), data_ptr->dataInterpolated[i]);
+      }
+      else if(imzMLReaders[current_imzML_id]->get_interpolationRequired())
+      {
+        //Float32 rows are interpolated in double and then converted, rows without interpolation were converted on load
+        imzMLReaders[current_imzML_id]->InterpolateSpectrum( &(data_ptr->dataOriginal[i]), 0, mass.length(), spectrumBuffer);
+        setSpectrum(data_ptr, i, spectrumBuffer);
+      }
     }
   }
 }
 
-void CrMSIDataCubeIO::storeDataCube(DataCube *data_ptr) 
+void CrMSIDataCubeIO::writeDataCube(DataCube *data_ptr, std::vector<CubeSpectra> &spectra)
 {
-  if(data_ptr->cubeID >= dataCubesDesc.size())
+  if(data_ptr->cubeID >= (int)dataCubesDesc.size())
   {
     throw std::runtime_error("Error: DataCube index out of range\n");
   }
   
+  spectra.clear();
+  if( dataMode == DataCubeIOMode::DATA_STORE)
+  {
+    accumulateCubeSpectra(data_ptr, spectra);
+  }
+  
+  ScratchArena::Scope scratch;
+  double *spectrumBuffer = bFloat32 ? scratch.alloc<double>(data_ptr->ncols) : nullptr;
+  
+  //Continuous mode pixels are written at their precomputed offsets, only the length of the other rows is kept to reserve their space
+  std::vector<unsigned int> rowLengths(data_ptr->nrows, 0);
   int current_imzML_id;
   int previous_imzML_id = -1; //Start previous as -1 to indicate an unallocated imzML
+  try
+  {
+    for(int i = 0; i < data_ptr->nrows; i++) //For each spectrum belonging to the selected datacube
+    {
+      current_imzML_id = dataCubesDesc[data_ptr->cubeID][i].imzML_ID;
+      if(current_imzML_id != previous_imzML_id)
+      {
+        if(previous_imzML_id != -1)
+        {
+          releaseImzMLWriter(previous_imzML_id);
+          previous_imzML_id = -1; //Nothing acquired until the following call returns
+        }
+        acquireImzMLWriter(current_imzML_id); //The space of the writer can not be reserved before it is opened
+        previous_imzML_id = current_imzML_id;
+      }
+      
+      if( dataMode == DataCubeIOMode::DATA_STORE)
+      {
+        if(imzMLWriters[current_imzML_id]->get_continuous())
+        {
+          imzMLWriters[current_imzML_id]->writeIntDataAt(dataCubesDesc[data_ptr->cubeID][i].pixel_ID, mass.length(), getSpectrum(data_ptr, i, spectrumBuffer));
+        }
+        else
+        {
+          rowLengths[i] = data_ptr->dataOriginal[i].imzMLmass.size(); //Processed mode, the original spectrum is written
+        }
+      }
+      
+      if( dataMode == DataCubeIOMode::PEAKLIST_STORE)
+      {
+        rowLengths[i] = data_ptr->peakLists[i]->mass.size();
+      }
+    }
+  }
+  catch(std::exception &e)
+  {
+    if(previous_imzML_id != -1)
+    {
+      releaseImzMLWriter(previous_imzML_id);
+    }
+    throw;
+  }
   
-  for(unsigned int i = 0; i < data_ptr->nrows; i++) //For each spectrum belonging to the selected datacube
+  if(previous_imzML_id != -1)
   {
-    current_imzML_id = dataCubesDesc[data_ptr->cubeID][i].imzML_ID;
-    
-    //Rcpp::Rcout << "CrMSIDataCubeIO::storeDataCube()--> current_imzML_id=" << current_imzML_id << std::endl; //DEBUG line!
-    //Rcpp::Rcout << "CrMSIDataCubeIO::storeDataCube()--> mzLength(0)=" << imzMLReaders[current_imzML_id]->get_mzLength(0)  << std::endl; //DEBUG line
-    //Rcpp::Rcout << "CrMSIDataCubeIO::storeDataCube()--> ibd file=" << imzMLReaders[current_imzML_id]->getIbdFilePath()  << std::endl; //DEBUG line
-    
-    if(current_imzML_id != previous_imzML_id)
+    releaseImzMLWriter(previous_imzML_id);
+  }
+  
+  //Reserve the space of this cube and the following ones already completed, as long as the previous cubes are reserved
+  std::vector<StagedCube*> reservedCubes; //Staged cubes reserved by this thread, it must write them
+  bool bReserved;
+  {
+    std::lock_guard<std::mutex> lock(reserveMutex);
+    pendingRowLengths[data_ptr->cubeID].swap(rowLengths);
+    reservePendingCubes(reservedCubes);
+    bReserved = data_ptr->cubeID < nextCubeReserve;
+  }
+  
+  try
+  {
+    if(bReserved)
+    {
+      std::vector<unsigned int> reservedLengths(data_ptr->nrows, 0);
+      std::vector<double*> rowData(5*data_ptr->nrows, nullptr);
+      for(int i = 0; i < data_ptr->nrows; i++)
+      {
+        if( dataMode == DataCubeIOMode::DATA_STORE)
+        {
+          reservedLengths[i] = data_ptr->dataOriginal[i].imzMLmass.size();
+          rowData[5*i] = data_ptr->dataOriginal[i].imzMLmass.data();
+          rowData[5*i + 1] = data_ptr->dataOriginal[i].imzMLintensity.data();
+        }
+        if( dataMode == DataCubeIOMode::PEAKLIST_STORE)
+        {
+          reservedLengths[i] = data_ptr->peakLists[i]->mass.size();
+          rowData[5*i] = data_ptr->peakLists[i]->mass.data();
+          rowData[5*i + 1] = data_ptr->peakLists[i]->intensity.data();
+          rowData[5*i + 2] = data_ptr->peakLists[i]->area.data();
+          rowData[5*i + 3] = data_ptr->peakLists[i]->SNR.data();
+          rowData[5*i + 4] = data_ptr->peakLists[i]->binSize.data();
+        }
+      }
+      writeReservedRows(data_ptr->cubeID, reservedLengths, rowData);
+    }
+    else
     {
-      if(previous_imzML_id != -1)
+      //A previous cube is still being processed, the rows are staged to release the cube
+      StagedCube *staged = stageReservedRows(data_ptr);
+      std::lock_guard<std::mutex> lock(reserveMutex);
+      if(data_ptr->cubeID < nextCubeReserve)
       {
-        imzMLWriters[previous_imzML_id]->close();
+        reservedCubes.push_back(staged); //Reserved while it was staged
+      }
+      else
+      {
+        pendingCubes[data_ptr->cubeID] = staged;
       }
-      imzMLWriters[current_imzML_id]->open();
     }
     
-    //Store Spectral data
-    if( dataMode == DataCubeIOMode::DATA_STORE)
+    while(!reservedCubes.empty())
+    {
+      writeReservedStagedCube(reservedCubes.back());
+      reservedCubes.pop_back();
+    }
+  }
+  catch(std::exception &e)
+  {
+    for(unsigned int i = 0; i < reservedCubes.size(); i++)
+    {
+      delete reservedCubes[i];
+    }
+    throw;
+  }
+}
+
+bool CrMSIDataCubeIO::isReservedRow(int iCube, int cubeRow)
+{
+  return dataMode == DataCubeIOMode::PEAKLIST_STORE || 
+    (dataMode == DataCubeIOMode::DATA_STORE && !imzMLWriters[dataCubesDesc[iCube][cubeRow].imzML_ID]->get_continuous());
+}
+
+void CrMSIDataCubeIO::reservePendingCubes(std::vector<StagedCube*> &reservedCubes)
+{
+  std::map<int, std::vector<unsigned int>>::iterator it;
+  while( (it = pendingRowLengths.find(nextCubeReserve)) != pendingRowLengths.end() )
+  {
+    for(unsigned int i = 0; i < it->second.size(); i++)
     {
-      //Calc average and base spectrum
-      for(unsigned int j = 0; j < mass.length(); j++)
+      if(!isReservedRow(nextCubeReserve, i))
       {
-        acumulatedSpectrum[current_imzML_id][j] += data_ptr->dataInterpolated[i][j];  
-        baseSpectrum[current_imzML_id][j] = data_ptr->dataInterpolated[i][j] > baseSpectrum[current_imzML_id][j] ? data_ptr->dataInterpolated[i][j] : baseSpectrum[current_imzML_id][j];
+        continue;
       }
       
-      if(imzMLWriters[current_imzML_id]->get_continuous())
+      ImzMLBinWrite *writer = imzMLWriters[dataCubesDesc[nextCubeReserve][i].imzML_ID];
+      if( dataMode == DataCubeIOMode::DATA_STORE)
       {
-        //Continuous mode write
-        imzMLWriters[current_imzML_id]->writeMzData(mass.length(), mass.begin()); //The mass axis will be writtem only once
-        imzMLWriters[current_imzML_id]->writeIntData(mass.length(), data_ptr->dataInterpolated[i]);
+        writer->reserveSpectrumAt(dataCubesDesc[nextCubeReserve][i].pixel_ID, it->second[i]);
       }
       else
       {
-        //Processed mode write
-        imzMLWriters[current_imzML_id]->writeMzData(data_ptr->dataOriginal[i].imzMLmass.size(), data_ptr->dataOriginal[i].imzMLmass.data());
-        imzMLWriters[current_imzML_id]->writeIntData(data_ptr->dataOriginal[i].imzMLintensity.size(), data_ptr->dataOriginal[i].imzMLintensity.data());
+        writer->reservePeakListAt(dataCubesDesc[nextCubeReserve][i].pixel_ID, it->second[i]);
       }
     }
+    pendingRowLengths.erase(it);
     
-    //Store Peak lists
+    std::map<int, StagedCube*>::iterator itStaged = pendingCubes.find(nextCubeReserve);
+    if(itStaged != pendingCubes.end())
+    {
+      reservedCubes.push_back(itStaged->second);
+      pendingCubes.erase(itStaged);
+    }
+    nextCubeReserve++;
+  }
+}
+
+CrMSIDataCubeIO::StagedCube *CrMSIDataCubeIO::stageReservedRows(DataCube *data_ptr)
+{
+  StagedCube *staged = new StagedCube;
+  staged->cubeID = data_ptr->cubeID;
+  staged->rowOffsets.resize(data_ptr->nrows + 1);
+  
+  //Mass and intensity in DATA_STORE mode or the five peak list vectors are concatenated for each row
+  size_t length = 0;
+  for(int i = 0; i < data_ptr->nrows; i++)
+  {
+    staged->rowOffsets[i] = length;
+    if(!isReservedRow(data_ptr->cubeID, i))
+    {
+      continue;
+    }
+    if( dataMode == DataCubeIOMode::DATA_STORE)
+    {
+      length += 2*data_ptr->dataOriginal[i].imzMLmass.size();
+    }
+    if( dataMode == DataCubeIOMode::PEAKLIST_STORE)
+    {
+      length += 5*data_ptr->peakLists[i]->mass.size();
+    }
+  }
+  staged->rowOffsets[data_ptr->nrows] = length;
+  staged->values.resize(length);
+  
+  for(int i = 0; i < data_ptr->nrows; i++)
+  {
+    if(!isReservedRow(data_ptr->cubeID, i))
+    {
+      continue;
+    }
+    double *dst = staged->values.data() + staged->rowOffsets[i];
+    if( dataMode == DataCubeIOMode::DATA_STORE)
+    {
+      dst = std::copy(data_ptr->dataOriginal[i].imzMLmass.begin(), data_ptr->dataOriginal[i].imzMLmass.end(), dst);
+      dst = std::copy(data_ptr->dataOriginal[i].imzMLintensity.begin(), data_ptr->dataOriginal[i].imzMLintensity.end(), dst);
+    }
     if( dataMode == DataCubeIOMode::PEAKLIST_STORE)
     {
-      //Processed mode write with phantom data for snr, area and bin size
-      //Rcpp::Rcout<<"iCube = " <<iCube<< "  i = " <<i<<"  mass.size() = "<<data_ptr->peakLists[i]->mass.size()<< "  intensity.size() = " << data_ptr->peakLists[i]->intensity.size() <<"\n";
-      imzMLWriters[current_imzML_id]->writePeakList(data_ptr->peakLists[i]->mass.size(), 
-                                                    data_ptr->peakLists[i]->mass.data(),
-                                                    data_ptr->peakLists[i]->intensity.data(),
-                                                    data_ptr->peakLists[i]->area.data(),
-                                                    data_ptr->peakLists[i]->SNR.data(),
-                                                    data_ptr->peakLists[i]->binSize.data() );
+      PeakPicking::Peaks *pks = data_ptr->peakLists[i];
+      const size_t N = pks->mass.size();
+      dst = std::copy(pks->mass.begin(), pks->mass.end(), dst);
+      dst = std::copy(pks->intensity.begin(), pks->intensity.begin() + N, dst);
+      dst = std::copy(pks->area.begin(), pks->area.begin() + N, dst);
+      dst = std::copy(pks->SNR.begin(), pks->SNR.begin() + N, dst);
+      dst = std::copy(pks->binSize.begin(), pks->binSize.begin() + N, dst);
+    }
+  }
+  return staged;
+}
+
+void CrMSIDataCubeIO::writeReservedRows(int iCube, const std::vector<unsigned int> &rowLengths, const std::vector<double*> &rowData)
+{
+  int current_imzML_id;
+  int previous_imzML_id = -1; //Start previous as -1 to indicate an unallocated imzML
+  try
+  {
+    for(unsigned int i = 0; i < rowLengths.size(); i++)
+    {
+      if(!isReservedRow(iCube, i))
+      {
+        continue;
+      }
+      
+      current_imzML_id = dataCubesDesc[iCube][i].imzML_ID;
+      if(current_imzML_id != previous_imzML_id)
+      {
+        if(previous_imzML_id != -1)
+        {
+          releaseImzMLWriter(previous_imzML_id);
+          previous_imzML_id = -1; //Nothing acquired until the following call returns
+        }
+        acquireImzMLWriter(current_imzML_id);
+        previous_imzML_id = current_imzML_id;
+      }
+      
+      const int pixelID = dataCubesDesc[iCube][i].pixel_ID;
+      if( dataMode == DataCubeIOMode::DATA_STORE)
+      {
+        imzMLWriters[current_imzML_id]->writeSpectrumAt(pixelID, rowLengths[i], rowData[5*i], rowData[5*i + 1]);
+      }
+      if( dataMode == DataCubeIOMode::PEAKLIST_STORE)
+      {
+        imzMLWriters[current_imzML_id]->writePeakListAt(pixelID, rowLengths[i], rowData[5*i], rowData[5*i + 1], rowData[5*i + 2], rowData[5*i + 3], rowData[5*i + 4]);
+      }
+    }
+  }
+  catch(std::exception &e)
+  {
+    if(previous_imzML_id != -1)
+    {
+      releaseImzMLWriter(previous_imzML_id);
+    }
+    throw;
+  }
+  
+  if(previous_imzML_id != -1)
+  {
+    releaseImzMLWriter(previous_imzML_id);
+  }
+}
+
+void CrMSIDataCubeIO::writeReservedStagedCube(StagedCube *staged)
+{
+  //Each staged row holds its vectors one after the other
+  const unsigned int numVectors = dataMode == DataCubeIOMode::PEAKLIST_STORE ? 5 : 2;
+  const int nrows = staged->rowOffsets.size() - 1;
+  std::vector<unsigned int> rowLengths(nrows);
+  std::vector<double*> rowData(5*nrows, nullptr);
+  for(int i = 0; i < nrows; i++)
+  {
+    rowLengths[i] = (staged->rowOffsets[i + 1] - staged->rowOffsets[i])/numVectors;
+    for(unsigned int j = 0; j < numVectors; j++)
+    {
+      rowData[5*i + j] = staged->values.data() + staged->rowOffsets[i] + j*rowLengths[i];
+    }
+  }
+  writeReservedRows(staged->cubeID, rowLengths, rowData);
+  delete staged;
+}
+
+void CrMSIDataCubeIO::clearPendingCubes()
+{
+  std::lock_guard<std::mutex> lock(reserveMutex);
+  for(std::map<int, StagedCube*>::iterator it = pendingCubes.begin(); it != pendingCubes.end(); ++it)
+  {
+    delete it->second;
+  }
+  pendingCubes.clear();
+  pendingRowLengths.clear();
+  nextCubeReserve = 0;
+}
+
+void CrMSIDataCubeIO::accumulateCubeSpectra(DataCube *data_ptr, std::vector<CubeSpectra> &spectra)
+{
+  ScratchArena::Scope scratch;
+  double *spectrumBuffer = bFloat32 ? scratch.alloc<double>(data_ptr->ncols) : nullptr;
+  for(int i = 0; i < data_ptr->nrows; i++)
+  {
+    const int imzML_ID = dataCubesDesc[data_ptr->cubeID][i].imzML_ID;
+    if(spectra.empty() || spectra.back().imzML_ID != imzML_ID) //Pixels of the same imzML are contiguous in a cube
+    {
+      spectra.push_back(CubeSpectra());
+      spectra.back().imzML_ID = imzML_ID;
+      spectra.back().sum.resize(data_ptr->ncols, 0.0);
+      spectra.back().max.resize(data_ptr->ncols, 0.0);
     }
     
-    previous_imzML_id = current_imzML_id;
+    const double *spectrum = getSpectrum(data_ptr, i, spectrumBuffer);
+    double *sum = spectra.back().sum.data();
+    double *max = spectra.back().max.data();
+    for(int j = 0; j < data_ptr->ncols; j++)
+    {
+      sum[j] += spectrum[j];
+      max[j] = spectrum[j] > max[j] ? spectrum[j] : max[j];
+    }
   }
+}
 
-  imzMLWriters[current_imzML_id]->close(); //Force to close the last opened imzML 
+void CrMSIDataCubeIO::addCubeSpectra(const std::vector<CubeSpectra> &spectra)
+{
+  for(unsigned int i = 0; i < spectra.size(); i++)
+  {
+    const int imzML_ID = spectra[i].imzML_ID;
+    for(int j = 0; j < mass.length(); j++)
+    {
+      acumulatedSpectrum[imzML_ID][j] += spectra[i].sum[j];  
+      baseSpectrum[imzML_ID][j] = spectra[i].max[j] > baseSpectrum[imzML_ID][j] ? spectra[i].max[j] : baseSpectrum[imzML_ID][j];
+    }
+  }
+}
+
+double *CrMSIDataCubeIO::getSpectrum(DataCube *data_ptr, int row, double *buffer)
+{
+  if(!bFloat32)
+  {
+    return data_ptr->dataInterpolated[row];
+  }
+  
+  const float *src = data_ptr->dataInterpolatedFloat[row];
+  for(int k = 0; k < data_ptr->ncols; k++)
+  {
+    buffer[k] = src[k];
+  }
+  return buffer;
+}
+
+void CrMSIDataCubeIO::setSpectrum(DataCube *data_ptr, int row, const double *spectrum)
+{
+  if(!bFloat32)
+  {
+    if(spectrum != data_ptr->dataInterpolated[row])
+    {
+      std::copy(spectrum, spectrum + data_ptr->ncols, data_ptr->dataInterpolated[row]);
+    }
+    return;
+  }
+  
+  float *dst = data_ptr->dataInterpolatedFloat[row];
+  for(int k = 0; k < data_ptr->ncols; k++)
+  {
+    dst[k] = (float)spectrum[k];
+  }
+}
+
+void CrMSIDataCubeIO::interpolateSpectrum(DataCube *data_ptr, int row, double *out)
+{
+  imzMLReaders[getImageIndex(data_ptr->cubeID, row)]->InterpolateSpectrum( &(data_ptr->dataOriginal[row]), 0, mass.length(), out);
+}
+
+bool CrMSIDataCubeIO::get_float32DataCubes()
+{
+  return bFloat32;
 }
 
 int CrMSIDataCubeIO::getNumberOfCubes()
@@ -473,6 +1144,16 @@ unsigned int CrMSIDataCubeIO::get_images_count()
  return imzMLReaders.size();
 }
 
+double CrMSIDataCubeIO::getCubeMemoryMB(int iCube)
+{
+  if(iCube >= (int)dataCubesBytes.size())
+  {
+    throw std::runtime_error("Error: DataCube index out of range\n");
+  }
+  
+  return dataCubesBytes[iCube]/(1024.0*1024.0);
+}
+
 int CrMSIDataCubeIO::getImageIndex(int iCube, int cubeRow)
 {
   if(iCube >= dataCubesDesc.size())
@@ -557,3 +1238,35 @@ bool CrMSIDataCubeIO::get_all_peakLists_are_rMSIformated()
   return rMSIpeakListFormated;
 }
 
+
+//' Testing the data cubes partition
+//' Returns the number of pixels of each data cube used to read the given images with their spectra interpolated to a common mass axis.
+//' @param rMSIObj_list: a list of rMSI objects with the imzML data.
+//' @param memoryPerThreadMB: memory limit of each data cube.
+//' @param commonMassAxis: the common mass axis used to process all the images.
+//' @param float32DataCubes: true to keep the interpolated spectra as float32.
+// [[Rcpp::export(name=".debug_dataCubesRows")]]
+Rcpp::IntegerVector testingDataCubesRows(Rcpp::List rMSIObj_list, double memoryPerThreadMB, Rcpp::NumericVector commonMassAxis, bool float32DataCubes = false)
+{
+  Rcpp::IntegerVector cubeRows;
+  try
+  {
+    CrMSIDataCubeIO dataCubes(commonMassAxis, memoryPerThreadMB, DataCubeIOMode::DATA_READ, "", float32DataCubes);
+    for(int i = 0; i < rMSIObj_list.length(); i++)
+    {
+      dataCubes.appedImageData(rMSIObj_list[i]);
+    }
+    
+    cubeRows = Rcpp::IntegerVector(dataCubes.getNumberOfCubes());
+    for(int i = 0; i < cubeRows.length(); i++)
+    {
+      cubeRows[i] = dataCubes.getNumberOfPixelsInCube(i);
+    }
+  }
+  catch(std::runtime_error &e)
+  {
+    Rcpp::stop(e.what());
+  }
+  
+  return cubeRows;
+}
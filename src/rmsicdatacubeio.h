@@ -19,6 +19,9 @@
   #define RMSI_DATA_CUBE_IO_H
 
 #include <string>
+#include <mutex>
+#include <list>
+#include <map>
 #include <Rcpp.h>
 #include "imzMLBin.h"
 #include "peakpicking.h" //needed for peak list definition
@@ -35,6 +38,18 @@
 //This is the case for peak binning first stage where only peak lists are accessed. 
 //The default value of a thousand is a good trade of to maximize parallelization.
 
+#define DATACUBE_ALIGNMENT 64
+//Byte alignment of the interpolated data in a data cube. Each row starts at a multiple of this value so vectorized loops operate on full cache lines.
+
+#define MAX_OPENED_IMZML_FILES 64
+//Maximum number of imzML files (readers and writers) kept opened by the file cache between cubes, the least recently used ones are closed when it is reached.
+//It is a fixed limit. Files in use are never closed, so it may be exceeded temporarily.
+
+#define CUBE_READ_MERGE_GAP 65536
+#define CUBE_READ_MAX_BYTES 16777216
+//The pixels of a data cube are read in ibd file order and their byte ranges are merged in a single read request when the gap between them
+//is below CUBE_READ_MERGE_GAP bytes. A request never grows over CUBE_READ_MAX_BYTES unless a single pixel is larger.
+
 typedef enum DataCubeIOMode
 {
   DATA_READ, //Read spectral data with interpolation to the common mass axis
@@ -52,10 +67,12 @@ class CrMSIDataCubeIO
     // - massAxis: The common mass axis for all the data.
     // - cubeMemoryLimitMB: Memory limit for the interpolated spectra in a cube, thus the acutal used memory can be higher due to stored data as-is in the imzML.
     // - dataModeEnum: set the data store mode.
-    CrMSIDataCubeIO(Rcpp::NumericVector massAxis, double cubeMemoryLimitMB, DataCubeIOMode dataModeEnum, Rcpp::String imzMLOutputPath = "");
+    // - float32DataCubes: store the interpolated spectra as float32, so a cube holds twice the rows for the same memory limit.
+    CrMSIDataCubeIO(Rcpp::NumericVector massAxis, double cubeMemoryLimitMB, DataCubeIOMode dataModeEnum, Rcpp::String imzMLOutputPath = "", bool float32DataCubes = false);
     ~CrMSIDataCubeIO();
     
     //Struct to define a whole data cube in memory
+    //The interpolated rows are views to a single contiguous block, so a cube is allocated with a few calls and can be reused to load other cubes.
     typedef struct
     {
       int cubeID;
@@ -63,7 +80,16 @@ class CrMSIDataCubeIO
       int nrows;
       imzMLSpectrum *dataOriginal; //Pointer to multiple imzMLSpectrum structs 
       PeakPicking::Peaks **peakLists; //Pointer to the peaklists assosiated with a datacube
-      double **dataInterpolated;   
+      double **dataInterpolated; //Pointers to each row in dataBlock, null for float32 data cubes
+      float **dataInterpolatedFloat; //Pointers to each row in dataBlock for float32 data cubes, null otherwise
+      char *dataBlock; //Contiguous storage of the interpolated data aligned to DATACUBE_ALIGNMENT bytes
+      char *dataBlockAlloc; //Unaligned allocation containing dataBlock
+      int rowStride; //Number of values between consecutive rows in dataBlock, ncols padded to DATACUBE_ALIGNMENT bytes
+      int maxRows; //Number of rows that fit in the allocated storage
+      unsigned int readRanges; //Number of pixel byte ranges read by the last load
+      unsigned long fileReads; //Read calls to the ibd files made by the last load, zero for memory mapped files
+      double fileReadBytes; //Bytes read by those calls
+      double mappedBytes; //Bytes accessed through memory mapped files by the last load
     } DataCube;
     
     //Appends an image to be processed.
@@ -73,17 +99,49 @@ class CrMSIDataCubeIO
     void appedImageData(Rcpp::List rMSIOoj,  std::string outputImzMLuuid = "", std::string outputImzMLfname = "");
     
     //Loads a data cube specified by iCube into data_ptr
-    //WARNING: This is not a thread-safe method, it must be only used on the main thread who'll take care of loading data from HDD and copy it to other thread mem space.
+    //This method is thread-safe, so each worker thread can load its own data cube using positional reads.
     //It returns a pointer to an allocated structure containing the datacube.
     //It is responisability of user to free memmory of the loaded datacube using freeDataCube() function.
-    DataCube *loadDataCube( int iCube);
+    //If reuse is provided, the storage of a previously released cube is used (and grown if needed) instead of allocating a new one,
+    //then the same pointer is returned. On error a reused cube is left released and the caller keeps its ownership.
+    DataCube *loadDataCube( int iCube, DataCube *reuse = nullptr);
+    
+    //Drops the contents of a loaded cube keeping its storage to be reused in a later loadDataCube() call
+    void releaseDataCube(DataCube *data_ptr);
     void freeDataCube(DataCube *data_ptr);
     
     //Execute the interpolation for a thread
     void interpolateDataCube(DataCube *data_ptr);
     
-    //Stores a datacube to the path assosiated with its ID
-    void storeDataCube(DataCube *data_ptr);
+    //Sum and max of the spectra of an imzML in a single cube, they are added to the average and base spectra in cube order
+    typedef struct
+    {
+      int imzML_ID;
+      std::vector<double> sum;
+      std::vector<double> max;
+    } CubeSpectra;
+    
+    //Writes a processed cube to the output ibd files at offsets reserved for its pixels. It can be called from multiple threads in any cube order.
+    //The space of processed mode pixels is reserved in cube order, so the output ibd files do not depend on the order the cubes are completed.
+    //A cube completed before the previous ones is staged and then written by the thread that reserves its space.
+    //In DATA_STORE mode the sum and max spectra of the cube are returned in spectra, they must be added with addCubeSpectra() in cube order.
+    void writeDataCube(DataCube *data_ptr, std::vector<CubeSpectra> &spectra);
+    
+    //Add the spectra of a cube to the average and base spectra
+    void addCubeSpectra(const std::vector<CubeSpectra> &spectra);
+    
+    //Returns a pointer to the interpolated spectrum of a cube row.
+    //Rows of float32 data cubes are converted into buffer, which must hold ncols values, and buffer is returned.
+    double *getSpectrum(DataCube *data_ptr, int row, double *buffer);
+    
+    //Copies back a spectrum obtained with getSpectrum() after modifying it. Nothing is done if it points directly to the cube row.
+    void setSpectrum(DataCube *data_ptr, int row, const double *spectrum);
+    
+    //Interpolates the original spectrum of a cube row to the common mass axis as it is done when the cube is loaded. out must hold ncols values.
+    void interpolateSpectrum(DataCube *data_ptr, int row, double *out);
+    
+    //Return true if the interpolated spectra are stored as float32
+    bool get_float32DataCubes();
     
     //Return the total number of cubes in the ramdisk
     int getNumberOfCubes();
@@ -94,6 +152,13 @@ class CrMSIDataCubeIO
     //Return the total number of pixels in each cube
     int getNumberOfPixelsInCube(int iCube);
     
+    //Return the estimated memory used by a cube in MB, including the original spectra kept until they are interpolated
+    double getCubeMemoryMB(int iCube);
+    
+    //Close all the imzML files kept opened by the file cache, so the written data is flushed. It must not be called while cubes are loaded or stored.
+    //The cube order of writeDataCube() starts over and the cubes staged after an aborted run are discarded.
+    void closeImzMLFiles();
+    
     //Return the image index (imzMLreader/writer for a given pixels specified as cube id and pixel row)
     int getImageIndex(int iCube, int cubeRow);
     
@@ -120,8 +185,10 @@ class CrMSIDataCubeIO
 
   private:
     DataCubeIOMode dataMode; //An enum to set the data mode.
+    bool bFloat32; //Interpolated spectra are stored as float32 in the data cubes
     std::string dataOutputPath; //A path to save output imzML data
     unsigned int cubeMaxNumRows; //The maximum rows in a datacube calculated from the maximum memory allowed by each cube and the mass axis length.
+    double cubeMaxBytes; //The maximum memory allowed by each cube, a cube is closed once its estimated memory reaches it
     Rcpp::NumericVector mass; //A common mass axis for all images to process
     std::vector<ImzMLBinRead*> imzMLReaders;  //Pointers to multiple imzMLReadrs initialized with openIbd = false to avoid exiding the maximum open files.
     std::vector<ImzMLBinWrite*> imzMLWriters; //Pointers to multiple imzMLWriters initialized with openIbd = false to avoid exiding the maximum open files.
@@ -131,6 +198,88 @@ class CrMSIDataCubeIO
     
     unsigned int next_peakMatrix_row; //A counter to follow added peak matrix rows
     
+    //File cache: the imzML files are kept opened between cubes and only the least recently used ones are closed when the limit is reached
+    enum ImzMLFileType { SPECTRA_READER, PEAKS_READER, WRITER }; //The writers are opened for concurrent writing at reserved offsets
+    typedef struct
+    {
+      ImzMLFileType type;
+      int imzML_ID;
+      unsigned int usageCount; //Number of data cubes currently using the file, it can not be closed until it reaches zero
+    } OpenedFile;
+    std::list<OpenedFile> openedFiles; //Opened files sorted from the most to the least recently used
+    std::mutex filesMutex; //Protects the file cache shared between threads
+    
+    //Open a file if it is not in the cache and mark it as used
+    void acquireImzMLFile(ImzMLFileType type, int imzML_ID);
+    
+    //Mark a file as not used, it is kept opened in the cache
+    void releaseImzMLFile(ImzMLFileType type, int imzML_ID);
+    
+    //Open and close an imzML file of the cache
+    void openImzMLFile(ImzMLFileType type, int imzML_ID);
+    void closeImzMLFile(ImzMLFileType type, int imzML_ID);
+    
+    //Acquire and release the imzML readers (spectral and/or peak list) for the given imzML_ID
+    void acquireImzMLReaders(int imzML_ID);
+    void releaseImzMLReaders(int imzML_ID);
+    
+    //Acquire and release the imzML writer for the given imzML_ID
+    void acquireImzMLWriter(int imzML_ID);
+    void releaseImzMLWriter(int imzML_ID);
+    
+    //Ensure the storage of a data cube can hold nrows rows, growing its buffers if needed
+    void allocateDataCube(DataCube *data_ptr, int nrows);
+    
+    //Byte ranges of the pixels of a cube in the ibd files of a set of readers, sorted and merged in read requests
+    typedef struct
+    {
+      std::vector<int> rowOrder; //Rows of the cube sorted by imzML and offset
+      std::vector<int> rowRequest; //Index of the request containing each row
+      std::vector<std::streamoff> requestBegin;
+      std::vector<std::streamoff> requestEnd;
+    } CubeReadPlan;
+    
+    //Compute the read plan of a cube using the offsets of the given readers
+    void planCubeReads(int iCube, std::vector<ImzMLBinRead*> &readers, CubeReadPlan &plan);
+    
+    //Issue the read request containing a row if it is not the current one
+    void prefetchCubeRow(ImzMLBinRead *reader, const CubeReadPlan &plan, int row, int &currentRequest, DataCube *data_ptr);
+    
+    //Compute the sum and max spectra of each imzML in a cube
+    void accumulateCubeSpectra(DataCube *data_ptr, std::vector<CubeSpectra> &spectra);
+    
+    //Output of a processed cube kept in memory until the space of its pixels is reserved, so the cube storage can be reused meanwhile
+    typedef struct
+    {
+      int cubeID;
+      std::vector<double> values; //Values to write of all rows concatenated
+      std::vector<size_t> rowOffsets; //Start of each row in values, the last element is the length of values
+    } StagedCube;
+    
+    //Reservation of the processed mode pixels written with writeDataCube(), they are reserved in cube order so the ibd files are reproducible
+    std::mutex reserveMutex; //Protects the members below
+    int nextCubeReserve; //Next cube to reserve
+    std::map<int, std::vector<unsigned int>> pendingRowLengths; //Length of the rows of the cubes written ahead of nextCubeReserve
+    std::map<int, StagedCube*> pendingCubes; //Rows of the cubes completed before their space was reserved
+    
+    //Returns true if a cube row is written in a space reserved in cube order (processed mode spectra and peak lists)
+    bool isReservedRow(int iCube, int cubeRow);
+    
+    //Reserve the space of the pending cubes that follow nextCubeReserve. The staged ones are appended to reservedCubes to be written. reserveMutex must be locked.
+    void reservePendingCubes(std::vector<StagedCube*> &reservedCubes);
+    
+    //Copies the reserved rows of a cube to a StagedCube, the other rows are left empty
+    StagedCube *stageReservedRows(DataCube *data_ptr);
+    
+    //Writes the reserved rows of a cube. Each row is given as 5 pointers to its mass, intensity, area, SNR and bin size (only the first two in DATA_STORE mode)
+    void writeReservedRows(int iCube, const std::vector<unsigned int> &rowLengths, const std::vector<double*> &rowData);
+    
+    //Writes the rows of a staged cube whose space has been reserved and deletes it
+    void writeReservedStagedCube(StagedCube *staged);
+    
+    //Discards the reservation state and the staged cubes
+    void clearPendingCubes();
+    
     //Struct to internally handle data cube accessors
     typedef struct
     {
@@ -142,6 +291,7 @@ class CrMSIDataCubeIO
     typedef std::vector<PixelDescription> DataCubeDescription; //Each data cube is defined as standard vector of pixel descriptions
     
     std::vector<DataCubeDescription> dataCubesDesc; //A vector to describe all data cubes in the data set
+    std::vector<double> dataCubesBytes; //Estimated memory used by each data cube in bytes
 };
 
 #endif
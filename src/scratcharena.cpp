@@ -0,0 +1,112 @@
+/*************************************************************************
+ *     rMSIproc - R package for MSI data processing
+ *     Copyright (C) 2014 Pere Rafols Soler
+ * 
+ *     This program is free software: you can redistribute it and/or modify
+ *     it under the terms of the GNU General Public License as published by
+ *     the Free Software Foundation, either version 3 of the License, or
+ *     (at your option) any later version.
+ * 
+ *     This program is distributed in the hope that it will be useful,
+ *     but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *     MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *     GNU General Public License for more details.
+ * 
+ *     You should have received a copy of the GNU General Public License
+ *     along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ **************************************************************************/
+
+#include <Rcpp.h>
+#include "scratcharena.h"
+
+#define SCRATCH_ALIGNMENT 16 //All buffers are aligned to 16 bytes, enough for double and SSE data
+
+std::atomic<unsigned long> ScratchArena::allocCounter(0);
+
+ScratchArena::ScratchArena():
+  block(nullptr), capacity(0), used(0), demand(0), peakDemand(0)
+{
+  
+}
+
+ScratchArena::~ScratchArena()
+{
+  for(unsigned int i = 0; i < overflowBlocks.size(); i++)
+  {
+    delete[] overflowBlocks[i];
+  }
+  delete[] block;
+}
+
+ScratchArena &ScratchArena::threadArena()
+{
+  static thread_local ScratchArena arena;
+  return arena;
+}
+
+unsigned long ScratchArena::allocationCount()
+{
+  return allocCounter.load();
+}
+
+void *ScratchArena::allocBytes(size_t bytes)
+{
+  bytes = ((bytes + SCRATCH_ALIGNMENT - 1) / SCRATCH_ALIGNMENT) * SCRATCH_ALIGNMENT;
+  demand += bytes;
+  peakDemand = demand > peakDemand ? demand : peakDemand;
+  
+  if( (used + bytes) <= capacity )
+  {
+    void *ptr = block + used;
+    used += bytes;
+    return ptr;
+  }
+  
+  //The main block is full, use a dedicated block until the arena is empty again
+  overflowBlocks.push_back(new char[bytes]);
+  overflowSizes.push_back(bytes);
+  allocCounter++;
+  return overflowBlocks.back();
+}
+
+void ScratchArena::release(size_t usedMark, size_t overflowMark)
+{
+  while(overflowBlocks.size() > overflowMark)
+  {
+    demand -= overflowSizes.back();
+    delete[] overflowBlocks.back();
+    overflowBlocks.pop_back();
+    overflowSizes.pop_back();
+  }
+  demand -= (used - usedMark);
+  used = usedMark;
+  
+  //Once empty, grow the main block to hold the peak demand so the next spectrum does not need any allocation
+  if(demand == 0 && peakDemand > capacity)
+  {
+    delete[] block;
+    block = new char[peakDemand];
+    capacity = peakDemand;
+    allocCounter++;
+  }
+}
+
+ScratchArena::Scope::Scope():
+  arena(ScratchArena::threadArena())
+{
+  markUsed = arena.used;
+  markOverflow = arena.overflowBlocks.size();
+}
+
+ScratchArena::Scope::~Scope()
+{
+  arena.release(markUsed, markOverflow);
+}
+
+//' Testing the scratch arenas
+//' Returns the number of heap allocations performed by the scratch arenas of all threads since the package was loaded.
+// [[Rcpp::export(name=".debug_scratchArenaAllocations")]]
+double testingScratchArenaAllocations()
+{
+  return (double)ScratchArena::allocationCount();
+}
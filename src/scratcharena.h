@@ -0,0 +1,76 @@
+/*************************************************************************
+ *     rMSIproc - R package for MSI data processing
+ *     Copyright (C) 2014 Pere Rafols Soler
+ * 
+ *     This program is free software: you can redistribute it and/or modify
+ *     it under the terms of the GNU General Public License as published by
+ *     the Free Software Foundation, either version 3 of the License, or
+ *     (at your option) any later version.
+ * 
+ *     This program is distributed in the hope that it will be useful,
+ *     but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *     MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *     GNU General Public License for more details.
+ * 
+ *     You should have received a copy of the GNU General Public License
+ *     along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ **************************************************************************/
+#ifndef SCRATCH_ARENA_H
+  #define SCRATCH_ARENA_H
+
+#include <cstddef>
+#include <vector>
+#include <atomic>
+
+//Per-thread scratch memory for the temporary buffers used in the spectrum processing hot paths.
+//Buffers are taken from a single block that is reused for every spectrum, so once the block has grown to the
+//largest demand no more heap allocations are performed.
+class ScratchArena
+{
+  public:
+    //Scoped access to the arena of the calling thread.
+    //All buffers obtained through a Scope are released when it is destroyed, so scopes can be nested as a stack.
+    class Scope
+    {
+      public:
+        Scope();
+        ~Scope();
+        
+        //Returns an uninitialized buffer of N elements valid until the Scope is destroyed
+        template<typename T> T* alloc(size_t N)
+        {
+          return (T*)arena.allocBytes(N * sizeof(T));
+        }
+        
+      private:
+        ScratchArena &arena;
+        size_t markUsed; //Bytes used in the main block when the scope was created
+        size_t markOverflow; //Number of overflow blocks when the scope was created
+    };
+    
+    //Number of heap allocations performed by all the arenas since the package was loaded.
+    //It remains constant during the steady state processing.
+    static unsigned long allocationCount();
+    
+  private:
+    ScratchArena();
+    ~ScratchArena();
+    
+    //Returns the arena of the calling thread
+    static ScratchArena &threadArena();
+    
+    void *allocBytes(size_t bytes);
+    void release(size_t used, size_t overflowCount);
+    
+    char *block; //Main block, buffers are taken from it in stack order
+    size_t capacity; //Size of the main block in bytes
+    size_t used; //Bytes used in the main block
+    std::vector<char*> overflowBlocks; //Blocks allocated when the main block was full
+    std::vector<size_t> overflowSizes; //Size of each overflow block
+    size_t demand; //Current number of bytes in use including the overflow blocks
+    size_t peakDemand; //Maximum number of bytes used at once, the main block grows to it when the arena is empty
+    
+    static std::atomic<unsigned long> allocCounter;
+};
+
+#endif
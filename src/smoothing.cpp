@@ -19,6 +19,7 @@
 #include <Rcpp.h>
 #include <vector>
 #include "smoothing.h"
+#include "scratcharena.h"
 #include "mlinterp.hpp" //Used for linear interpolation
 using namespace Rcpp;
 
@@ -124,7 +125,8 @@ NumericVector Smoothing::smoothSavitzkyGolay(NumericVector x)
 void Smoothing::smoothSavitzkyGolay(double *x, int length)
 {
   //Convolution with SavitzkyGolay kernel
-  double *y = new double[length];
+  ScratchArena::Scope scratch;
+  double *y = scratch.alloc<double>(length);
   for( int i = 0; i < length; i++)
   {
     y[i] = 0; //Init a zero
@@ -139,7 +141,6 @@ void Smoothing::smoothSavitzkyGolay(double *x, int length)
   
   //Overwrite input pointer
   memcpy(x, y, sizeof(double)*length);
-  delete[] y;
 }
 
 //Smooth a given spectrum and interpolate it to imzML processed mode. 
@@ -0,0 +1,145 @@
+/*************************************************************************
+ *     rMSIproc - R package for MSI data processing
+ *     Copyright (C) 2014 Pere Rafols Soler
+ * 
+ *     This program is free software: you can redistribute it and/or modify
+ *     it under the terms of the GNU General Public License as published by
+ *     the Free Software Foundation, either version 3 of the License, or
+ *     (at your option) any later version.
+ * 
+ *     This program is distributed in the hope that it will be useful,
+ *     but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *     MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *     GNU General Public License for more details.
+ * 
+ *     You should have received a copy of the GNU General Public License
+ *     along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ **************************************************************************/
+#include <Rcpp.h>
+#include <stdexcept>
+#include "sparsepeakmatrix.h"
+using namespace Rcpp;
+
+SparsePeakMatrix::SparsePeakMatrix(unsigned int numRows, unsigned int numCols):
+  nrows(numRows), ncols(numCols), rows(numRows)
+{
+  
+}
+
+SparsePeakMatrix::~SparsePeakMatrix()
+{
+  
+}
+
+void SparsePeakMatrix::setValue(unsigned int row, unsigned int col, double intensity, double snr, double area)
+{
+  if(row >= nrows || col >= ncols)
+  {
+    throw std::runtime_error("Error: SparsePeakMatrix index out of range\n");
+  }
+  
+  if(intensity == 0.0 && snr == 0.0 && area == 0.0)
+  {
+    return; //Zeros are implicit
+  }
+  
+  SparseEntry entry;
+  entry.col = col;
+  entry.intensity = intensity;
+  entry.snr = snr;
+  entry.area = area;
+  rows[row].push_back(entry);
+}
+
+List SparsePeakMatrix::exportToR()
+{
+  //Row pointers are stored as doubles since the number of non-zero entries may not fit in an R integer
+  NumericVector rowPtr(nrows + 1);
+  R_xlen_t nnz = 0;
+  for(unsigned int i = 0; i < nrows; i++)
+  {
+    rowPtr[i] = (double)nnz;
+    nnz += rows[i].size();
+  }
+  rowPtr[nrows] = (double)nnz;
+  
+  IntegerVector colIdx(nnz);
+  NumericVector intensity(nnz);
+  NumericVector snr(nnz);
+  NumericVector area(nnz);
+  R_xlen_t k = 0;
+  for(unsigned int i = 0; i < nrows; i++)
+  {
+    for(unsigned int j = 0; j < rows[i].size(); j++)
+    {
+      colIdx[k] = rows[i][j].col;
+      intensity[k] = rows[i][j].intensity;
+      snr[k] = rows[i][j].snr;
+      area[k] = rows[i][j].area;
+      k++;
+    }
+    std::vector<SparseEntry>().swap(rows[i]); //Release memory as soon as possible
+  }
+  
+  //The three matrices share the same row pointers and column indices vectors
+  IntegerVector dims = IntegerVector::create(nrows, ncols);
+  List intensityMat = List::create( Named("dim") = dims, Named("p") = rowPtr, Named("j") = colIdx, Named("x") = intensity);
+  List snrMat = List::create( Named("dim") = dims, Named("p") = rowPtr, Named("j") = colIdx, Named("x") = snr);
+  List areaMat = List::create( Named("dim") = dims, Named("p") = rowPtr, Named("j") = colIdx, Named("x") = area);
+  intensityMat.attr("class") = "rMSIprocSparseMatrix";
+  snrMat.attr("class") = "rMSIprocSparseMatrix";
+  areaMat.attr("class") = "rMSIprocSparseMatrix";
+  
+  return List::create( Named("intensity") = intensityMat, Named("SNR") = snrMat, Named("area") = areaMat);
+}
+
+//' CSparsePeakMatrixSlice.
+//' 
+//' Materializes a slice of a rMSIprocSparseMatrix as a dense matrix.
+//' 
+//' @param sparseMat an rMSIprocSparseMatrix object.
+//' @param rows the rows to extract (R style indices beginning at 1).
+//' @param cols the columns to extract (R style indices beginning at 1).
+//' 
+//' @return a NumericMatrix with the selected rows and columns.
+// [[Rcpp::export]]
+NumericMatrix CSparsePeakMatrixSlice(List sparseMat, IntegerVector rows, IntegerVector cols)
+{
+  IntegerVector dims = sparseMat["dim"];
+  NumericVector rowPtr = sparseMat["p"];
+  IntegerVector colIdx = sparseMat["j"];
+  NumericVector values = sparseMat["x"];
+  
+  //Map each matrix column to the output columns, duplicated columns are chained
+  std::vector<int> firstOutCol(dims[1], -1);
+  std::vector<int> nextOutCol(cols.length(), -1);
+  for(int i = cols.length() - 1; i >= 0; i--)
+  {
+    if(cols[i] < 1 || cols[i] > dims[1])
+    {
+      Rcpp::stop("Error: column index out of range\n");
+    }
+    nextOutCol[i] = firstOutCol[cols[i] - 1];
+    firstOutCol[cols[i] - 1] = i;
+  }
+  
+  NumericMatrix out(rows.length(), cols.length());
+  for(int i = 0; i < rows.length(); i++)
+  {
+    if(rows[i] < 1 || rows[i] > dims[0])
+    {
+      Rcpp::stop("Error: row index out of range\n");
+    }
+    R_xlen_t start = (R_xlen_t)rowPtr[rows[i] - 1];
+    R_xlen_t end = (R_xlen_t)rowPtr[rows[i]];
+    for(R_xlen_t k = start; k < end; k++)
+    {
+      for(int icol = firstOutCol[colIdx[k]]; icol >= 0; icol = nextOutCol[icol])
+      {
+        out(i, icol) = values[k];
+      }
+    }
+  }
+  
+  return out;
+}
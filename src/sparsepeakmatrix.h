@@ -0,0 +1,63 @@
+/*************************************************************************
+ *     rMSIproc - R package for MSI data processing
+ *     Copyright (C) 2014 Pere Rafols Soler
+ * 
+ *     This program is free software: you can redistribute it and/or modify
+ *     it under the terms of the GNU General Public License as published by
+ *     the Free Software Foundation, either version 3 of the License, or
+ *     (at your option) any later version.
+ * 
+ *     This program is distributed in the hope that it will be useful,
+ *     but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *     MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *     GNU General Public License for more details.
+ * 
+ *     You should have received a copy of the GNU General Public License
+ *     along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ **************************************************************************/
+#ifndef SPARSE_PEAK_MATRIX_H
+  #define SPARSE_PEAK_MATRIX_H
+
+#include <Rcpp.h>
+#include <vector>
+
+/********************************************************************************
+ *  SparsePeakMatrix: A C++ class to build the peak matrix in sparse format
+ *  
+ *  Only the non-zero values of the intensity, SNR and area matrices are kept.
+ *  Each row (pixel) is filled independently, so multiple threads can fill different 
+ *  rows at the same time. Finally, the matrices are exported to R in compressed 
+ *  sparse row (CSR) format as rMSIprocSparseMatrix objects sharing the same sparsity pattern.
+ ********************************************************************************/
+class SparsePeakMatrix
+{
+  public:
+    // Constructor Arguments:
+    // - numRows: number of rows (pixels) in the peak matrix.
+    // - numCols: number of columns (mass channels) in the peak matrix.
+    SparsePeakMatrix(unsigned int numRows, unsigned int numCols);
+    ~SparsePeakMatrix();
+    
+    //Sets the values of a peak matrix entry. Zero entries are not stored.
+    //Each row must be filled from a single thread and with columns in ascending order.
+    void setValue(unsigned int row, unsigned int col, double intensity, double snr, double area);
+    
+    //Compact all rows in CSR format and return a list with the intensity, SNR and area rMSIprocSparseMatrix objects.
+    //It must be called from the main thread since R objects are created.
+    Rcpp::List exportToR();
+    
+  private:
+    typedef struct
+    {
+      unsigned int col;
+      double intensity;
+      double snr;
+      double area;
+    } SparseEntry;
+    
+    unsigned int nrows;
+    unsigned int ncols;
+    std::vector<std::vector<SparseEntry>> rows; //The non-zero entries of each row sorted by column
+};
+
+#endif
@@ -19,11 +19,16 @@
 #include "threadingmsiproc.h" 
 #include "progressbar.h"
 #include <stdexcept>
+#include <algorithm>
+#include <chrono>
+#include <iomanip>
+#include <map>
 
 //#define __DEBUG__ // comment out in the final release!
 
 ThreadingMsiProc::ThreadingMsiProc(Rcpp::List rMSIObj_list, int numberOfThreads, double memoryPerThreadMB, Rcpp::NumericVector commonMassAxis,
-                                   DataCubeIOMode storeDataModeimzml, Rcpp::StringVector uuid, Rcpp::String outputImzMLPath, Rcpp::StringVector outputImzMLfnames):
+                                   DataCubeIOMode storeDataModeimzml, Rcpp::StringVector uuid, Rcpp::String outputImzMLPath, Rcpp::StringVector outputImzMLfnames,
+                                   bool float32DataCubes):
   dataStoreMode(storeDataModeimzml), massAxis(commonMassAxis)
 {
   if( (dataStoreMode == DataCubeIOMode::DATA_STORE) || (dataStoreMode == DataCubeIOMode::PEAKLIST_STORE) )
@@ -52,7 +57,7 @@ ThreadingMsiProc::ThreadingMsiProc(Rcpp::List rMSIObj_list, int numberOfThreads,
   }
   
   numOfThreadsDouble = 2*numberOfThreads;
-  ioObj = new CrMSIDataCubeIO( massAxis, memoryPerThreadMB, dataStoreMode, outputImzMLPath);
+  ioObj = new CrMSIDataCubeIO( massAxis, memoryPerThreadMB, dataStoreMode, outputImzMLPath, float32DataCubes && massAxis.length() > 0);
   
   //Call the append method for each image in the list
   for(int i = 0; i < rMSIObj_list.length(); i++)
@@ -69,11 +74,23 @@ ThreadingMsiProc::ThreadingMsiProc(Rcpp::List rMSIObj_list, int numberOfThreads,
     }
   }
   
-  cubes = new CrMSIDataCubeIO::DataCube*[numOfThreadsDouble];
+  cubes = new CrMSIDataCubeIO::DataCube*[numOfThreadsDouble](); //Each slot keeps its cube storage between cubes, it is allocated on the first load
   iCube = new int[numOfThreadsDouble];
-  bDataReady = new bool[numOfThreadsDouble];
-  bRunningThread = new bool[numOfThreadsDouble];
-  tworkers = new std::thread[numOfThreadsDouble]; //There will be double of thread objects than the actually running threads
+  threadException = new std::exception_ptr[numOfThreadsDouble];
+  bPoolStop = false;
+  nextCubeStore = 0;
+  nextCubeLoad = 0;
+  numCubesToLoad = 0;
+  bAbortRun = false;
+  bReaderBusy = false;
+  workQueues.resize(numberOfThreads);
+  numLoadedSlots = 0;
+  bOrderedStore = (dataStoreMode == DataCubeIOMode::DATA_STORE) || (dataStoreMode == DataCubeIOMode::PEAKLIST_STORE);
+  cubeSpectra.resize(numOfThreadsDouble);
+  if(ioObj->get_float32DataCubes())
+  {
+    spectrumBuffers.resize(numOfThreadsDouble, std::vector<double>(massAxis.length()));
+  }
   
   numPixels = 0;
   for (int i = 0; i < ioObj->getNumberOfCubes(); i++)
@@ -85,189 +102,358 @@ ThreadingMsiProc::ThreadingMsiProc(Rcpp::List rMSIObj_list, int numberOfThreads,
 
 ThreadingMsiProc::~ThreadingMsiProc()
 {
+  //End the reader and worker threads
+  poolMutex.lock();
+  bPoolStop = true;
+  poolMutex.unlock();
+  workAvailable_cond.notify_all();
+  slotFree_cond.notify_all();
+  if(readerThread.joinable())
+  {
+    readerThread.join();
+  }
+  for(unsigned int i = 0; i < poolWorkers.size(); i++)
+  {
+    poolWorkers[i].join();
+  }
+  
+  for(int i = 0; i < numOfThreadsDouble; i++)
+  {
+    if(cubes[i] != nullptr)
+    {
+      ioObj->freeDataCube(cubes[i]);
+    }
+  }
   delete[] cubes;
   delete[] iCube;
-  delete[] bDataReady;
-  delete[] bRunningThread;
-  delete[] tworkers; 
+  delete[] threadException;
   delete ioObj;
 }
 
+void ThreadingMsiProc::StartThreadPool()
+{
+  if(poolWorkers.size() > 0)
+  {
+    return; //Already running
+  }
+  
+  int numOfThreads = numOfThreadsDouble/2;
+  for(int i = 0; i < numOfThreads; i++)
+  {
+    poolWorkers.push_back(std::thread(std::bind(&ThreadingMsiProc::WorkerLoop, this, i)));
+  }
+  readerThread = std::thread(&ThreadingMsiProc::ReaderLoop, this);
+}
+
 void ThreadingMsiProc::runMSIProcessingCpp()
 {
-  //Initialize processing data cube
-  life_end = false;
-  for( int i = 0; i < numOfThreadsDouble; i++)
+  int numOfCubes = ioObj->getNumberOfCubes();
+  int totalCubes = numOfCubes; //Number of cubes to release, reduced if pending cubes are discarded due to an error
+  int releasedCubes = 0; //Number of cubes already stored and released
+  std::exception_ptr abortException = nullptr; //Set with the first error, then the pending cubes are discarded
+  std::map<int, std::vector<CrMSIDataCubeIO::CubeSpectra>> pendingSpectra; //Spectra of cubes written ahead of the next one to accumulate
+  
+  StartThreadPool();
+  std::unique_lock<std::mutex> lock(poolMutex);
+  
+  //Initialize the data slots
+  freeSlots.clear();
+  for(unsigned int i = 0; i < workQueues.size(); i++)
   {
-    iCube[i] = -1; //-1 means that there is no any cube assigned to worker thread
-    bDataReady[i] = false;
-    bRunningThread[i] = false;
+    workQueues[i].clear();
   }
+  numLoadedSlots = 0;
+  readySlots.clear();
+  for( int i = numOfThreadsDouble - 1; i >= 0; i--)
+  {
+    iCube[i] = -1; //-1 means that there is no any cube assigned to this slot
+    threadException[i] = nullptr;
+    freeSlots.push_back(i);
+  }
+  nextCubeStore = 0;
+  nextCubeLoad = 0;
+  bAbortRun = false;
+  pipelineStats = PipelineStats();
+  cubeProcessingTime.assign(numOfCubes, 0.0);
   
-  int nextCubeLoad = 0; //Point to the next datacube to load
-  int nextCubeStore = 0; //Point to the next datacube to store
-  int runningThreads = 0; //Total number of running threads
-  bool end_of_program = false;
+  //Start the reader, it loads the cubes in order so the next cube to store is never waiting for a slot
+  numCubesToLoad = numOfCubes;
+  slotFree_cond.notify_all();
   
-  while( !end_of_program ) 
+  int nextCubeSpectra = 0; //Next cube whose spectra must be accumulated, copied to nextCubeStore with the lock held
+  while( releasedCubes < totalCubes ) 
   {
-    //Load data for future threads and start working threads
-    for(int iThread = 0; iThread < numOfThreadsDouble; iThread++)
+    //Wait for any processed cube, the workers have already written it in the ordered modes
+    while(readySlots.empty())
+    {
+      std::chrono::steady_clock::time_point waitStart = std::chrono::steady_clock::now();
+      cubeReady_cond.wait(lock);
+      pipelineStats.writerStall += std::chrono::duration<double>(std::chrono::steady_clock::now() - waitStart).count();
+    }
+    pipelineStats.readyDepthSum += readySlots.size();
+    pipelineStats.readyDepthMax = std::max(pipelineStats.readyDepthMax, (unsigned int)readySlots.size());
+    pipelineStats.readySamples++;
+    int iSlot = readySlots.front();
+    readySlots.erase(readySlots.begin());
+    
+    if(threadException[iSlot] && !abortException)
     {
-      if(iCube[iThread] == -1 && nextCubeLoad < ioObj->getNumberOfCubes()) //No cube assigned then no thread running in this slot
+      abortException = threadException[iSlot];
+    }
+    threadException[iSlot] = nullptr;
+    
+    //Release the cube without locking the reader and the workers
+    lock.unlock();
+    if( !abortException && bOrderedStore )
+    {
+      //Only the spectra are accumulated here, in cube order to get the same average in any completion order
+      pendingSpectra[iCube[iSlot]].swap(cubeSpectra[iSlot]);
+      std::map<int, std::vector<CrMSIDataCubeIO::CubeSpectra>>::iterator it;
+      while( (it = pendingSpectra.find(nextCubeSpectra)) != pendingSpectra.end() )
       {
-        progressBar(nextCubeLoad, ioObj->getNumberOfCubes(), "=", " ");
-        iCube[iThread] = nextCubeLoad;
-        nextCubeLoad++;
-        
-#ifdef __DEBUG__
-        Rcpp::Rcout << "DBG: Loading data for cube = " << iCube[iThread] << " on thread " << iThread << "\n";
-#endif
-        cubes[iThread] = ioObj->loadDataCube(iCube[iThread]);
-        if(2*runningThreads < numOfThreadsDouble)
-        {
-          bRunningThread[iThread] = true;
-          tworkers[iThread] = std::thread(std::bind(&ThreadingMsiProc::ProcessingThread, this, iThread)); //Start Thread 
-          runningThreads++;
-        }
-#ifdef __DEBUG__
-        Rcpp::Rcout << "DBG: Started work for cube = " << iCube[iThread] << " on thread " << iThread << "\n";
-#endif
+        ioObj->addCubeSpectra(it->second);
+        pendingSpectra.erase(it);
+        nextCubeSpectra++;
       }
     }
-
-    //Wait for thread ends
-#ifdef __DEBUG__
-    Rcpp::Rcout << "DBG: waiting for some thread...\n"; 
-#endif
-    if(runningThreads > 0 )
+    if(cubes[iSlot] != nullptr)
     {
-      WaitForSomeThreadEnd();
+      ioObj->releaseDataCube(cubes[iSlot]); //The storage is kept in the slot for its next cube
     }
+    releasedCubes++;
+    progressBar(releasedCubes, numOfCubes, "=", " ");
+    lock.lock();
+    
+    if(abortException && !bAbortRun)
+    {
+      //Stop loading new cubes, the ones already assigned to a slot are released without processing
+      bAbortRun = true;
+      totalCubes = nextCubeLoad;
+      workAvailable_cond.notify_all();
+    }
+    
+    iCube[iSlot] = -1;
+    nextCubeStore = nextCubeSpectra;
+    freeSlots.push_back(iSlot);
+    slotFree_cond.notify_one();
+  }
+  numCubesToLoad = 0; //The reader remains idle until the next run
+  PipelineStats runStats = pipelineStats;
+  lock.unlock();
+  
+  //The imzML files are kept opened between cubes, close them so the output files are complete when the run ends
+  ioObj->closeImzMLFiles();
+  
+  Rcpp::Rcout<<"\n";
+  
 #ifdef __DEBUG__
-    Rcpp::Rcout << "DBG: waiting for data mutex...\n";
-#endif
-    mtx.lock(); //Any thread locked to this mutex is actually waiting to save data
-#ifdef __DEBUG__
-    Rcpp::Rcout << "DBG: got the data mutex\n";
+  Rcpp::Rcout << "DBG: MT proc END\n";
 #endif
-    
-    //Update number of running threads
-    for(int iThread = 0; iThread < numOfThreadsDouble; iThread++)
+  
+  //Report how the stages overlapped, a stalled stage waits for the previous one (or for a free slot in the reader case)
+  Rcpp::Rcout << std::fixed << std::setprecision(2);
+  Rcpp::Rcout << "Read-ahead queue depth: mean " << (runStats.loadedSamples > 0 ? (double)runStats.loadedDepthSum/runStats.loadedSamples : 0.0)
+              << ", max " << runStats.loadedDepthMax << ". Reader stalled " << runStats.readerStall << " s waiting for free slots\n";
+  if(runStats.cubesRead > 0)
+  {
+    Rcpp::Rcout << "Reads per cube: " << (double)runStats.readRanges/runStats.cubesRead << " pixel ranges in " << (double)runStats.fileReads/runStats.cubesRead 
+                << " file reads of " << runStats.fileReadBytes/(1024.0*1024.0*runStats.cubesRead) << " MB, " 
+                << runStats.mappedBytes/(1024.0*1024.0*runStats.cubesRead) << " MB accessed through memory maps\n";
+  }
+  Rcpp::Rcout << "Workers stalled " << runStats.workersStall << " s waiting for loaded cubes (summed over " << poolWorkers.size() << " threads), "
+              << runStats.cubesStolen << " cubes stolen from another worker queue\n";
+  Rcpp::Rcout << "Processed queue depth: mean " << (runStats.readySamples > 0 ? (double)runStats.readyDepthSum/runStats.readySamples : 0.0)
+              << ", max " << runStats.readyDepthMax << ". Main thread stalled " << runStats.writerStall << " s waiting for processed cubes\n";
+  
+  //Report the balance of the cubes, the slowest cube delays the end of the run
+  if(numOfCubes > 0)
+  {
+    int iSlowest = std::max_element(cubeProcessingTime.begin(), cubeProcessingTime.end()) - cubeProcessingTime.begin();
+    double totalTime = 0.0;
+    for(int i = 0; i < numOfCubes; i++)
     {
-      runningThreads = 0;
-      if(bRunningThread[iThread])
-      {
-        runningThreads++;
-      }
+      totalTime += cubeProcessingTime[i];
     }
+    Rcpp::Rcout << "Cube processing time: mean " << 1000.0*totalTime/numOfCubes << " ms, max " << 1000.0*cubeProcessingTime[iSlowest] << " ms on cube " << iSlowest 
+                << " (" << ioObj->getNumberOfPixelsInCube(iSlowest) << " pixels, " << ioObj->getCubeMemoryMB(iSlowest) << " MB)\n";
+  }
+  Rcpp::Rcout.unsetf(std::ios_base::floatfield);
+  Rcpp::Rcout << std::setprecision(6);
+  
+  if(abortException)
+  {
+    std::rethrow_exception(abortException);
+  }
+}
+
+double *ThreadingMsiProc::getSpectrum(int threadSlot, int row)
+{
+  return ioObj->getSpectrum(cubes[threadSlot], row, spectrumBuffers.size() > 0 ? spectrumBuffers[threadSlot].data() : nullptr);
+}
 
-    //Start thread that have data loaded ready to be processed
-    for(int iThread = 0; iThread < numOfThreadsDouble; iThread++)
+void ThreadingMsiProc::setSpectrum(int threadSlot, int row, double *spectrum)
+{
+  ioObj->setSpectrum(cubes[threadSlot], row, spectrum);
+}
+
+void ThreadingMsiProc::ReaderLoop()
+{
+  std::unique_lock<std::mutex> lock(poolMutex);
+  while(true)
+  {
+    while( !bPoolStop && (bAbortRun || nextCubeLoad >= numCubesToLoad || freeSlots.empty() || 
+                          (bOrderedStore && nextCubeLoad >= nextCubeStore + 2*numOfThreadsDouble)) )
     {
-      if(iCube[iThread] != -1 && !bRunningThread[iThread] && !bDataReady[iThread] && 2*runningThreads < numOfThreadsDouble)
+      bool bStalled = !bAbortRun && nextCubeLoad < numCubesToLoad; //Pending cubes but no free slot (or too far ahead of the store)
+      std::chrono::steady_clock::time_point waitStart = std::chrono::steady_clock::now();
+      slotFree_cond.wait(lock);
+      if(bStalled)
       {
-        bRunningThread[iThread] = true;
-        tworkers[iThread] = std::thread(std::bind(&ThreadingMsiProc::ProcessingThread, this, iThread)); //Start Thread 
-        runningThreads++;
-      }      
+        pipelineStats.readerStall += std::chrono::duration<double>(std::chrono::steady_clock::now() - waitStart).count();
+      }
     }
-
-    //Save data and free thread slots
-    for(int iThread = 0; iThread < numOfThreadsDouble; iThread++)
+    if(bPoolStop)
     {
-      if(bDataReady[iThread] && 
-          ((nextCubeStore == iCube[iThread]) ||
-          (dataStoreMode == DataCubeIOMode::DATA_READ) ||
-          (dataStoreMode == DataCubeIOMode::PEAKLIST_READ) || 
-          (dataStoreMode == DataCubeIOMode::DATA_AND_PEAKLIST_READ) ) ) 
-      {
-        //If destination imzML is set then store the data
-        if( (dataStoreMode == DataCubeIOMode::DATA_STORE) || (dataStoreMode == DataCubeIOMode::PEAKLIST_STORE) )
-        {
-#ifdef __DEBUG__
-          Rcpp::Rcout << "DBG: Storing cube = " << cubes[iThread]->cubeID << " on thread " << iThread << "\n";
-#endif
-          ioObj->storeDataCube(cubes[iThread]);
-          nextCubeStore++;
-          
-#ifdef __DEBUG__
-          Rcpp::Rcout << "DBG: Storeing completed\n";
-#endif
-        }
-        
-#ifdef __DEBUG__
-        Rcpp::Rcout << "DBG: Frree cube = " << cubes[iThread]->cubeID << " on thread " << iThread << "\n";
-#endif
-        ioObj->freeDataCube(cubes[iThread]);
-        iCube[iThread] = -1; //Mark thread as stopped
-        bDataReady[iThread] = false; //Reset data ready state;
-#ifdef __DEBUG__
-        Rcpp::Rcout << "DBG: Free completed, joning thread...\n";
-#endif
-        tworkers[iThread].join();
+      return;
+    }
+    
+    int iSlot = freeSlots.back();
+    freeSlots.pop_back();
+    iCube[iSlot] = nextCubeLoad++;
+    bReaderBusy = true;
+    lock.unlock();
+    
 #ifdef __DEBUG__
-        Rcpp::Rcout << "DBG: Join completed\n";
+    Rcpp::Rcout << "DBG: Reader loading cube = " << iCube[iSlot] << " on slot " << iSlot << "\n";
 #endif
-      } 
+    try
+    {
+      cubes[iSlot] = ioObj->loadDataCube(iCube[iSlot], cubes[iSlot]);
     }
-
-#ifdef __DEBUG__
-    Rcpp::Rcout <<"\nDBG Thread report:\n"; 
-    for(int iThread = 0; iThread < numOfThreadsDouble; iThread++)
+    catch(...)
     {
-      Rcpp::Rcout <<"Thread "<< iThread <<" : iCube = " << iCube[iThread] << " : running = " << bRunningThread[iThread] << " : dataReady = " << bDataReady[iThread]<<"\n";
+      threadException[iSlot] = std::current_exception(); //Exceptions can not cross the thread boundary, the main thread will re-throw it
     }
-    Rcpp::Rcout <<"\n\n\n";
-#endif
     
-    //Check end condition
-    if( nextCubeLoad >= ioObj->getNumberOfCubes() )
+    lock.lock();
+    bReaderBusy = false;
+    if(threadException[iSlot])
+    {
+      readySlots.push_back(iSlot); //Skip the processing
+      cubeReady_cond.notify_one();
+    }
+    else
     {
-      end_of_program = true;
-      for(int iThread = 0; iThread < numOfThreadsDouble; iThread++)
+      pipelineStats.cubesRead++;
+      pipelineStats.readRanges += cubes[iSlot]->readRanges;
+      pipelineStats.fileReads += cubes[iSlot]->fileReads;
+      pipelineStats.fileReadBytes += cubes[iSlot]->fileReadBytes;
+      pipelineStats.mappedBytes += cubes[iSlot]->mappedBytes;
+      workQueues[iCube[iSlot] % workQueues.size()].push_back(iSlot);
+      numLoadedSlots++;
+      pipelineStats.loadedDepthMax = std::max(pipelineStats.loadedDepthMax, numLoadedSlots);
+    }
+    if(nextCubeLoad >= numCubesToLoad)
+    {
+      workAvailable_cond.notify_all(); //Nothing left to read, so waiting workers are no longer stalled by the reader
+    }
+    else
+    {
+      workAvailable_cond.notify_one();
+    }
+  }
+}
+
+int ThreadingMsiProc::TakeNextCube( int workerID )
+{
+  int iQueue = -1;
+  if( !workQueues[workerID].empty() )
+  {
+    iQueue = workerID; //The own queue has the priority
+  }
+  else
+  {
+    //Steal the lowest loaded cube from the other workers
+    for(unsigned int i = 0; i < workQueues.size(); i++)
+    {
+      if( !workQueues[i].empty() && (iQueue == -1 || iCube[workQueues[i].front()] < iCube[workQueues[iQueue].front()]) )
       {
-        end_of_program &= (iCube[iThread] == -1);
+        iQueue = i;
       }
     }
-    mtx.unlock();
+    if(iQueue == -1)
+    {
+      return -1;
+    }
+    pipelineStats.cubesStolen++;
   }
-#ifdef __DEBUG__
-  Rcpp::Rcout << "DBG: MT proc END\n";
-#endif
-  Rcpp::Rcout<<"\n";
+  
+  pipelineStats.loadedDepthSum += numLoadedSlots;
+  pipelineStats.loadedSamples++;
+  int iSlot = workQueues[iQueue].front();
+  workQueues[iQueue].pop_front();
+  numLoadedSlots--;
+  return iSlot;
 }
 
-void ThreadingMsiProc::ProcessingThread( int threadSlot )
+void ThreadingMsiProc::WorkerLoop( int workerID )
 {
-  ioObj->interpolateDataCube(cubes[threadSlot]); 
-  
-  //Call the processing function for this thread
-  ProcessingFunction(threadSlot);
-  
-  //Save data to R Session and Store the new state of total processed cubes
-  mtx.lock();
-  bDataReady[threadSlot] = true;
-  bRunningThread[threadSlot] = false;
-  mtx.unlock();
-  
-  //Notify Main thread
-  std::unique_lock<std::mutex> lock(life_end_mutex);
-  if(!life_end) //Notify only if it haven been done already by another thread
+  std::unique_lock<std::mutex> lock(poolMutex);
+  while(true)
   {
-    life_end = true;
-    life_end_cond.notify_all();
+    int iSlot;
+    while( !bPoolStop && (iSlot = TakeNextCube(workerID)) == -1 )
+    {
+      bool bStalled = bReaderBusy || (!bAbortRun && nextCubeLoad < numCubesToLoad); //Cubes are pending but still not loaded
+      std::chrono::steady_clock::time_point waitStart = std::chrono::steady_clock::now();
+      workAvailable_cond.wait(lock);
+      if(bStalled)
+      {
+        pipelineStats.workersStall += std::chrono::duration<double>(std::chrono::steady_clock::now() - waitStart).count();
+      }
+    }
+    if(bPoolStop)
+    {
+      return;
+    }
+    
+    bool bSkip = bAbortRun;
+    lock.unlock();
+    
+#ifdef __DEBUG__
+    Rcpp::Rcout << "DBG: Worker " << workerID << " started cube = " << iCube[iSlot] << " on slot " << iSlot << "\n";
+#endif
+    if(!bSkip)
+    {
+      std::chrono::steady_clock::time_point procStart = std::chrono::steady_clock::now();
+      ProcessingThread(iSlot);
+      cubeProcessingTime[iCube[iSlot]] = std::chrono::duration<double>(std::chrono::steady_clock::now() - procStart).count();
+    }
+    
+    lock.lock();
+    readySlots.push_back(iSlot);
+    cubeReady_cond.notify_one();
   }
 }
 
-void ThreadingMsiProc::WaitForSomeThreadEnd()
+void ThreadingMsiProc::ProcessingThread( int threadSlot )
 {
-  std::unique_lock<std::mutex> lock(life_end_mutex);
-  while (!life_end)
+  try
+  {
+    ioObj->interpolateDataCube(cubes[threadSlot]); 
+    
+    //Call the processing function for this thread
+    ProcessingFunction(threadSlot);
+    
+    if(bOrderedStore)
+    {
+      ioObj->writeDataCube(cubes[threadSlot], cubeSpectra[threadSlot]);
+    }
+  }
+  catch(...)
   {
-    life_end_cond.wait(lock);
+    threadException[threadSlot] = std::current_exception(); //Exceptions can not cross the thread boundary, the main thread will re-throw it
   }
-  life_end =false; //Reset it for the next thread
 }
 
 void ThreadingMsiProc::ProcessingFunction(int threadSlot)
@@ -23,8 +23,16 @@
 #include <thread>
 #include <mutex>
 #include <condition_variable>
+#include <exception>
+#include <deque>
+#include <vector>
 #include "rmsicdatacubeio.h"
 
+//The cubes are processed in a pipeline of three stages connected by slot queues:
+// - A reader thread loads the cubes in order into the free data slots.
+// - The worker threads interpolate and process the loaded cubes. In the store modes each worker also writes its processed cube
+//   at the ibd offsets reserved for it, so the cubes are written concurrently instead of through a single writer thread.
+// - The main thread accumulates the average and base spectra in cube order, releases the slots and reports the progress.
 class ThreadingMsiProc
 {
   public:
@@ -34,8 +42,10 @@ class ThreadingMsiProc
     // numberOfThreads: Total number of threads to use during processing
     // memoryPerThreadMB: Maximum memory allocated by each thread in MB. The total allocated memory will be: 2*numberOfThreads*memoryPerThreadMB
     // commonMassAxis: The common mass axis used to process and interpolate multiple datasets.
+    // float32DataCubes: Keep the interpolated spectra as float32 in memory, doubling the spectra per cube for the same memoryPerThreadMB.
     ThreadingMsiProc(Rcpp::List rMSIObj_list, int numberOfThreads, double memoryPerThreadMB, Rcpp::NumericVector commonMassAxis,
-                     DataCubeIOMode storeDataModeimzml = DataCubeIOMode::DATA_READ, Rcpp::StringVector uuid = Rcpp::StringVector(), Rcpp::String outputImzMLPath = "", Rcpp::StringVector outputImzMLfnames = Rcpp::StringVector());
+                     DataCubeIOMode storeDataModeimzml = DataCubeIOMode::DATA_READ, Rcpp::StringVector uuid = Rcpp::StringVector(), Rcpp::String outputImzMLPath = "", Rcpp::StringVector outputImzMLfnames = Rcpp::StringVector(),
+                     bool float32DataCubes = false);
     ~ThreadingMsiProc();
     
   protected:
@@ -45,8 +55,16 @@ class ThreadingMsiProc
     //Function to control threaded execution
     void runMSIProcessingCpp();
     
-    int *iCube; //This vector will porvide which cube ID is processing each thread
-    CrMSIDataCubeIO::DataCube **cubes; //Array of data cubes pointer, the length of this array will be the number of processing threads.
+    //Returns the interpolated spectrum at a row of the cube loaded in a slot.
+    //With float32 data cubes the row is converted to double in a buffer of the slot, so it is valid until the next call from the same slot.
+    //The smoothing, alignment, noise estimation and peak picking kernels work on this double spectrum since they run on the double FFTW plans.
+    double *getSpectrum(int threadSlot, int row);
+    
+    //Stores back a spectrum obtained with getSpectrum() that has been modified in place
+    void setSpectrum(int threadSlot, int row, double *spectrum);
+    
+    int *iCube; //This vector will porvide which cube ID is processed on each data slot
+    CrMSIDataCubeIO::DataCube **cubes; //Array of data cubes pointer, the length of this array will be the number of data slots (numOfThreadsDouble).
     CrMSIDataCubeIO *ioObj; //Data access object must be a pointer since I don't know the params befor the constructor
     int numOfThreadsDouble; //The double of used number of threads
     int numPixels; //Total number of pixels in the dataset
@@ -54,22 +72,70 @@ class ThreadingMsiProc
     DataCubeIOMode dataStoreMode;  //It is protected to be accesed from fill peaks
     
   private:  
-    //The function to be executed for each thread. 
+    //The function to be executed for each loaded cube in a data slot. 
+    //The cube is interpolated and processed by the worker thread.
     //Data will be accessed from each thread using in-class member data and the index provided as threadSlot parameter.
     void ProcessingThread( int threadSlot );
     
-    //Function to suspend main thread execution until some thread ends.
-    void WaitForSomeThreadEnd();
+    //Main loop of the reader thread. It loads the cubes in order into the free slots ahead of the workers,
+    //so disk reading overlaps the processing. The read-ahead is bounded by the number of data slots and, in the ordered store modes,
+    //to 2*numOfThreadsDouble cubes after nextCubeStore, which also bounds the cubes staged by the writer while a slow cube is processed.
+    void ReaderLoop();
+    
+    //Main loop of each persistent worker thread of the pool. A worker processes the loaded cubes of its own queue and steals from the others when it is empty.
+    void WorkerLoop( int workerID );
+    
+    //Pops the slot of the next loaded cube for a worker: the front of its own queue or, if it is empty, the lowest front of the other queues.
+    //Since the queues are in cube order, the lowest loaded cube is always at a front and an idle worker takes it, so cubes never wait for a busy worker.
+    //Returns -1 if no loaded cube is available. It must be called with poolMutex locked.
+    int TakeNextCube( int workerID );
+    
+    //Start the reader and worker threads if they are not running yet. They will live until the object is destroyed.
+    void StartThreadPool();
+    
+    //Time spent waiting by each stage and depth of the queues between them during a run
+    typedef struct PipelineStats
+    {
+      double readerStall = 0.0; //Seconds the reader waited for a free slot with cubes pending to load
+      double workersStall = 0.0; //Seconds the workers waited for a loaded cube, summed over all workers
+      double writerStall = 0.0; //Seconds the main thread waited for a processed cube to release
+      unsigned long loadedDepthSum = 0; //Loaded cubes in all the queues accumulated each time a worker takes a cube
+      unsigned long loadedSamples = 0;
+      unsigned int loadedDepthMax = 0;
+      unsigned long readyDepthSum = 0; //Ready queue depth accumulated each time the main thread takes a cube
+      unsigned long readySamples = 0;
+      unsigned int readyDepthMax = 0;
+      unsigned long cubesStolen = 0; //Cubes taken from the queue of another worker
+      unsigned long cubesRead = 0; //Read counters of the loaded cubes
+      unsigned long readRanges = 0;
+      unsigned long fileReads = 0;
+      double fileReadBytes = 0.0;
+      double mappedBytes = 0.0;
+    } PipelineStats;
     
-    std::mutex mtx; //Lock mechanism for signalling bDataReady vector
-    bool *bDataReady; //This vector will contain true when a worker thread completes a datacube processing
-    bool *bRunningThread; //Keep track if a thread is runnning for a data slot
+    std::exception_ptr *threadException; //Exception raised while processing a slot, it is re-thrown from the main thread once all running cubes end
     
-    //Condition variable to notify thread ends
-    std::condition_variable  life_end_cond;
-    std::mutex               life_end_mutex;
-    bool                       life_end;
-    std::thread *tworkers; //Thread objects
+    std::mutex poolMutex; //Lock mechanism for the work queues, the slot lists and the pool state
+    std::condition_variable workAvailable_cond; //Notifies workers about loaded cubes
+    std::condition_variable slotFree_cond; //Notifies the reader about released slots and new runs
+    std::condition_variable cubeReady_cond; //Notifies the main thread about processed cubes
+    std::vector<std::thread> poolWorkers; //Persistent thread objects
+    std::thread readerThread; //Persistent thread loading the cubes
+    std::vector<int> freeSlots; //Data slots available to load a cube
+    std::vector<std::deque<int>> workQueues; //Data slots with a loaded cube waiting for each worker, in cube order. The reader assigns the cubes round-robin
+    unsigned int numLoadedSlots; //Number of slots in all the work queues
+    std::vector<int> readySlots; //Data slots with a processed cube waiting to be stored and released by the main thread
+    int nextCubeStore; //Point to the next datacube whose spectra must be accumulated, the reader does not load cubes far ahead of it
+    int nextCubeLoad; //Point to the next datacube to load
+    int numCubesToLoad; //Number of cubes in the current run, zero when no run is active
+    bool bAbortRun; //Set after an error to stop loading and skip the processing of the cubes already loaded
+    bool bReaderBusy; //True while the reader is loading a cube
+    PipelineStats pipelineStats; //Stats of the current run, protected by poolMutex
+    std::vector<double> cubeProcessingTime; //Seconds spent interpolating and processing each cube in the current run
+    bool bOrderedStore; //True in DATA_STORE or PEAKLIST_STORE modes, the workers write the processed cubes at offsets reserved in cube order
+    std::vector<std::vector<CrMSIDataCubeIO::CubeSpectra>> cubeSpectra; //Sum and max spectra of the cube written from each slot
+    bool bPoolStop; //Set to true to end the worker threads
+    std::vector<std::vector<double>> spectrumBuffers; //A double spectrum for each slot used to process float32 data cubes
     
 };
   